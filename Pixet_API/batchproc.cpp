@@ -0,0 +1,876 @@
+/**
+ * @file      batchproc.cpp
+ *
+ * Parallel batch reprocessing of a campaign of run files (tpx3batch).
+ *
+ * The run files found in the given files/directories are split into
+ * chunks (RunFile) and every chunk is one task on a work-stealing thread
+ * pool: read, unwrap, sort and shot segmentation. The chunk task then
+ * fills the ToF spectrum and spawns clustering tasks for groups of its
+ * shots onto its own deque, idle workers steal them. The last of them
+ * hands the chunk to the file's exporter, which writes the chunks of a
+ * file in order and merges the file's ToF spectrum.
+ *
+ * Memory is bounded by the chunk size and the number of chunks in flight
+ * (read but not exported yet), 2 per worker by default. New chunks are
+ * started only when a chunk has been exported, across files, so the
+ * workers move on to the next file while the last chunks of the previous
+ * one are still being clustered.
+ *
+ * Outputs per run file the event list <name>_events.t3ev (EventFileWriter,
+ * fed with the clusters as the chunks are exported) and <name>_tof.txt,
+ * plus campaign_tof.txt. With --csv also <name>_centroided.csv
+ * (Shot,X,Y,ToA,ToT like the centroiding notebook). With --coinc the
+ * exporters also count the clusters of every chunk into a campaign wide
+ * CoincidenceMap on the same pool, saved as campaign_coincidence.npy and
+ * campaign_covariance.npy.
+ *
+ * With --cache the products of every chunk (prepared pixels, clusters,
+ * ToF spectrum) are kept in a content addressed cache (ChunkCache). A
+ * re-run with other cluster parameters only clusters again, a re-run of
+ * an interrupted job reads only the chunks it did not finish.
+ *
+ */
+#include "pxcapi.h"
+#include "tpx3proc.h"
+#include "runfile.h"
+#include "workpool.h"
+#include "chunkcache.h"
+#include "coincmap.h"
+#include "eventfile.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#define BATCH_SHOT_GROUP_HITS   65536   // pixels per clustering task
+
+struct BatchParams
+{
+    ClusterParams cluster;
+    u64 chunkHits;
+    unsigned threads;
+    unsigned inflightPerThread;
+    double shotRate;            // Hz, fixed shot grid when the LED is not used
+    bool useLed;
+    int ledX, ledY, ledRadius;  // LED trigger pixels, shots are found as bursts of LED hits
+    double ledMinTot;
+    double ledGap;              // ns, LED hits closer than this belong to one shot (1D DBSCAN eps)
+    double tofBin;
+    double tofRange;
+    unsigned coincBins;         // bins of the coincidence map over the ToF range, 0 = no map
+    unsigned width;             // detector matrix and operation mode the kernels are specialized for
+    unsigned height;
+    int opMode;
+    std::string outDir;
+    bool writeCsv;
+    std::string cacheDir;       // empty = no cache
+};
+
+struct ChunkResult;
+
+struct FileJob
+{
+    RunFile run;
+    std::string name;           // base name without the extension
+    unsigned nextChunk;         // next chunk to start
+    unsigned nextExport;        // next chunk to write
+    std::map<unsigned, ChunkResult*> done;
+    std::mutex mutex;
+    EventFileWriter events;
+    FILE* csv;                  // NULL = no CSV
+    std::unique_ptr<TofHistogram> tof;
+    u64 shotOffset;             // batches layout with LED shots: shots of the chunks exported so far
+    u64 clusters;
+    std::vector<Tpx3Cluster> coincClusters;   // the clusters of a chunk in one block, for the coincidence map
+    std::chrono::steady_clock::time_point start;
+    u64 key;                    // identity of the file for its checkpoint
+    std::vector<u64> inputKeys; // input keys of the chunks known from the checkpoint
+};
+
+struct ChunkResult
+{
+    FileJob* file;
+    unsigned index;
+    RunChunkData data;
+    std::vector<double> shotTimes;          // unwrapped ns (raw layout)
+    std::vector<unsigned> shotStarts;       // pixel index of every shot + end
+    std::vector<u32> shotIds;
+    bool localShots;                        // shot ids count from 0 in this chunk
+    u32 shotCount;
+    u64 hits;
+    u64 prepareKey;                         // key of the prepared product, 0 = not cached
+    bool clustersCached;
+    std::unique_ptr<TofHistogram> tof;
+    std::vector<ClusterBuffer> groupClusters;
+    std::atomic<unsigned> groupsLeft;
+};
+
+class BatchJob
+{
+public:
+    BatchJob(const BatchParams& params)
+        : mParams(params), mNextFile(0), mInflight(0), mFailed(0), mHits(0), mChunks(0), mPreparedReused(0), mClustersReused(0) {}
+
+    int run(const std::vector<std::string>& files);
+
+private:
+    void feed();
+    void processChunk(FileJob* file, unsigned index);
+    void readInput(ChunkResult* chunk);
+    void prepareChunk(ChunkResult* chunk);
+    void findShots(ChunkResult* chunk);
+    void clusterGroup(ChunkResult* chunk, unsigned group, unsigned firstShot, unsigned endShot);
+    void exportChunk(ChunkResult* chunk);
+    void finishFile(FileJob* file);
+
+    bool loadPrepared(ChunkResult* chunk);
+    void storePrepared(ChunkResult* chunk);
+    bool loadClusters(ChunkResult* chunk);
+    void storeClusters(ChunkResult* chunk);
+    bool loadTof(ChunkResult* chunk);
+    void storeTof(ChunkResult* chunk);
+    void initGroups(ChunkResult* chunk, unsigned groups);
+
+    BatchParams mParams;
+    WorkStealingPool mPool;
+    std::vector<std::string> mFiles;
+    std::vector<FileJob*> mJobs;
+    size_t mNextFile;
+    FileJob* mCurrent;
+    std::mutex mFeedMutex;
+    unsigned mInflight;
+    std::atomic<unsigned> mFailed;
+    std::atomic<u64> mHits;
+    std::mutex mTotalMutex;
+    std::unique_ptr<TofHistogram> mTotalTof;
+    std::unique_ptr<CoincidenceMap> mCoinc;
+    std::unique_ptr<PixelKernels> mKernels;
+    std::vector<std::unique_ptr<ShotClusterer> > mClusterers;  // one per worker
+    ClusterBlockPool mBlocks;
+    ChunkCache mCache;
+    u64 mPrepareParams;         // hashes of the stage parameters
+    u64 mClusterParams;
+    u64 mTofParams;
+    std::atomic<unsigned> mChunks;
+    std::atomic<unsigned> mPreparedReused;
+    std::atomic<unsigned> mClustersReused;
+};
+
+// Identity of a run file for its checkpoint: the chunks are the same as long as the file and the chunking are
+static u64 runFileKey(const std::string& path, const FileJob* job, u64 chunkHits)
+{
+    CacheBuffer b;
+    struct stat st;
+    if (!stat(path.c_str(), &st)) {
+        b.put((u64)st.st_size);
+        b.put((i64)st.st_mtime);
+    }
+    b.put(chunkHits);
+    b.put(job->run.hitCount());
+    b.put(job->run.chunkCount());
+    return b.hash(hashBytes(job->name.data(), job->name.size()));
+}
+
+static u64 hashInput(const RunChunkData& data)
+{
+    u64 h = hashBytes(data.pixels.empty() ? NULL : &data.pixels[0], data.pixels.size() * sizeof(Tpx3Pixel), CHUNKCACHE_VERSION);
+    h = hashCombine(h, hashBytes(data.shots.empty() ? NULL : &data.shots[0], data.shots.size() * sizeof(u32)));
+    h = hashCombine(h, hashBytes(&data.batchTime, sizeof(data.batchTime)));
+    return hashCombine(h, data.shotRelative ? 1 : 0);
+}
+
+// ##########################################################################################33
+//                                     SCHEDULING
+// ##########################################################################################33
+
+void BatchJob::feed()
+{
+    std::lock_guard<std::mutex> lock(mFeedMutex);
+    unsigned limit = mPool.threadCount() * mParams.inflightPerThread;
+    while (mInflight < limit) {
+        if (!mCurrent || mCurrent->nextChunk >= mCurrent->run.chunkCount()) {
+            // open the next file, only the metadata is read here
+            mCurrent = NULL;
+            while (!mCurrent && mNextFile < mFiles.size()) {
+                const std::string& path = mFiles[mNextFile++];
+                FileJob* job = new FileJob();
+                if (job->run.open(path.c_str(), mParams.chunkHits, mParams.width) || !job->run.chunkCount()) {
+                    printf("Skipping %s\n", path.c_str());
+                    mFailed++;
+                    delete job;
+                    continue;
+                }
+                size_t slash = path.find_last_of("/\\");
+                job->name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+                job->name = job->name.substr(0, job->name.find_last_of('.'));
+                job->nextChunk = 0;
+                job->nextExport = 0;
+                job->shotOffset = 0;
+                job->clusters = 0;
+                job->tof.reset(new TofHistogram(mParams.tofBin, mParams.tofRange));
+                job->start = std::chrono::steady_clock::now();
+                job->csv = NULL;
+                std::string eventsName = mParams.outDir + PATH_SEPAR_STR + job->name + "_events.t3ev";
+                std::string csvName = mParams.outDir + PATH_SEPAR_STR + job->name + "_centroided.csv";
+                if (job->events.open(eventsName.c_str()) || (mParams.writeCsv && !(job->csv = fopen(csvName.c_str(), "w")))) {
+                    printf("Cannot create the outputs of %s\n", job->name.c_str());
+                    mFailed++;
+                    delete job;
+                    continue;
+                }
+                if (job->csv)
+                    fprintf(job->csv, "# Shot,X,Y,ToA,ToT\n");
+                job->key = runFileKey(path, job, mParams.chunkHits);
+                mCache.loadCheckpoint(job->key, job->inputKeys);
+                mJobs.push_back(job);
+                mCurrent = job;
+            }
+            if (!mCurrent)
+                return;
+        }
+        FileJob* file = mCurrent;
+        unsigned index = file->nextChunk++;
+        mInflight++;
+        mPool.submit([this, file, index] { processChunk(file, index); });
+    }
+}
+
+int BatchJob::run(const std::vector<std::string>& files)
+{
+    mFiles = files;
+    mCurrent = NULL;
+    mTotalTof.reset(new TofHistogram(mParams.tofBin, mParams.tofRange));
+    // the kernels are picked once for the whole campaign
+    unsigned chips = PXMAX(mParams.width * mParams.height / (TPX3_CHIP_WIDTH * TPX3_CHIP_HEIGHT), 1u);
+    mKernels.reset(createPixelKernels(mParams.width, mParams.height, chips, mParams.opMode));
+    if (!mKernels)
+        return PXCERR_INVALID_ARGUMENT;
+    if (!mParams.cacheDir.empty() && mCache.open(mParams.cacheDir.c_str()))
+        return PXCERR_INVALID_ARGUMENT;
+
+    // every stage parameter that changes a product goes into its key
+    CacheBuffer prepare, cluster, tof;
+    prepare.put(mParams.shotRate);
+    prepare.put(mParams.useLed);
+    prepare.put(mParams.ledX);
+    prepare.put(mParams.ledY);
+    prepare.put(mParams.ledRadius);
+    prepare.put(mParams.ledMinTot);
+    prepare.put(mParams.ledGap);
+    prepare.put(mParams.width);
+    prepare.put(mParams.height);
+    prepare.put(mParams.opMode);
+    cluster.put(mParams.cluster.timeWindow);
+    cluster.put(mParams.cluster.minToa);
+    cluster.put(mParams.cluster.maxToa);
+    cluster.put(mParams.cluster.minSize);
+    cluster.put(mParams.cluster.maxSize);
+    cluster.put(mParams.width);
+    cluster.put(mParams.height);
+    cluster.put(mParams.opMode);
+    tof.put(mParams.tofBin);
+    tof.put(mParams.tofRange);
+    mPrepareParams = prepare.hash(CHUNKCACHE_VERSION);
+    mClusterParams = cluster.hash(CHUNKCACHE_VERSION);
+    mTofParams = tof.hash(CHUNKCACHE_VERSION);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    mPool.start(mParams.threads);
+    for (unsigned i = 0; i < mPool.threadCount(); i++)
+        mClusterers.push_back(std::unique_ptr<ShotClusterer>(mKernels->createClusterer(mParams.cluster)));
+    // counted by the exporting workers, each in its own partial map
+    if (mParams.coincBins)
+        mCoinc.reset(new CoincidenceMap(0, mParams.tofRange, mParams.coincBins, mPool));
+    printf("Processing %u files on %u threads\n", (unsigned)files.size(), mPool.threadCount());
+    feed();
+    mPool.wait();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::string totalName = mParams.outDir + PATH_SEPAR_STR + "campaign_tof.txt";
+    FILE* f = fopen(totalName.c_str(), "w");
+    if (f) {
+        const std::vector<u64>& bins = mTotalTof->bins();
+        for (size_t i = 0; i < bins.size(); i++)
+            fprintf(f, "%.4f %llu\n", i * mParams.tofBin, bins[i]);
+        fclose(f);
+    }
+    if (mCoinc) {
+        std::string coincName = mParams.outDir + PATH_SEPAR_STR + "campaign_coincidence.npy";
+        std::string covName = mParams.outDir + PATH_SEPAR_STR + "campaign_covariance.npy";
+        if (mCoinc->saveNpy(coincName.c_str(), covName.c_str()))
+            printf("Cannot write the coincidence maps\n");
+        printf("Coincidence map: %llu shots, %u x %u bins\n", mCoinc->shots(), mCoinc->binCount(), mCoinc->binCount());
+        mCoinc.reset();
+    }
+    printf("Done: %llu hits in %.1f s (%.2f Mhits/s), %llu tasks, %llu steals, %u files failed\n", mHits.load(),
+           seconds, seconds > 0 ? mHits.load() / seconds / 1e6 : 0, mPool.tasksRun(), mPool.steals(), mFailed.load());
+    printf("Cluster blocks: %llu of %u clusters\n", (u64)mBlocks.allocated(), TPX3_CLUSTER_BLOCK);
+    if (mCache.isOpen())
+        printf("Cache: %u chunks, %u prepared and %u clustered from the cache, %llu objects stored (%.1f MB)\n",
+               mChunks.load(), mPreparedReused.load(), mClustersReused.load(), mCache.stored(), mCache.bytesStored() / 1e6);
+    mPool.stop();
+    for (size_t i = 0; i < mJobs.size(); i++)
+        delete mJobs[i];
+    mJobs.clear();
+    return mFailed ? PXCERR_UNEXPECTED_ERROR : 0;
+}
+
+// ##########################################################################################33
+//                                      STAGES
+// ##########################################################################################33
+
+void BatchJob::processChunk(FileJob* file, unsigned index)
+{
+    ChunkResult* chunk = new ChunkResult();
+    chunk->file = file;
+    chunk->index = index;
+    chunk->shotCount = 0;
+    chunk->hits = 0;
+    chunk->prepareKey = 0;
+    chunk->clustersCached = false;
+    chunk->localShots = false;
+    chunk->groupsLeft = 0;
+    mChunks++;
+
+    bool read = false;
+    bool prepared = false;
+    bool tofCached = false;
+    if (mCache.isOpen()) {
+        // the input key is in the checkpoint when an earlier run hashed the chunk, it is not read then
+        u64 inputKey = index < file->inputKeys.size() ? file->inputKeys[index] : 0;
+        if (!inputKey) {
+            readInput(chunk);
+            read = true;
+            inputKey = hashInput(chunk->data);
+            if (chunk->hits)
+                mCache.saveCheckpoint(file->key, index, inputKey);
+        }
+        // batches layout: the unwrapping and the fixed shot grid are anchored to the start of the run
+        double anchor[2] = { file->run.firstToa(), file->run.expectedToa(file->run.chunkTime(index)) };
+        chunk->prepareKey = hashCombine(hashCombine(inputKey, mPrepareParams), hashBytes(anchor, sizeof(anchor)));
+        if (read && !chunk->hits)
+            chunk->prepareKey = 0;
+        chunk->clustersCached = chunk->prepareKey && loadClusters(chunk);
+        tofCached = chunk->prepareKey && loadTof(chunk);
+        if (chunk->clustersCached && tofCached) {
+            mClustersReused++;
+            exportChunk(chunk);
+            return;
+        }
+        prepared = chunk->prepareKey && loadPrepared(chunk);
+        if (prepared)
+            mPreparedReused++;
+    }
+    if (!prepared) {
+        if (!read) {
+            readInput(chunk);
+            read = true;
+        }
+        // a chunk that could not be read must not replace its cached products
+        if (read && !chunk->hits)
+            chunk->prepareKey = 0;
+        prepareChunk(chunk);
+        storePrepared(chunk);
+    }
+    std::vector<Tpx3Pixel>& pixels = chunk->data.pixels;
+
+    // ToF spectrum of the pixels assigned to shots
+    if (!tofCached) {
+        chunk->tof.reset(new TofHistogram(mParams.tofBin, mParams.tofRange));
+        unsigned first = chunk->shotStarts[0];
+        if (chunk->shotStarts.back() > first)
+            chunk->tof->fill(&pixels[first], chunk->shotStarts.back() - first);
+        storeTof(chunk);
+    }
+    if (chunk->clustersCached) {
+        mClustersReused++;
+        exportChunk(chunk);
+        return;
+    }
+
+    // clustering tasks for groups of shots, on this worker's deque for the others to steal
+    std::vector<std::pair<unsigned, unsigned> > groups;
+    for (unsigned s = 0; s < chunk->shotCount;) {
+        unsigned e = s + 1;
+        while (e < chunk->shotCount && chunk->shotStarts[e + 1] - chunk->shotStarts[s] < BATCH_SHOT_GROUP_HITS)
+            e++;
+        groups.push_back(std::make_pair(s, e));
+        s = e;
+    }
+    if (groups.empty()) {
+        storeClusters(chunk);
+        exportChunk(chunk);
+        return;
+    }
+    initGroups(chunk, (unsigned)groups.size());
+    chunk->groupsLeft = (unsigned)groups.size();
+    for (unsigned g = 1; g < groups.size(); g++) {
+        unsigned first = groups[g].first, end = groups[g].second;
+        mPool.submit([this, chunk, g, first, end] { clusterGroup(chunk, g, first, end); });
+    }
+    clusterGroup(chunk, 0, groups[0].first, groups[0].second);
+}
+
+void BatchJob::readInput(ChunkResult* chunk)
+{
+    if (chunk->file->run.readChunk(chunk->index, chunk->data)) {
+        printf("%s: cannot read chunk %u\n", chunk->file->name.c_str(), chunk->index);
+        chunk->data.pixels.clear();
+        chunk->data.shots.clear();
+    }
+    chunk->hits = chunk->data.pixels.size();
+}
+
+void BatchJob::prepareChunk(ChunkResult* chunk)
+{
+    std::vector<Tpx3Pixel>& pixels = chunk->data.pixels;
+    unsigned count = (unsigned)pixels.size();
+    std::vector<Tpx3Pixel> scratch;
+    chunk->shotTimes.clear();
+    chunk->shotStarts.clear();
+    chunk->shotIds.clear();
+    chunk->localShots = false;
+
+    if (chunk->data.shotRelative) {
+        // events layout: the shots are given, each one is sorted on its own
+        const std::vector<u32>& shots = chunk->data.shots;
+        for (unsigned i = 0; i < count;) {
+            unsigned end = i + 1;
+            while (end < count && shots[end] == shots[i])
+                end++;
+            chunk->shotStarts.push_back(i);
+            chunk->shotIds.push_back(shots[i]);
+            sortPixelsByToa(&pixels[i], end - i, scratch);
+            i = end;
+        }
+        chunk->shotStarts.push_back(count);
+    } else if (count) {
+        ToaUnwrapper unwrapper;
+        unwrapper.setReference(chunk->file->run.expectedToa(chunk->data.batchTime));
+        unwrapper.unwrap(&pixels[0], count);
+        sortPixelsByToa(&pixels[0], count, scratch);
+        findShots(chunk);
+        // pixels before the first shot of the chunk belong to a shot of the previous chunk and are dropped,
+        // as in the per-batch processing of the acquisition
+        segmentShots(&pixels[0], count, chunk->shotTimes.empty() ? NULL : &chunk->shotTimes[0],
+                     (unsigned)chunk->shotTimes.size(), chunk->shotStarts);
+        for (size_t s = 0; s < chunk->shotTimes.size(); s++)
+            for (unsigned i = chunk->shotStarts[s]; i < chunk->shotStarts[s + 1]; i++)
+                pixels[i].toa -= chunk->shotTimes[s];
+    }
+    if (chunk->shotStarts.empty())
+        chunk->shotStarts.push_back(0);
+    chunk->shotCount = (u32)chunk->shotIds.size();
+    std::vector<u32>().swap(chunk->data.shots);
+}
+
+void BatchJob::findShots(ChunkResult* chunk)
+{
+    const std::vector<Tpx3Pixel>& pixels = chunk->data.pixels;
+    unsigned count = (unsigned)pixels.size();
+    double period = 1e9 / mParams.shotRate;
+
+    if (!mParams.useLed) {
+        // fixed shot grid from the first pixel of the run, shot numbers are global
+        double t0 = chunk->file->run.firstToa();
+        double first = ceil((pixels[0].toa - t0) / period);
+        for (double k = PXMAX(first, 0.0); t0 + k * period <= pixels[count - 1].toa; k++) {
+            chunk->shotTimes.push_back(t0 + k * period);
+            chunk->shotIds.push_back((u32)k);
+        }
+        return;
+    }
+
+    // LED hits of the chunk, bursts of at least 2 hits separated by more than ledGap are shots,
+    // the first hit of the burst is the shot time
+    chunk->localShots = true;
+    std::vector<unsigned> led;
+    mKernels->selectRect(&pixels[0], count, PXMAX(mParams.ledX - mParams.ledRadius, 0), PXMAX(mParams.ledY - mParams.ledRadius, 0),
+                         mParams.ledX + mParams.ledRadius, mParams.ledY + mParams.ledRadius, (float)mParams.ledMinTot, led);
+    double burstStart = 0, last = 0;
+    unsigned burstHits = 0;
+    for (size_t k = 0; k <= led.size(); k++) {
+        bool end = k == led.size();
+        double toa = end ? 0 : pixels[led[k]].toa;
+        if (end || toa - last > mParams.ledGap) {
+            if (burstHits >= 2) {
+                chunk->shotIds.push_back((u32)chunk->shotTimes.size());
+                chunk->shotTimes.push_back(burstStart);
+            }
+            burstStart = toa;
+            burstHits = 0;
+        }
+        last = toa;
+        burstHits++;
+    }
+}
+
+void BatchJob::clusterGroup(ChunkResult* chunk, unsigned group, unsigned firstShot, unsigned endShot)
+{
+    // the clusterer of the worker keeps its scratch from group to group
+    int worker = mPool.workerIndex();
+    std::unique_ptr<ShotClusterer> local;
+    ShotClusterer* clusterer = worker >= 0 ? mClusterers[worker].get() : NULL;
+    if (!clusterer) {
+        local.reset(mKernels->createClusterer(mParams.cluster));
+        clusterer = local.get();
+    }
+    ClusterBuffer& out = chunk->groupClusters[group];
+    const Tpx3Pixel* pixels = chunk->data.pixels.empty() ? NULL : &chunk->data.pixels[0];
+    for (unsigned s = firstShot; s < endShot; s++) {
+        unsigned first = chunk->shotStarts[s];
+        unsigned n = chunk->shotStarts[s + 1] - first;
+        if (!n)
+            continue;
+        clusterer->clusterShot(pixels + first, n, chunk->shotIds[s], out);
+    }
+    if (--chunk->groupsLeft == 0) {
+        storeClusters(chunk);
+        exportChunk(chunk);
+    }
+}
+
+void BatchJob::exportChunk(ChunkResult* chunk)
+{
+    // the pixels are not needed any more, free them before waiting for the earlier chunks
+    std::vector<Tpx3Pixel>().swap(chunk->data.pixels);
+    std::vector<u32>().swap(chunk->data.shots);
+    mHits += chunk->hits;
+
+    FileJob* file = chunk->file;
+    unsigned exported = 0;
+    bool finished = false;
+    {
+        std::lock_guard<std::mutex> lock(file->mutex);
+        file->done[chunk->index] = chunk;
+        std::map<unsigned, ChunkResult*>::iterator it;
+        while ((it = file->done.find(file->nextExport)) != file->done.end()) {
+            ChunkResult* c = it->second;
+            u64 offset = c->localShots ? file->shotOffset : 0;
+            for (size_t g = 0; g < c->groupClusters.size(); g++) {
+                const ClusterBuffer& clusters = c->groupClusters[g];
+                for (unsigned b = 0; b < clusters.blockCount(); b++) {
+                    const Tpx3Cluster* block = clusters.block(b);
+                    unsigned n = clusters.blockSize(b);
+                    file->events.write(block, n, offset);
+                    for (unsigned k = 0; file->csv && k < n; k++) {
+                        const Tpx3Cluster& cl = block[k];
+                        fprintf(file->csv, "%llu,%d,%d,%.4f,%.0f\n", cl.shot + offset, (int)(cl.x + 0.5f), (int)(cl.y + 0.5f),
+                                cl.toa, cl.tot);
+                    }
+                }
+                file->clusters += clusters.size();
+            }
+            if (mCoinc) {
+                // a shot can span two blocks of a buffer, the map gets the chunk in one piece
+                file->coincClusters.clear();
+                for (size_t g = 0; g < c->groupClusters.size(); g++) {
+                    const ClusterBuffer& clusters = c->groupClusters[g];
+                    for (unsigned b = 0; b < clusters.blockCount(); b++)
+                        file->coincClusters.insert(file->coincClusters.end(), clusters.block(b), clusters.block(b) + clusters.blockSize(b));
+                }
+                mCoinc->addShots(file->coincClusters.empty() ? NULL : &file->coincClusters[0], file->coincClusters.size(),
+                                 c->shotCount);
+            }
+            if (c->tof)
+                file->tof->merge(*c->tof);
+            if (c->localShots)
+                file->shotOffset += c->shotCount;
+            file->done.erase(it);
+            delete c;
+            file->nextExport++;
+            exported++;
+        }
+        finished = file->nextExport == file->run.chunkCount();
+    }
+    if (finished)
+        finishFile(file);
+    if (exported) {
+        {
+            std::lock_guard<std::mutex> lock(mFeedMutex);
+            mInflight -= exported;
+        }
+        feed();
+    }
+}
+
+void BatchJob::finishFile(FileJob* file)
+{
+    if (file->events.close())
+        mFailed++;
+    if (file->csv)
+        fclose(file->csv);
+    file->csv = NULL;
+    std::string tofName = mParams.outDir + PATH_SEPAR_STR + file->name + "_tof.txt";
+    FILE* f = fopen(tofName.c_str(), "w");
+    if (f) {
+        const std::vector<u64>& bins = file->tof->bins();
+        for (size_t i = 0; i < bins.size(); i++)
+            fprintf(f, "%.4f %llu\n", i * mParams.tofBin, bins[i]);
+        fclose(f);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mTotalMutex);
+        mTotalTof->merge(*file->tof);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - file->start).count();
+    printf("%s: %llu hits, %u chunks, %llu clusters, %.1f s\n", file->name.c_str(), file->run.hitCount(),
+           file->run.chunkCount(), file->clusters, seconds);
+    file->run.close();
+    file->tof.reset();
+}
+
+// ##########################################################################################33
+//                                       CACHE
+// ##########################################################################################33
+
+bool BatchJob::loadPrepared(ChunkResult* chunk)
+{
+    CacheBuffer b;
+    u32 localShots;
+    if (!mCache.load(chunk->prepareKey, "prep", b))
+        return false;
+    if (!b.get(localShots) || !b.getArray(chunk->data.pixels) || !b.getArray(chunk->shotStarts) ||
+        !b.getArray(chunk->shotIds) || chunk->shotStarts.size() != chunk->shotIds.size() + 1)
+        return false;
+    chunk->localShots = localShots != 0;
+    chunk->shotCount = (u32)chunk->shotIds.size();
+    chunk->hits = chunk->data.pixels.size();
+    return true;
+}
+
+void BatchJob::storePrepared(ChunkResult* chunk)
+{
+    if (!mCache.isOpen() || !chunk->prepareKey)
+        return;
+    CacheBuffer b;
+    b.put((u32)chunk->localShots);
+    b.putArray(chunk->data.pixels);
+    b.putArray(chunk->shotStarts);
+    b.putArray(chunk->shotIds);
+    if (mCache.store(chunk->prepareKey, "prep", b))
+        printf("%s: cannot cache chunk %u\n", chunk->file->name.c_str(), chunk->index);
+}
+
+bool BatchJob::loadClusters(ChunkResult* chunk)
+{
+    CacheBuffer b;
+    u32 localShots, groups;
+    if (!mCache.load(hashCombine(chunk->prepareKey, mClusterParams), "clus", b))
+        return false;
+    if (!b.get(chunk->hits) || !b.get(chunk->shotCount) || !b.get(localShots) || !b.get(groups))
+        return false;
+    initGroups(chunk, groups);
+    for (u32 g = 0; g < groups; g++) {
+        // same layout as CacheBuffer::putArray
+        u64 n;
+        bool ok = b.get(n);
+        Tpx3Cluster c;
+        for (u64 k = 0; ok && k < n; k++) {
+            ok = b.get(c);
+            chunk->groupClusters[g].push_back(c);
+        }
+        if (!ok) {
+            chunk->groupClusters.clear();
+            return false;
+        }
+    }
+    chunk->localShots = localShots != 0;
+    return true;
+}
+
+void BatchJob::initGroups(ChunkResult* chunk, unsigned groups)
+{
+    chunk->groupClusters.clear();
+    chunk->groupClusters.reserve(groups);
+    for (unsigned g = 0; g < groups; g++)
+        chunk->groupClusters.push_back(ClusterBuffer(&mBlocks));
+}
+
+void BatchJob::storeClusters(ChunkResult* chunk)
+{
+    if (!mCache.isOpen() || !chunk->prepareKey)
+        return;
+    CacheBuffer b;
+    b.put(chunk->hits);
+    b.put(chunk->shotCount);
+    b.put((u32)chunk->localShots);
+    b.put((u32)chunk->groupClusters.size());
+    for (size_t g = 0; g < chunk->groupClusters.size(); g++) {
+        const ClusterBuffer& clusters = chunk->groupClusters[g];
+        b.put((u64)clusters.size());
+        for (unsigned k = 0; k < clusters.blockCount(); k++)
+            b.putBytes(clusters.block(k), clusters.blockSize(k) * sizeof(Tpx3Cluster));
+    }
+    mCache.store(hashCombine(chunk->prepareKey, mClusterParams), "clus", b);
+}
+
+bool BatchJob::loadTof(ChunkResult* chunk)
+{
+    CacheBuffer b;
+    if (!mCache.load(hashCombine(chunk->prepareKey, mTofParams), "tof", b))
+        return false;
+    chunk->tof.reset(new TofHistogram(mParams.tofBin, mParams.tofRange));
+    size_t binCount = chunk->tof->bins().size();
+    if (!b.getArray(chunk->tof->bins()) || chunk->tof->bins().size() != binCount) {
+        chunk->tof.reset();
+        return false;
+    }
+    return true;
+}
+
+void BatchJob::storeTof(ChunkResult* chunk)
+{
+    if (!mCache.isOpen() || !chunk->prepareKey)
+        return;
+    CacheBuffer b;
+    b.putArray(chunk->tof->bins());
+    mCache.store(hashCombine(chunk->prepareKey, mTofParams), "tof", b);
+}
+
+// ##########################################################################################33
+//                                        MAIN
+// ##########################################################################################33
+
+static void printUsage()
+{
+    printf("Usage: tpx3batch [options] <run file or directory>...\n"
+           "  --out DIR           output directory (default .)\n"
+           "  --threads N         worker threads (default all cores)\n"
+           "  --chunk-hits N      pixels per chunk (default 4000000)\n"
+           "  --inflight N        chunks in flight per worker, bounds the memory (default 2)\n"
+           "  --csv               also write <name>_centroided.csv\n"
+           "  --cache DIR         keep the chunk products and checkpoints in DIR, re-runs and\n"
+           "                      resumed runs recompute only what changed\n"
+           "  --time-win NS       cluster time window (default 250)\n"
+           "  --min-t NS          seed ToA window after the shot (default 0)\n"
+           "  --max-t NS          (default 100000)\n"
+           "  --min-size N        cluster size limits (default 1)\n"
+           "  --max-size N        (default 40)\n"
+           "  --shot-rate F       shot rate for the fixed shot grid [Hz] (default 100)\n"
+           "  --led X,Y,R         find the shots from the LED pixels around X,Y instead\n"
+           "  --led-tot T         min ToT of LED hits (default 20)\n"
+           "  --matrix WxH        detector matrix (default 256x256, 512x512 = quad)\n"
+           "  --mode M            operation mode toatot, toa or tot (default toatot)\n"
+           "  --tof-bin NS        ToF spectrum bin (default 1.5625)\n"
+           "  --tof-range NS      ToF spectrum range (default 100000)\n"
+           "  --coinc N           also write the coincidence and covariance maps of N x N bins\n"
+           "                      over the ToF range\n");
+}
+
+int main(int argc, char const* argv[])
+{
+    BatchParams params;
+    params.cluster.timeWindow = 10 * 25;
+    params.cluster.minToa = 0;
+    params.cluster.maxToa = 100000;
+    params.cluster.minSize = 1;
+    params.cluster.maxSize = 40;
+    params.chunkHits = 4000000;
+    params.threads = 0;
+    params.inflightPerThread = 2;
+    params.shotRate = 100;
+    params.useLed = false;
+    params.ledX = params.ledY = params.ledRadius = 0;
+    params.ledMinTot = 20;
+    params.ledGap = 10000;
+    params.tofBin = 1.5625;
+    params.tofRange = 100000;
+    params.coincBins = 0;
+    params.width = TPX3_CHIP_WIDTH;
+    params.height = TPX3_CHIP_HEIGHT;
+    params.opMode = PXC_TPX3_OPM_TOATOT;
+    params.outDir = ".";
+    params.writeCsv = false;
+
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--help" || arg == "-h") {
+            printUsage();
+            return 0;
+        } else if (arg.compare(0, 2, "--") != 0) {
+            if (discoverRunFiles(arg.c_str(), files))
+                printf("Cannot find %s\n", arg.c_str());
+            continue;
+        } else if (arg == "--out") {
+            params.outDir = value;
+        } else if (arg == "--csv") {
+            params.writeCsv = true;
+            continue;
+        } else if (arg == "--cache") {
+            params.cacheDir = value;
+        } else if (arg == "--threads") {
+            params.threads = (unsigned)atoi(value);
+        } else if (arg == "--chunk-hits") {
+            params.chunkHits = (u64)atof(value);
+        } else if (arg == "--inflight") {
+            params.inflightPerThread = PXMAX(atoi(value), 1);
+        } else if (arg == "--time-win") {
+            params.cluster.timeWindow = atof(value);
+        } else if (arg == "--min-t") {
+            params.cluster.minToa = atof(value);
+        } else if (arg == "--max-t") {
+            params.cluster.maxToa = atof(value);
+        } else if (arg == "--min-size") {
+            params.cluster.minSize = (unsigned)atoi(value);
+        } else if (arg == "--max-size") {
+            params.cluster.maxSize = (unsigned)atoi(value);
+        } else if (arg == "--shot-rate") {
+            params.shotRate = atof(value);
+        } else if (arg == "--led") {
+            params.useLed = sscanf(value, "%d,%d,%d", &params.ledX, &params.ledY, &params.ledRadius) == 3;
+            if (!params.useLed) {
+                printUsage();
+                return 2;
+            }
+        } else if (arg == "--led-tot") {
+            params.ledMinTot = atof(value);
+        } else if (arg == "--matrix") {
+            if (sscanf(value, "%ux%u", &params.width, &params.height) != 2 || !params.width || !params.height) {
+                printUsage();
+                return 2;
+            }
+        } else if (arg == "--mode") {
+            std::string mode = value;
+            if (mode == "toatot")
+                params.opMode = PXC_TPX3_OPM_TOATOT;
+            else if (mode == "toa")
+                params.opMode = PXC_TPX3_OPM_TOA;
+            else if (mode == "tot")
+                params.opMode = PXC_TPX3_OPM_TOT_NOTOA;
+            else {
+                printUsage();
+                return 2;
+            }
+        } else if (arg == "--tof-bin") {
+            params.tofBin = atof(value);
+        } else if (arg == "--tof-range") {
+            params.tofRange = atof(value);
+        } else if (arg == "--coinc") {
+            params.coincBins = (unsigned)atoi(value);
+        } else {
+            printf("Invalid argument %s\n", arg.c_str());
+            printUsage();
+            return 2;
+        }
+        i++;
+    }
+    if (files.empty() || params.shotRate <= 0 || params.tofBin <= 0) {
+        printUsage();
+        return 2;
+    }
+
+    BatchJob job(params);
+    return job.run(files) ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+/**
+ * @file      chunkcache.cpp
+ *
+ * Content addressed cache of processing products.
+ *
+ */
+#include "chunkcache.h"
+#include <chrono>
+#include <cstdio>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <direct.h>
+#endif
+
+#define HASH_PRIME1     0x9e3779b185ebca87ULL
+#define HASH_PRIME2     0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3     0x165667b19e3779f9ULL
+
+#define CACHE_MAGIC     0x43435850u     // "PXCC"
+
+// ##########################################################################################33
+//                                      HASHING
+// ##########################################################################################33
+
+static inline u64 rotl64(u64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 mix64(u64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+u64 hashBytes(const void* data, size_t size, u64 seed)
+{
+    // four independent lanes of multiply-rotate rounds (as xxHash64), then the tail byte by byte
+    const byte* p = (const byte*)data;
+    u64 lanes[4] = { seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            u64 w;
+            memcpy(&w, p + i + 8 * k, 8);
+            lanes[k] = rotl64(lanes[k] + w * HASH_PRIME2, 31) * HASH_PRIME1;
+        }
+    }
+    u64 h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    h += (u64)size * HASH_PRIME3;
+    for (; i < size; i++)
+        h = rotl64(h ^ (p[i] * HASH_PRIME3), 11) * HASH_PRIME1;
+    return mix64(h);
+}
+
+u64 hashCombine(u64 a, u64 b)
+{
+    return mix64(a ^ (b + HASH_PRIME1 + (a << 6) + (a >> 2)));
+}
+
+// ##########################################################################################33
+//                                       CACHE
+// ##########################################################################################33
+
+struct CacheHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u64 size;
+    u64 hash;
+};
+
+ChunkCache::ChunkCache()
+    : mTempCounter(0)
+    , mLoaded(0)
+    , mStored(0)
+    , mBytesStored(0)
+{
+}
+
+int ChunkCache::open(const char* dir)
+{
+    struct stat st;
+    if (stat(dir, &st)) {
+#ifdef WIN32
+        int rc = _mkdir(dir);
+#else
+        int rc = mkdir(dir, 0755);
+#endif
+        if (rc) {
+            printf("Cannot create the cache directory %s\n", dir);
+            return PXCERR_COULD_NOT_SAVE;
+        }
+    } else if (!S_ISDIR(st.st_mode)) {
+        printf("%s is not a directory\n", dir);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    mDir = dir;
+    return 0;
+}
+
+std::string ChunkCache::objectPath(u64 key, const char* stage) const
+{
+    char name[64];
+    sprintf(name, "%016llx.%s", key, stage);
+    return mDir + PATH_SEPAR_STR + name;
+}
+
+bool ChunkCache::load(u64 key, const char* stage, CacheBuffer& buffer)
+{
+    if (!isOpen())
+        return false;
+    FILE* f = fopen(objectPath(key, stage).c_str(), "rb");
+    if (!f)
+        return false;
+    // a damaged header must not size the buffer, the data has to be in the file
+    struct stat st;
+    CacheHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == CACHE_MAGIC &&
+              header.version == CHUNKCACHE_VERSION && header.key == key &&
+              fstat(fileno(f), &st) == 0 && header.size == (u64)st.st_size - sizeof(header);
+    std::vector<byte>& data = buffer.data();
+    if (ok) {
+        data.resize((size_t)header.size);
+        ok = !header.size || fread(&data[0], 1, data.size(), f) == data.size();
+    }
+    fclose(f);
+    if (!ok || buffer.hash() != header.hash) {
+        printf("Cache object %016llx.%s is damaged, recomputing\n", key, stage);
+        data.clear();
+        return false;
+    }
+    buffer.rewind();
+    mLoaded++;
+    return true;
+}
+
+int ChunkCache::store(u64 key, const char* stage, const CacheBuffer& buffer)
+{
+    if (!isOpen())
+        return 0;
+    std::string path = objectPath(key, stage);
+    char suffix[64];
+    sprintf(suffix, ".%llx.%llu.tmp", (u64)std::chrono::steady_clock::now().time_since_epoch().count(), mTempCounter++);
+    std::string temp = path + suffix;
+
+    const std::vector<byte>& data = buffer.data();
+    CacheHeader header;
+    header.magic = CACHE_MAGIC;
+    header.version = CHUNKCACHE_VERSION;
+    header.key = key;
+    header.size = data.size();
+    header.hash = buffer.hash();
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f)
+        return PXCERR_COULD_NOT_SAVE;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && (data.empty() || fwrite(&data[0], 1, data.size(), f) == data.size());
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        remove(temp.c_str());
+        return PXCERR_COULD_NOT_SAVE;
+    }
+    // an object with this key has the same content, when another writer was faster its copy is kept
+    if (rename(temp.c_str(), path.c_str()))
+        remove(temp.c_str());
+    mStored++;
+    mBytesStored += sizeof(header) + data.size();
+    return 0;
+}
+
+// ##########################################################################################33
+//                                    CHECKPOINTS
+// ##########################################################################################33
+
+void ChunkCache::loadCheckpoint(u64 fileKey, std::vector<u64>& inputKeys)
+{
+    if (!isOpen())
+        return;
+    char name[64];
+    sprintf(name, "%016llx.ckpt", fileKey);
+    FILE* f = fopen((mDir + PATH_SEPAR_STR + name).c_str(), "r");
+    if (!f)
+        return;
+    // one line per chunk, a line cut by an interrupted job is not complete and is ignored
+    unsigned chunk;
+    u64 key;
+    char end;
+    while (fscanf(f, "%u %llx%c", &chunk, &key, &end) == 3 && end == '\n') {
+        if (chunk >= inputKeys.size())
+            inputKeys.resize(chunk + 1, 0);
+        inputKeys[chunk] = key;
+    }
+    fclose(f);
+}
+
+int ChunkCache::saveCheckpoint(u64 fileKey, unsigned chunk, u64 inputKey)
+{
+    if (!isOpen())
+        return 0;
+    char name[64];
+    sprintf(name, "%016llx.ckpt", fileKey);
+    std::lock_guard<std::mutex> lock(mCheckpointMutex);
+    FILE* f = fopen((mDir + PATH_SEPAR_STR + name).c_str(), "a");
+    if (!f)
+        return PXCERR_COULD_NOT_SAVE;
+    fprintf(f, "%u %016llx\n", chunk, inputKey);
+    return fclose(f) ? PXCERR_COULD_NOT_SAVE : 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file      chunkcache.h
+ *
+ * Content addressed cache of the intermediate products of the offline
+ * processing and checkpoints of the run files being processed.
+ *
+ * A product is stored under a 64 bit key derived from the hash of its
+ * input and the parameters of the stage that made it, a product of a later
+ * stage is keyed by the key of the earlier one:
+ *
+ *     input    = hash(chunk data)
+ *     prepared = combine(input, unwrap/shot parameters)
+ *     clusters = combine(prepared, cluster parameters)
+ *
+ * Changing a parameter changes the keys of its stage and of the stages
+ * after it only, a re-run recomputes just those and reuses the rest.
+ *
+ * The checkpoint of a run file lists the input keys of its chunks hashed
+ * so far. It is identified by the size, modification time and chunking of
+ * the file, so a resumed or repeated job derives the keys of the finished
+ * chunks without reading them again.
+ *
+ * Objects are written to a temporary file and renamed, an interrupted job
+ * never leaves a partial object behind; a damaged object fails its hash
+ * and is recomputed.
+ *
+ */
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+#include "pxcapi.h"
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define CHUNKCACHE_VERSION  1       // bump when a product changes its meaning or layout
+
+u64 hashBytes(const void* data, size_t size, u64 seed = 0);
+u64 hashCombine(u64 a, u64 b);
+
+// Binary record of a product, native byte order (the cache is local to the machine)
+class CacheBuffer
+{
+public:
+    CacheBuffer() : mPos(0) {}
+
+    template <typename T> void put(const T& value)
+    {
+        append(&value, sizeof(T));
+    }
+
+    // Raw bytes, the reader takes them apart with get
+    void putBytes(const void* data, size_t size)
+    {
+        append(data, size);
+    }
+
+    template <typename T> void putArray(const std::vector<T>& values)
+    {
+        put((u64)values.size());
+        if (!values.empty())
+            append(&values[0], values.size() * sizeof(T));
+    }
+
+    template <typename T> bool get(T& value)
+    {
+        return take(&value, sizeof(T));
+    }
+
+    template <typename T> bool getArray(std::vector<T>& values)
+    {
+        u64 n;
+        if (!get(n) || n > (mData.size() - mPos) / sizeof(T))
+            return false;
+        values.resize((size_t)n);
+        return !n || take(&values[0], (size_t)n * sizeof(T));
+    }
+
+    u64 hash(u64 seed = 0) const { return hashBytes(mData.empty() ? NULL : &mData[0], mData.size(), seed); }
+    std::vector<byte>& data() { return mData; }
+    const std::vector<byte>& data() const { return mData; }
+    void rewind() { mPos = 0; }
+
+private:
+    void append(const void* data, size_t size)
+    {
+        const byte* p = (const byte*)data;
+        mData.insert(mData.end(), p, p + size);
+    }
+
+    bool take(void* data, size_t size)
+    {
+        if (mData.size() - mPos < size)
+            return false;
+        memcpy(data, &mData[mPos], size);
+        mPos += size;
+        return true;
+    }
+
+    std::vector<byte> mData;
+    size_t mPos;
+};
+
+class ChunkCache
+{
+public:
+    ChunkCache();
+
+    // Uses the directory dir for the objects and checkpoints, it is created when missing
+    int open(const char* dir);
+    bool isOpen() const { return !mDir.empty(); }
+
+    // Loads the product stage of key, false when it is not cached or is damaged
+    bool load(u64 key, const char* stage, CacheBuffer& buffer);
+    // Stores the product stage of key, can be called from several threads
+    int store(u64 key, const char* stage, const CacheBuffer& buffer);
+
+    // Input keys of the chunks of the run file fileKey recorded so far, 0 = not known
+    void loadCheckpoint(u64 fileKey, std::vector<u64>& inputKeys);
+    // Records the input key of a chunk
+    int saveCheckpoint(u64 fileKey, unsigned chunk, u64 inputKey);
+
+    u64 loaded() const { return mLoaded; }
+    u64 stored() const { return mStored; }
+    u64 bytesStored() const { return mBytesStored; }
+
+private:
+    std::string objectPath(u64 key, const char* stage) const;
+
+    std::string mDir;
+    std::mutex mCheckpointMutex;
+    std::atomic<u64> mTempCounter;
+    std::atomic<u64> mLoaded;
+    std::atomic<u64> mStored;
+    std::atomic<u64> mBytesStored;
+};
+
+#endif /* end of include guard: CHUNKCACHE_H */
@@ -0,0 +1,261 @@
+/**
+ * @file      coincmap.cpp
+ *
+ * Per-shot ion coincidence and covariance maps.
+ *
+ */
+#include "coincmap.h"
+#include <algorithm>
+#include <cstring>
+
+CoincidenceMap::CoincidenceMap(double tofMin, double tofMax, unsigned binCount, unsigned threadCount)
+    : mTofMin(tofMin)
+    , mBinWidth((tofMax - tofMin) / PXMAX(binCount, 1u))
+    , mInvBinWidth(1.0 / mBinWidth)
+    , mBinCount(PXMAX(binCount, 1u))
+    , mPool(NULL)
+    , mPairs((size_t)mBinCount * (mBinCount + 1) / 2, 0)
+    , mSpectrum(mBinCount, 0)
+    , mShots(0)
+{
+    if (threadCount != 1) {
+        mOwnPool.start(threadCount);
+        mPool = &mOwnPool;
+    }
+    init(mPool ? mPool->threadCount() : 1);
+}
+
+CoincidenceMap::CoincidenceMap(double tofMin, double tofMax, unsigned binCount, WorkStealingPool& pool)
+    : mTofMin(tofMin)
+    , mBinWidth((tofMax - tofMin) / PXMAX(binCount, 1u))
+    , mInvBinWidth(1.0 / mBinWidth)
+    , mBinCount(PXMAX(binCount, 1u))
+    , mPool(&pool)
+    , mPairs((size_t)mBinCount * (mBinCount + 1) / 2, 0)
+    , mSpectrum(mBinCount, 0)
+    , mShots(0)
+{
+    init(PXMAX(pool.threadCount(), 1u));
+}
+
+void CoincidenceMap::init(unsigned partialCount)
+{
+    mPartials.resize(partialCount);
+    for (size_t i = 0; i < mPartials.size(); i++) {
+        mPartials[i].pairs.assign(mPairs.size(), 0);
+        mPartials[i].spectrum.assign(mBinCount, 0);
+        mPartials[i].pairCount = 0;
+    }
+}
+
+void CoincidenceMap::clear()
+{
+    for (size_t i = 0; i < mPartials.size(); i++) {
+        std::fill(mPartials[i].pairs.begin(), mPartials[i].pairs.end(), 0);
+        std::fill(mPartials[i].spectrum.begin(), mPartials[i].spectrum.end(), 0);
+        mPartials[i].pairCount = 0;
+    }
+    std::fill(mPairs.begin(), mPairs.end(), 0);
+    std::fill(mSpectrum.begin(), mSpectrum.end(), 0);
+    mShots = 0;
+}
+
+// ##########################################################################################33
+//                                    ACCUMULATION
+// ##########################################################################################33
+
+u64 CoincidenceMap::accumulate(Partial& partial, const Tpx3Cluster* clusters, size_t count)
+{
+    u32* map = &partial.pairs[0];
+    std::vector<u32>& bins = partial.bins;
+    size_t n = mBinCount;
+    size_t start = 0;
+    u64 shots = 0;
+    while (start < count) {
+        u32 shot = clusters[start].shot;
+        size_t end = start + 1;
+        while (end < count && clusters[end].shot == shot)
+            end++;
+
+        bins.clear();
+        for (size_t i = start; i < end; i++) {
+            double pos = (clusters[i].toa - mTofMin) * mInvBinWidth;
+            if (pos >= 0 && pos < n)
+                bins.push_back((u32)pos);
+        }
+        std::sort(bins.begin(), bins.end());
+
+        // all pairs a < b, bins sorted so every pair lands in the upper triangle
+        size_t m = bins.size();
+        for (size_t a = 0; a < m; a++) {
+            u32* row = map + triangleRow(bins[a]);
+            partial.spectrum[bins[a]]++;
+            for (size_t b = a + 1; b < m; b++)
+                row[bins[b]]++;
+        }
+        partial.pairCount += m * (m - 1) / 2;
+        shots++;
+        if (partial.pairCount > COINCMAP_FLUSH_PAIRS)
+            flush(partial);
+        start = end;
+    }
+    return shots;
+}
+
+void CoincidenceMap::flush(Partial& partial)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t size = partial.pairs.size();
+    u32* src = &partial.pairs[0];
+    u64* dst = &mPairs[0];
+    for (size_t i = 0; i < size; i++)
+        dst[i] += src[i];
+    memset(src, 0, size * sizeof(u32));
+    for (size_t i = 0; i < mBinCount; i++)
+        mSpectrum[i] += partial.spectrum[i];
+    std::fill(partial.spectrum.begin(), partial.spectrum.end(), 0);
+    partial.pairCount = 0;
+}
+
+void CoincidenceMap::flushAll()
+{
+    for (size_t i = 0; i < mPartials.size(); i++)
+        flush(mPartials[i]);
+}
+
+void CoincidenceMap::addShots(const Tpx3Cluster* clusters, size_t count, u64 shotCount)
+{
+    if (shotCount)
+        mShots += shotCount;
+    if (!count)
+        return;
+
+    // a worker of the pool counts the block itself, a worker runs one task at a time and owns its partial
+    size_t threads = PXMIN(mPartials.size(), count);
+    if (!mPool || mPool->workerIndex() >= 0) {
+        u64 shots = accumulate(workerPartial(), clusters, count);
+        if (!shotCount)
+            mShots += shots;
+        return;
+    }
+
+    // split at shot boundaries, a shot is never shared by two workers
+    size_t begin = 0;
+    for (size_t t = 1; t <= threads; t++) {
+        size_t end = t == threads ? count : PXMAX(count * t / threads, begin);
+        while (end > begin && end < count && clusters[end].shot == clusters[end - 1].shot)
+            end++;
+        if (end > begin) {
+            const Tpx3Cluster* first = clusters + begin;
+            size_t n = end - begin;
+            mPool->submit([this, first, n, shotCount] {
+                u64 shots = accumulate(workerPartial(), first, n);
+                if (!shotCount)
+                    mShots += shots;
+            });
+        }
+        begin = end;
+    }
+    mPool->wait();
+}
+
+int CoincidenceMap::merge(CoincidenceMap& other)
+{
+    if (other.mBinCount != mBinCount || other.mBinWidth != mBinWidth || other.mTofMin != mTofMin)
+        return PXCERR_INVALID_ARGUMENT;
+    other.flushAll();
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (size_t i = 0; i < mPairs.size(); i++)
+        mPairs[i] += other.mPairs[i];
+    for (size_t i = 0; i < mBinCount; i++)
+        mSpectrum[i] += other.mSpectrum[i];
+    mShots += other.mShots;
+    return 0;
+}
+
+// ##########################################################################################33
+//                                       RESULTS
+// ##########################################################################################33
+
+void CoincidenceMap::coincidences(std::vector<u64>& out)
+{
+    flushAll();
+    size_t n = mBinCount;
+    out.resize(n * n);
+    for (size_t i = 0; i < n; i++) {
+        const u64* row = &mPairs[triangleRow(i)];
+        for (size_t j = i; j < n; j++) {
+            out[i * n + j] = row[j];
+            out[j * n + i] = row[j];
+        }
+    }
+}
+
+void CoincidenceMap::spectrum(std::vector<u64>& out)
+{
+    flushAll();
+    out = mSpectrum;
+}
+
+void CoincidenceMap::covariance(std::vector<double>& out)
+{
+    flushAll();
+    size_t n = mBinCount;
+    out.assign(n * n, 0);
+    if (!mShots)
+        return;
+    double invShots = 1.0 / mShots;
+    std::vector<double> mean(n);
+    for (size_t i = 0; i < n; i++)
+        mean[i] = mSpectrum[i] * invShots;
+    for (size_t i = 0; i < n; i++) {
+        const u64* row = &mPairs[triangleRow(i)];
+        // <X_i^2> counts the ordered pairs within the bin and every event with itself
+        out[i * n + i] = (2.0 * row[i] + mSpectrum[i]) * invShots - mean[i] * mean[i];
+        for (size_t j = i + 1; j < n; j++) {
+            double cov = row[j] * invShots - mean[i] * mean[j];
+            out[i * n + j] = cov;
+            out[j * n + i] = cov;
+        }
+    }
+}
+
+// Writes a 2D C-order array as .npy (format version 1.0)
+static int writeNpy(const char* fileName, const char* dtype, const void* data, size_t itemSize, unsigned rows, unsigned cols)
+{
+    FILE* f = fopen(fileName, "wb");
+    if (!f)
+        return PXCERR_COULD_NOT_SAVE;
+    char header[128];
+    int len = sprintf(header, "{'descr': '%s', 'fortran_order': False, 'shape': (%u, %u), }", dtype, rows, cols);
+    // magic + version + header length + header padded with spaces to 64 bytes, ending with a newline
+    int total = 10 + len + 1;
+    int pad = (64 - total % 64) % 64;
+    unsigned short headerLen = (unsigned short)(len + pad + 1);
+    fwrite("\x93NUMPY\x01\x00", 1, 8, f);
+    fwrite(&headerLen, 2, 1, f);
+    fwrite(header, 1, len, f);
+    for (int i = 0; i < pad; i++)
+        fputc(' ', f);
+    fputc('\n', f);
+    size_t items = (size_t)rows * cols;
+    bool ok = fwrite(data, itemSize, items, f) == items;
+    fclose(f);
+    return ok ? 0 : PXCERR_COULD_NOT_SAVE;
+}
+
+int CoincidenceMap::saveNpy(const char* coincidenceFile, const char* covarianceFile)
+{
+    int rc = 0;
+    if (coincidenceFile) {
+        std::vector<u64> coinc;
+        coincidences(coinc);
+        rc = writeNpy(coincidenceFile, "<u8", &coinc[0], sizeof(u64), mBinCount, mBinCount);
+    }
+    if (!rc && covarianceFile) {
+        std::vector<double> cov;
+        covariance(cov);
+        rc = writeNpy(covarianceFile, "<f8", &cov[0], sizeof(double), mBinCount, mBinCount);
+    }
+    return rc;
+}
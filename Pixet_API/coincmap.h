@@ -0,0 +1,103 @@
+/**
+ * @file      coincmap.h
+ *
+ * Per-shot ion coincidence and covariance maps. For every shot all pairs
+ * of centroided events are binned by their two ToFs into a 2D map; the 1D
+ * ToF spectrum is accumulated alongside. The covariance map is
+ *
+ *     cov(i, j) = <X_i X_j> - <X_i> <X_j>
+ *
+ * with X_i the number of events in ToF bin i of a shot and the averages
+ * taken over all shots, i.e. the coincidences with the mean-product
+ * (false coincidence) term subtracted.
+ *
+ * Shots are processed in parallel on the workers of a WorkStealingPool
+ * (workpool.h), the map's own or one shared with the caller: a block of
+ * shots is split between the workers at shot boundaries, and a block
+ * added from a worker of the pool is counted by that worker. Every worker
+ * counts into its own partial map of 32 bit counters, which is flushed
+ * into the 64 bit total before it could overflow and when the results are
+ * read. The events of a shot are sorted by bin first, so every pair falls
+ * in the upper triangle (row <= column) and the pair loop walks each row
+ * forward; partials and totals store only that triangle, packed row by
+ * row, which halves their size.
+ *
+ * The results are read from the partials without locking them: when
+ * blocks are added from workers of a shared pool, wait() on the pool
+ * before calling coincidences(), covariance(), spectrum(), merge() or
+ * saveNpy(). addShots from outside the pool already waits.
+ *
+ */
+#ifndef COINCMAP_H
+#define COINCMAP_H
+#include "tpx3proc.h"
+#include "workpool.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define COINCMAP_FLUSH_PAIRS    0x7fffffffULL   // pairs in a partial map before it is flushed
+
+class CoincidenceMap
+{
+public:
+    // ToF range [tofMin, tofMax) ns split into binCount bins, counted on an own pool of threadCount
+    // threads kept for the life of the map (0 = number of cores, 1 = in the calling thread)
+    CoincidenceMap(double tofMin, double tofMax, unsigned binCount, unsigned threadCount = 0);
+    // Counted on the workers of a started pool that outlives the map
+    CoincidenceMap(double tofMin, double tofMax, unsigned binCount, WorkStealingPool& pool);
+
+    // Adds a block of clusters ordered by shot with ToA relative to the shot, a shot must not be split
+    // between two blocks. shotCount is the number of shots the block covers including the shots without
+    // any cluster, 0 = count the shots present. From outside the pool the block is split between the
+    // workers and the call waits for the pool to be idle; from a worker it is counted by that worker,
+    // blocks can then be added from several workers at once.
+    void addShots(const Tpx3Cluster* clusters, size_t count, u64 shotCount = 0);
+    // Adds the counts of another map with the same binning
+    int merge(CoincidenceMap& other);
+    void clear();
+
+    u64 shots() const { return mShots.load(); }
+    unsigned binCount() const { return mBinCount; }
+    double binWidth() const { return mBinWidth; }
+
+    // Full symmetric binCount x binCount maps, row major. No addShots may be running (see above).
+    void coincidences(std::vector<u64>& out);
+    void covariance(std::vector<double>& out);
+    void spectrum(std::vector<u64>& out);
+
+    // Saves the coincidence and covariance maps as numpy .npy files (NULL = skip)
+    int saveNpy(const char* coincidenceFile, const char* covarianceFile);
+
+private:
+    struct Partial
+    {
+        std::vector<u32> pairs;     // packed upper triangle, see triangleRow
+        std::vector<u64> spectrum;
+        std::vector<u32> bins;      // scratch, bins of the current shot
+        u64 pairCount;
+    };
+
+    void init(unsigned partialCount);
+    // Returns number of shots counted
+    u64 accumulate(Partial& partial, const Tpx3Cluster* clusters, size_t count);
+    Partial& workerPartial() { return mPartials[mPool ? PXMAX(mPool->workerIndex(), 0) : 0]; }
+    // Offset of row i in a packed upper triangle, element (i, j >= i) is at triangleRow(i) + j
+    size_t triangleRow(size_t i) const { return i * mBinCount - i * (i + 1) / 2; }
+    void flush(Partial& partial);
+    void flushAll();
+
+    double mTofMin;
+    double mBinWidth;
+    double mInvBinWidth;
+    unsigned mBinCount;
+    WorkStealingPool mOwnPool;
+    WorkStealingPool* mPool;        // NULL = in the calling thread
+    std::vector<Partial> mPartials; // one per worker
+    std::mutex mMutex;              // guards the totals during flushes
+    std::vector<u64> mPairs;        // packed upper triangle totals
+    std::vector<u64> mSpectrum;
+    std::atomic<u64> mShots;
+};
+
+#endif /* end of include guard: COINCMAP_H */
@@ -46,6 +46,9 @@ typedef u32 THREADID;
 #define PATH_SEPAR          '\\'
 #define PATH_SEPAR_STR      "\\"
 #define PATH_SEPAR_STRW      L"\\"
+#ifndef S_ISDIR
+#define S_ISDIR(mode)       (((mode) & _S_IFMT) == _S_IFDIR)    // not in the MSVC <sys/stat.h>
+#endif
 #else
 #include <stdint.h>
 typedef long THREADID;
@@ -0,0 +1,222 @@
+/**
+ * @file      ddtuner.cpp
+ *
+ * Adaptive sizing of the Timepix3 data driven buffers.
+ *
+ */
+#include "ddtuner.h"
+#include <cmath>
+#include <cstring>
+
+#define DDTUNER_MB              (1024.0 * 1024.0)
+#define DDTUNER_THROUGHPUT_TOL  0.95    // runs within 5 % of the best throughput count as equally fast
+
+DDBufferTuner::DDBufferTuner(unsigned deviceIndex, int opMode, unsigned readerHits, double targetLatency, double burstTime)
+    : mDeviceIndex(deviceIndex)
+    , mOpMode(opMode)
+    , mMaxBlockSize(DDTUNER_MAX_BLOCK_MB)
+    , mTargetLatency(targetLatency)
+    , mBurstTime(burstTime)
+    , mIntervalSum(0)
+    , mProcessingSum(0)
+{
+    if (readerHits)
+        mMaxBlockSize = PXMIN(PXMAX((int)((double)readerHits * DDTUNER_BYTES_PER_HIT / DDTUNER_MB), DDTUNER_MIN_BLOCK_MB),
+                              DDTUNER_MAX_BLOCK_MB);
+    // start from the SDK values if they can be read
+    int block = pxcGetDeviceParameter(deviceIndex, PAR_DDBLOCKSIZE);
+    int buff = pxcGetDeviceParameter(deviceIndex, PAR_DDBUFFSIZE);
+    setCurrent(block > 0 ? block : 10, buff > 0 ? buff : 500);
+    memset(&mRun, 0, sizeof(mRun));
+}
+
+void DDBufferTuner::setCurrent(int blockSize, int buffSize)
+{
+    mCurrent.blockSize = PXMIN(PXMAX(blockSize, DDTUNER_MIN_BLOCK_MB), mMaxBlockSize);
+    mCurrent.buffSize = PXMIN(PXMAX(buffSize, PXMAX(DDTUNER_MIN_BUFF_MB, 2 * mCurrent.blockSize)), DDTUNER_MAX_BUFF_MB);
+}
+
+int DDBufferTuner::apply()
+{
+    int rc = pxcSetDeviceParameter(mDeviceIndex, PAR_DDBLOCKSIZE, mCurrent.blockSize);
+    if (rc)
+        return rc;
+    return pxcSetDeviceParameter(mDeviceIndex, PAR_DDBUFFSIZE, mCurrent.buffSize);
+}
+
+std::string DDBufferTuner::deviceKey() const
+{
+    char chipID[256];
+    memset(chipID, 0, sizeof(chipID));
+    if (pxcGetDeviceChipID(mDeviceIndex, 0, chipID, sizeof(chipID)) || !chipID[0])
+        sprintf(chipID, "device%u", mDeviceIndex);
+    // chip IDs may contain spaces, the file is whitespace separated
+    for (char* c = chipID; *c; c++)
+        if (*c == ' ' || *c == '\t')
+            *c = '_';
+    return chipID;
+}
+
+int DDBufferTuner::load(const char* fileName)
+{
+    FILE* f = fopen(fileName, "r");
+    if (!f)
+        return PXCERR_INVALID_ARGUMENT;
+    std::string key = deviceKey();
+    char line[512];
+    char id[256];
+    int mode, block, buff;
+    int rc = PXCERR_INVALID_ARGUMENT;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%255s %d %d %d", id, &mode, &block, &buff) == 4 && key == id && mode == mOpMode) {
+            setCurrent(block, buff);
+            rc = 0;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+int DDBufferTuner::save(const char* fileName)
+{
+    // keep the entries of the other devices/modes
+    std::vector<std::string> lines;
+    std::string key = deviceKey();
+    FILE* f = fopen(fileName, "r");
+    if (f) {
+        char line[512];
+        char id[256];
+        int mode;
+        while (fgets(line, sizeof(line), f)) {
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%255s %d", id, &mode) == 2 && key == id && mode == mOpMode)
+                continue;
+            lines.push_back(line);
+        }
+        fclose(f);
+    }
+
+    f = fopen(fileName, "w");
+    if (!f)
+        return PXCERR_COULD_NOT_SAVE;
+    DDBufferSettings b = best();
+    fprintf(f, "# chipID opMode DDBlockSize[MB] DDBuffSize[MB]\n");
+    for (size_t i = 0; i < lines.size(); i++)
+        fputs(lines[i].c_str(), f);
+    fprintf(f, "%s %d %d %d\n", key.c_str(), mOpMode, b.blockSize, b.buffSize);
+    fclose(f);
+    return 0;
+}
+
+void DDBufferTuner::beginRun()
+{
+    memset(&mRun, 0, sizeof(mRun));
+    mRun.settings = mCurrent;
+    mIntervalSum = 0;
+    mProcessingSum = 0;
+    mRunStart = mLastCallback = Clock::now();
+}
+
+void DDBufferTuner::onCallback(unsigned pixelsReported, unsigned pixelsRead, double processingTime, bool readFailed)
+{
+    Clock::time_point now = Clock::now();
+    double interval = std::chrono::duration<double>(now - mLastCallback).count();
+    mLastCallback = now;
+
+    mRun.callbacks++;
+    mRun.pixels += pixelsRead;
+    if (readFailed)
+        mRun.callbacksFailed++;
+    else
+        mRun.pixelsLost += pixelsReported - PXMIN(pixelsRead, pixelsReported);
+    mIntervalSum += interval;
+    mProcessingSum += processingTime;
+    mRun.maxInterval = PXMAX(mRun.maxInterval, interval);
+    mRun.maxProcessing = PXMAX(mRun.maxProcessing, processingTime);
+    if (interval > 0)
+        mRun.peakHitRate = PXMAX(mRun.peakHitRate, pixelsReported / interval);
+}
+
+void DDBufferTuner::endRun(int measurementRc)
+{
+    mRun.duration = std::chrono::duration<double>(Clock::now() - mRunStart).count();
+    mRun.failed = measurementRc != 0;
+    if (mRun.callbacks) {
+        mRun.avgInterval = mIntervalSum / mRun.callbacks;
+        mRun.avgProcessing = mProcessingSum / mRun.callbacks;
+    }
+    if (mRun.duration > 0)
+        mRun.hitRate = (mRun.pixels + mRun.pixelsLost) / mRun.duration;
+    mResults.push_back(mRun);
+}
+
+int DDBufferTuner::roundPow2(double value, int minValue, int maxValue)
+{
+    int result = minValue;
+    while (result < value && result < maxValue)
+        result *= 2;
+    return PXMIN(result, maxValue);
+}
+
+bool DDBufferTuner::adapt()
+{
+    if (mResults.empty())
+        return false;
+    const DDRunResult& last = mResults.back();
+    DDBufferSettings next = mCurrent;
+
+    // block size: one callback per target latency at the average rate
+    double bytesPerSec = last.hitRate * DDTUNER_BYTES_PER_HIT;
+    next.blockSize = roundPow2(bytesPerSec * mTargetLatency / DDTUNER_MB, DDTUNER_MIN_BLOCK_MB, mMaxBlockSize);
+    // pixels cut off by the reader buffer: the blocks are too big, a bigger DDBuffSize does not help
+    if (last.pixelsLost)
+        next.blockSize = PXMIN(next.blockSize, PXMAX(last.settings.blockSize / 2, DDTUNER_MIN_BLOCK_MB));
+
+    // buffer: the peak rate for the burst time plus what piles up while the callback is busy
+    double peakBytes = last.peakHitRate * DDTUNER_BYTES_PER_HIT;
+    double backlog = last.maxProcessing > last.avgInterval ? peakBytes * (last.maxProcessing - last.avgInterval) : 0;
+    next.buffSize = roundPow2((peakBytes * mBurstTime + backlog) / DDTUNER_MB, DDTUNER_MIN_BUFF_MB, DDTUNER_MAX_BUFF_MB);
+
+    // an overflow means the buffer was too small whatever the estimate says
+    if (last.failed)
+        next.buffSize = PXMAX(next.buffSize, PXMIN(2 * last.settings.buffSize, DDTUNER_MAX_BUFF_MB));
+
+    bool changed = next.blockSize != mCurrent.blockSize || next.buffSize != mCurrent.buffSize;
+    setCurrent(next.blockSize, next.buffSize);
+    return changed;
+}
+
+DDBufferSettings DDBufferTuner::best() const
+{
+    double bestRate = 0;
+    for (size_t i = 0; i < mResults.size(); i++)
+        if (!mResults[i].failed && !mResults[i].pixelsLost && !mResults[i].callbacksFailed)
+            bestRate = PXMAX(bestRate, mResults[i].hitRate);
+
+    const DDRunResult* best = NULL;
+    for (size_t i = 0; i < mResults.size(); i++) {
+        const DDRunResult& r = mResults[i];
+        if (r.failed || r.pixelsLost || r.callbacksFailed || r.hitRate < bestRate * DDTUNER_THROUGHPUT_TOL)
+            continue;
+        if (!best || r.avgInterval < best->avgInterval)
+            best = &r;
+    }
+    return best ? best->settings : mCurrent;
+}
+
+void DDBufferTuner::printReport() const
+{
+    printf("%6s %6s %12s %12s %10s %10s %10s %10s %s\n", "Block", "Buff", "Rate[hit/s]", "Peak[hit/s]",
+           "Lat[ms]", "MaxLat[ms]", "Proc[ms]", "Lost", "");
+    DDBufferSettings b = best();
+    for (size_t i = 0; i < mResults.size(); i++) {
+        const DDRunResult& r = mResults[i];
+        bool isBest = r.settings.blockSize == b.blockSize && r.settings.buffSize == b.buffSize;
+        printf("%6d %6d %12.0f %12.0f %10.2f %10.2f %10.2f %10llu %s%s%s\n", r.settings.blockSize, r.settings.buffSize,
+               r.hitRate, r.peakHitRate, r.avgInterval * 1e3, r.maxInterval * 1e3, r.avgProcessing * 1e3,
+               r.pixelsLost, r.failed ? "FAILED " : "", r.callbacksFailed ? "READ ERRORS " : "", isBest ? "<- best" : "");
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file      ddtuner.h
+ *
+ * Adaptive sizing of the Timepix3 data driven buffers (DDBlockSize and
+ * DDBuffSize device parameters).
+ *
+ * The block size sets how much data the device collects before the new
+ * data callback fires: too big means high latency at low hit rates, too
+ * small means many callbacks at high rates. The buffer size has to absorb
+ * bursts (e.g. laser shots) while the consumer is busy. The tuner measures
+ * the hit rate, callback interval and callback processing time during a
+ * run and picks new sizes for the next one. The best settings found are
+ * persisted per device (chip ID) and operation mode in a text file.
+ *
+ * The callback reads the pixels into a buffer of its own, a block bigger
+ * than that buffer loses the rest of its pixels whatever DDBuffSize is.
+ * The block size is capped at the reader buffer and halved when a run
+ * lost pixels that way; only a failed measurement (buffer overflow)
+ * grows DDBuffSize beyond the estimate.
+ *
+ */
+#ifndef DDTUNER_H
+#define DDTUNER_H
+#include "pxcapi.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define PAR_DDBLOCKSIZE         "DDBlockSize"
+#define PAR_DDBUFFSIZE          "DDBuffSize"
+
+#define DDTUNER_BYTES_PER_HIT   8       // one 64 bit data driven packet per hit
+#define DDTUNER_MIN_BLOCK_MB    1
+#define DDTUNER_MAX_BLOCK_MB    64
+#define DDTUNER_MIN_BUFF_MB     16
+#define DDTUNER_MAX_BUFF_MB     2048
+
+typedef struct _DDBufferSettings
+{
+    int blockSize;  // MB
+    int buffSize;   // MB
+} DDBufferSettings;
+
+// Measured result of one run with given settings
+typedef struct _DDRunResult
+{
+    DDBufferSettings settings;
+    double duration;        // s
+    u64 callbacks;
+    u64 pixels;
+    u64 pixelsLost;         // pixels reported but not read (reader buffer smaller than the block)
+    u64 callbacksFailed;    // callbacks that could not read the pixels
+    double hitRate;         // average pixels/s
+    double peakHitRate;     // pixels/s within the busiest callback interval
+    double avgInterval;     // average time between callbacks (s) - the data latency
+    double maxInterval;
+    double avgProcessing;   // average time spent in the callback (s)
+    double maxProcessing;
+    bool failed;            // measurement returned an error (e.g. buffer overflow)
+} DDRunResult;
+
+class DDBufferTuner
+{
+public:
+    // readerHits - size of the buffer the callback reads the pixels into, caps the block size (0 = no cap)
+    // targetLatency - desired time between callbacks in seconds
+    // burstTime - how long (s) the buffer has to absorb the peak hit rate without the consumer
+    DDBufferTuner(unsigned deviceIndex, int opMode, unsigned readerHits = 0, double targetLatency = 0.1, double burstTime = 2.0);
+
+    // Loads the best settings stored for this device and mode, returns 0 if found
+    int load(const char* fileName);
+    // Stores the best settings found so far for this device and mode
+    int save(const char* fileName);
+
+    // Sets the current settings to the device
+    int apply();
+    DDBufferSettings current() const { return mCurrent; }
+    void setCurrent(int blockSize, int buffSize);
+
+    // Call around the measurement and from the new data callback
+    void beginRun();
+    // readFailed - the pixels could not be read, they are not counted as lost to the reader buffer
+    void onCallback(unsigned pixelsReported, unsigned pixelsRead, double processingTime, bool readFailed = false);
+    void endRun(int measurementRc);
+
+    // Picks the settings for the next run from the last result, returns true if they changed
+    bool adapt();
+
+    // Best settings: no failure or loss, throughput close to the best run and the lowest latency
+    DDBufferSettings best() const;
+
+    // Prints the throughput/latency trade-off of all runs
+    void printReport() const;
+
+    const std::vector<DDRunResult>& results() const { return mResults; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static int roundPow2(double value, int minValue, int maxValue);
+    std::string deviceKey() const;
+
+    unsigned mDeviceIndex;
+    int mOpMode;
+    int mMaxBlockSize;      // MB, what the reader buffer takes
+    double mTargetLatency;
+    double mBurstTime;
+    DDBufferSettings mCurrent;
+    DDRunResult mRun;
+    Clock::time_point mRunStart;
+    Clock::time_point mLastCallback;
+    double mIntervalSum;
+    double mProcessingSum;
+    std::vector<DDRunResult> mResults;
+};
+
+#endif /* end of include guard: DDTUNER_H */
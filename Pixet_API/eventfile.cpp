@@ -0,0 +1,376 @@
+/**
+ * @file      eventfile.cpp
+ *
+ * Binary event list of cluster results.
+ *
+ */
+#include "eventfile.h"
+#include <cmath>
+#include <cstring>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const unsigned gColumnBytes[EVCOL_COUNT] = { 8, 4, 4, 8, 4, 4 };
+
+static u64 padded(u64 bytes)
+{
+    return (bytes + 7) & ~(u64)7;
+}
+
+// Offsets of the columns of a chunk of rows from its start, offsets[EVCOL_COUNT] is the chunk size
+static void columnOffsets(u32 rows, u64* offsets)
+{
+    offsets[0] = 0;
+    for (int c = 0; c < EVCOL_COUNT; c++)
+        offsets[c + 1] = offsets[c] + padded((u64)rows * gColumnBytes[c]);
+}
+
+EventQuery::EventQuery()
+{
+    for (int c = 0; c < EVCOL_COUNT; c++) {
+        mMin[c] = -HUGE_VAL;
+        mMax[c] = HUGE_VAL;
+    }
+}
+
+// ##########################################################################################33
+//                                       WRITER
+// ##########################################################################################33
+
+EventFileWriter::EventFileWriter()
+    : mFile(NULL)
+    , mChunkRows(EVENTFILE_CHUNK_ROWS)
+    , mOffset(0)
+    , mRows(0)
+    , mFailed(false)
+{
+}
+
+EventFileWriter::~EventFileWriter()
+{
+    close();
+}
+
+int EventFileWriter::open(const char* fileName, unsigned chunkRows)
+{
+    close();
+    mFile = fopen(fileName, "wb");
+    if (!mFile)
+        return PXCERR_COULD_NOT_SAVE;
+    mFileName = fileName;
+    mChunkRows = PXMAX(chunkRows, 1u);
+    mRows = 0;
+    mFailed = false;
+    mChunks.clear();
+    mShot.reserve(mChunkRows);
+    mX.reserve(mChunkRows);
+    mY.reserve(mChunkRows);
+    mToa.reserve(mChunkRows);
+    mTot.reserve(mChunkRows);
+    mSize.reserve(mChunkRows);
+
+    EventFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = EVENTFILE_MAGIC;
+    header.version = EVENTFILE_VERSION;
+    header.columnCount = EVCOL_COUNT;
+    header.chunkRows = mChunkRows;
+    mFailed = fwrite(&header, sizeof(header), 1, mFile) != 1;
+    mOffset = sizeof(header);
+    return mFailed ? PXCERR_COULD_NOT_SAVE : 0;
+}
+
+int EventFileWriter::write(const Tpx3Cluster* clusters, size_t count, u64 shotOffset)
+{
+    if (!mFile)
+        return PXCERR_INVALID_ARGUMENT;
+    size_t i = 0;
+    while (i < count) {
+        size_t n = PXMIN(count - i, (size_t)(mChunkRows - mShot.size()));
+        for (size_t k = i; k < i + n; k++) {
+            const Tpx3Cluster& c = clusters[k];
+            mShot.push_back(c.shot + shotOffset);
+            mX.push_back(c.x);
+            mY.push_back(c.y);
+            mToa.push_back(c.toa);
+            mTot.push_back(c.tot);
+            mSize.push_back(c.size);
+        }
+        i += n;
+        if (mShot.size() == mChunkRows)
+            flushChunk();
+    }
+    return mFailed ? PXCERR_COULD_NOT_SAVE : 0;
+}
+
+template <typename T> static void columnRange(const std::vector<T>& column, double& min, double& max)
+{
+    T lo = column[0], hi = column[0];
+    for (size_t i = 1; i < column.size(); i++) {
+        lo = PXMIN(lo, column[i]);
+        hi = PXMAX(hi, column[i]);
+    }
+    min = (double)lo;
+    max = (double)hi;
+}
+
+int EventFileWriter::flushChunk()
+{
+    u32 rows = (u32)mShot.size();
+    if (!rows)
+        return 0;
+    EventChunkInfo info;
+    memset(&info, 0, sizeof(info));
+    info.offset = mOffset;
+    info.rows = rows;
+    columnRange(mShot, info.min[EVCOL_SHOT], info.max[EVCOL_SHOT]);
+    columnRange(mX, info.min[EVCOL_X], info.max[EVCOL_X]);
+    columnRange(mY, info.min[EVCOL_Y], info.max[EVCOL_Y]);
+    columnRange(mToa, info.min[EVCOL_TOA], info.max[EVCOL_TOA]);
+    columnRange(mTot, info.min[EVCOL_TOT], info.max[EVCOL_TOT]);
+    columnRange(mSize, info.min[EVCOL_SIZE], info.max[EVCOL_SIZE]);
+
+    const void* columns[EVCOL_COUNT] = { &mShot[0], &mX[0], &mY[0], &mToa[0], &mTot[0], &mSize[0] };
+    static const byte zeros[8] = { 0 };
+    for (int c = 0; c < EVCOL_COUNT; c++) {
+        size_t bytes = (size_t)rows * gColumnBytes[c];
+        size_t pad = (size_t)(padded(bytes) - bytes);
+        if (fwrite(columns[c], 1, bytes, mFile) != bytes || (pad && fwrite(zeros, 1, pad, mFile) != pad))
+            mFailed = true;
+        mOffset += bytes + pad;
+    }
+    mChunks.push_back(info);
+    mRows += rows;
+    mShot.clear();
+    mX.clear();
+    mY.clear();
+    mToa.clear();
+    mTot.clear();
+    mSize.clear();
+    return mFailed ? PXCERR_COULD_NOT_SAVE : 0;
+}
+
+int EventFileWriter::close()
+{
+    if (!mFile)
+        return 0;
+    flushChunk();
+    EventFileTrailer trailer;
+    trailer.directoryOffset = mOffset;
+    trailer.chunkCount = mChunks.size();
+    trailer.rowCount = mRows;
+    trailer.version = EVENTFILE_VERSION;
+    trailer.magic = EVENTFILE_MAGIC;
+    if (!mChunks.empty() && fwrite(&mChunks[0], sizeof(EventChunkInfo), mChunks.size(), mFile) != mChunks.size())
+        mFailed = true;
+    if (fwrite(&trailer, sizeof(trailer), 1, mFile) != 1)
+        mFailed = true;
+    if (fclose(mFile))
+        mFailed = true;
+    mFile = NULL;
+    mChunks.clear();
+    if (mFailed)
+        printf("Cannot write %s\n", mFileName.c_str());
+    return mFailed ? PXCERR_COULD_NOT_SAVE : 0;
+}
+
+// ##########################################################################################33
+//                                       READER
+// ##########################################################################################33
+
+EventFileReader::EventFileReader()
+    : mData(NULL)
+    , mSize(0)
+    , mRows(0)
+#ifdef WIN32
+    , mFileHandle(NULL)
+    , mMapping(NULL)
+#endif
+{
+}
+
+EventFileReader::~EventFileReader()
+{
+    close();
+}
+
+int EventFileReader::open(const char* fileName)
+{
+    close();
+#ifdef WIN32
+    HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return PXCERR_INVALID_ARGUMENT;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)(sizeof(EventFileHeader) + sizeof(EventFileTrailer))) {
+        CloseHandle(file);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!data) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    mFileHandle = file;
+    mMapping = mapping;
+    mSize = (u64)size.QuadPart;
+#else
+    int fd = ::open(fileName, O_RDONLY);
+    if (fd < 0)
+        return PXCERR_INVALID_ARGUMENT;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(EventFileHeader) + sizeof(EventFileTrailer)) {
+        ::close(fd);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return PXCERR_UNEXPECTED_ERROR;
+    mSize = (u64)st.st_size;
+#endif
+    mData = (const byte*)data;
+
+    // the header, the trailer and the directory have to be consistent with the file size
+    EventFileHeader header;
+    EventFileTrailer trailer;
+    memcpy(&header, mData, sizeof(header));
+    memcpy(&trailer, mData + mSize - sizeof(trailer), sizeof(trailer));
+    bool ok = header.magic == EVENTFILE_MAGIC && header.version == EVENTFILE_VERSION && header.columnCount == EVCOL_COUNT &&
+              trailer.magic == EVENTFILE_MAGIC && trailer.version == EVENTFILE_VERSION &&
+              trailer.directoryOffset >= sizeof(header) && trailer.chunkCount <= mSize / sizeof(EventChunkInfo) &&
+              trailer.directoryOffset + trailer.chunkCount * sizeof(EventChunkInfo) + sizeof(trailer) == mSize;
+    if (ok) {
+        mChunks.resize((size_t)trailer.chunkCount);
+        if (!mChunks.empty())
+            memcpy(&mChunks[0], mData + trailer.directoryOffset, mChunks.size() * sizeof(EventChunkInfo));
+        u64 rows = 0;
+        u64 offsets[EVCOL_COUNT + 1];
+        for (size_t i = 0; i < mChunks.size() && ok; i++) {
+            columnOffsets(mChunks[i].rows, offsets);
+            ok = (mChunks[i].offset & 7) == 0 && mChunks[i].offset >= sizeof(header) &&
+                 mChunks[i].offset + offsets[EVCOL_COUNT] <= trailer.directoryOffset;
+            rows += mChunks[i].rows;
+        }
+        ok = ok && rows == trailer.rowCount;
+        mRows = rows;
+    }
+    if (!ok) {
+        printf("%s is not a complete event file\n", fileName);
+        close();
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+void EventFileReader::close()
+{
+#ifdef WIN32
+    if (mData)
+        UnmapViewOfFile(mData);
+    if (mMapping)
+        CloseHandle((HANDLE)mMapping);
+    if (mFileHandle)
+        CloseHandle((HANDLE)mFileHandle);
+    mMapping = NULL;
+    mFileHandle = NULL;
+#else
+    if (mData)
+        munmap((void*)mData, (size_t)mSize);
+#endif
+    mData = NULL;
+    mSize = 0;
+    mRows = 0;
+    mChunks.clear();
+}
+
+int EventFileReader::columns(unsigned index, EventColumns& out) const
+{
+    if (index >= mChunks.size())
+        return PXCERR_INVALID_ARGUMENT;
+    const EventChunkInfo& info = mChunks[index];
+    u64 offsets[EVCOL_COUNT + 1];
+    columnOffsets(info.rows, offsets);
+    const byte* base = mData + info.offset;
+    out.rows = info.rows;
+    out.shot = (const u64*)(base + offsets[EVCOL_SHOT]);
+    out.x = (const float*)(base + offsets[EVCOL_X]);
+    out.y = (const float*)(base + offsets[EVCOL_Y]);
+    out.toa = (const double*)(base + offsets[EVCOL_TOA]);
+    out.tot = (const float*)(base + offsets[EVCOL_TOT]);
+    out.size = (const u32*)(base + offsets[EVCOL_SIZE]);
+    return 0;
+}
+
+bool EventFileReader::chunkMayMatch(unsigned index, const EventQuery& query) const
+{
+    const EventChunkInfo& info = mChunks[index];
+    for (int c = 0; c < EVCOL_COUNT; c++)
+        if (query.mMin[c] > info.max[c] || query.mMax[c] < info.min[c])
+            return false;
+    return true;
+}
+
+// Keeps the rows whose value is in [min, max], without branches on the values
+template <typename T> static void filterRows(const T* column, double min, double max, std::vector<u32>& rows)
+{
+    size_t n = 0;
+    for (size_t k = 0; k < rows.size(); k++) {
+        double v = (double)column[rows[k]];
+        rows[n] = rows[k];
+        n += v >= min && v <= max;
+    }
+    rows.resize(n);
+}
+
+u64 EventFileReader::select(const EventQuery& query, std::vector<EventRecord>& out) const
+{
+    size_t before = out.size();
+    std::vector<u32> rows;
+    for (unsigned i = 0; i < mChunks.size(); i++) {
+        if (!chunkMayMatch(i, query))
+            continue;
+        const EventChunkInfo& info = mChunks[i];
+        EventColumns col;
+        columns(i, col);
+        rows.resize(col.rows);
+        for (u32 r = 0; r < col.rows; r++)
+            rows[r] = r;
+        // only the columns whose range is not covered by the query entirely are read
+        for (int c = 0; c < EVCOL_COUNT && !rows.empty(); c++) {
+            double min = query.mMin[c], max = query.mMax[c];
+            if (min <= info.min[c] && max >= info.max[c])
+                continue;
+            switch (c) {
+            case EVCOL_SHOT: filterRows(col.shot, min, max, rows); break;
+            case EVCOL_X: filterRows(col.x, min, max, rows); break;
+            case EVCOL_Y: filterRows(col.y, min, max, rows); break;
+            case EVCOL_TOA: filterRows(col.toa, min, max, rows); break;
+            case EVCOL_TOT: filterRows(col.tot, min, max, rows); break;
+            case EVCOL_SIZE: filterRows(col.size, min, max, rows); break;
+            }
+        }
+        for (size_t k = 0; k < rows.size(); k++) {
+            u32 r = rows[k];
+            EventRecord e;
+            e.shot = col.shot[r];
+            e.x = col.x[r];
+            e.y = col.y[r];
+            e.toa = col.toa[r];
+            e.tot = col.tot[r];
+            e.size = col.size[r];
+            out.push_back(e);
+        }
+    }
+    return out.size() - before;
+}
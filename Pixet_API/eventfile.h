@@ -0,0 +1,171 @@
+/**
+ * @file      eventfile.h
+ *
+ * Binary event list of cluster results (.t3ev), the replacement of the
+ * centroided CSV files. Every event has the columns
+ *
+ *     shot (u64), x (f32), y (f32), toa (f64, ns), tot (f32), size (u32)
+ *
+ * stored column by column in chunks of up to chunkRows events:
+ *
+ *     header | chunk 0 | chunk 1 | ... | directory | trailer
+ *
+ * A chunk holds the 6 columns one after the other, each padded to 8 bytes.
+ * The directory has the offset, row count and min/max of every column for
+ * each chunk, a query skips the chunks whose ranges exclude it without
+ * touching their data. The directory is written at the end, so the writer
+ * streams the chunks out as the clustering produces them; a file without
+ * the trailer was not closed and is rejected.
+ *
+ * The reader maps the file into memory, the columns of a chunk are plain
+ * arrays in the mapping. Little endian, as the numpy reader
+ * (read_events in eventfile.py) assumes.
+ *
+ */
+#ifndef EVENTFILE_H
+#define EVENTFILE_H
+#include "tpx3proc.h"
+#include <string>
+#include <vector>
+
+#define EVENTFILE_MAGIC         0x56455850  // "PXEV"
+#define EVENTFILE_VERSION       1
+#define EVENTFILE_CHUNK_ROWS    65536
+
+typedef enum _EventColumn
+{
+    EVCOL_SHOT = 0,
+    EVCOL_X,
+    EVCOL_Y,
+    EVCOL_TOA,
+    EVCOL_TOT,
+    EVCOL_SIZE,
+    EVCOL_COUNT,
+} EventColumn;
+
+#pragma pack(push, 1)
+typedef struct _EventFileHeader
+{
+    u32 magic;
+    u32 version;
+    u32 columnCount;
+    u32 chunkRows;
+    u64 reserved[2];
+} EventFileHeader;
+
+typedef struct _EventChunkInfo
+{
+    u64 offset;                 // of the first column from the start of the file
+    u32 rows;
+    u32 reserved;
+    double min[EVCOL_COUNT];
+    double max[EVCOL_COUNT];
+} EventChunkInfo;
+
+typedef struct _EventFileTrailer
+{
+    u64 directoryOffset;
+    u64 chunkCount;
+    u64 rowCount;
+    u32 version;
+    u32 magic;
+} EventFileTrailer;
+#pragma pack(pop)
+
+struct EventRecord
+{
+    u64 shot;
+    float x;
+    float y;
+    double toa;
+    float tot;
+    u32 size;
+};
+
+// Columns of one chunk, pointers into the mapped file
+struct EventColumns
+{
+    u32 rows;
+    const u64* shot;
+    const float* x;
+    const float* y;
+    const double* toa;
+    const float* tot;
+    const u32* size;
+};
+
+// Inclusive range per column, all events by default
+struct EventQuery
+{
+    EventQuery();
+    EventQuery& where(EventColumn column, double min, double max) { mMin[column] = min; mMax[column] = max; return *this; }
+
+    double mMin[EVCOL_COUNT];
+    double mMax[EVCOL_COUNT];
+};
+
+class EventFileWriter
+{
+public:
+    EventFileWriter();
+    ~EventFileWriter();
+
+    int open(const char* fileName, unsigned chunkRows = EVENTFILE_CHUNK_ROWS);
+    // Appends clusters, shotOffset is added to their shot numbers
+    int write(const Tpx3Cluster* clusters, size_t count, u64 shotOffset = 0);
+    // Writes the last chunk and the directory
+    int close();
+
+    bool isOpen() const { return mFile != NULL; }
+    u64 rowCount() const { return mRows; }
+    u64 bytesWritten() const { return mOffset; }
+
+private:
+    int flushChunk();
+
+    FILE* mFile;
+    std::string mFileName;
+    unsigned mChunkRows;
+    u64 mOffset;
+    u64 mRows;
+    bool mFailed;
+    std::vector<u64> mShot;
+    std::vector<float> mX;
+    std::vector<float> mY;
+    std::vector<double> mToa;
+    std::vector<float> mTot;
+    std::vector<u32> mSize;
+    std::vector<EventChunkInfo> mChunks;
+};
+
+class EventFileReader
+{
+public:
+    EventFileReader();
+    ~EventFileReader();
+
+    int open(const char* fileName);
+    void close();
+
+    u64 rowCount() const { return mRows; }
+    unsigned chunkCount() const { return (unsigned)mChunks.size(); }
+    const EventChunkInfo& chunkInfo(unsigned index) const { return mChunks[index]; }
+
+    int columns(unsigned index, EventColumns& out) const;
+    // True when the min/max of the chunk do not exclude the query
+    bool chunkMayMatch(unsigned index, const EventQuery& query) const;
+    // Appends the events matching the query, returns their number
+    u64 select(const EventQuery& query, std::vector<EventRecord>& out) const;
+
+private:
+    const byte* mData;
+    u64 mSize;
+    u64 mRows;
+    std::vector<EventChunkInfo> mChunks;
+#ifdef WIN32
+    void* mFileHandle;
+    void* mMapping;
+#endif
+};
+
+#endif /* end of include guard: EVENTFILE_H */
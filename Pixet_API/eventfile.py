@@ -0,0 +1,93 @@
+"""
+Reader of the binary event lists (.t3ev) written by tpx3batch, the layout
+is described in eventfile.h. The file is memory mapped and the chunks whose
+min/max statistics exclude the requested ranges are skipped unread.
+
+    from eventfile import read_events
+    events = read_events('run_events.t3ev', toa=(0, 5000), size=(2, 40))
+    x, y = events['x'], events['y']
+
+Ranges are inclusive, the columns are shot, x, y, toa, tot and size. A
+file that was not closed or is damaged raises ValueError.
+"""
+import numpy as np
+
+EVENTFILE_MAGIC = 0x56455850
+EVENTFILE_VERSION = 1
+
+COLUMNS = [('shot', '<u8'), ('x', '<f4'), ('y', '<f4'), ('toa', '<f8'), ('tot', '<f4'), ('size', '<u4')]
+CHUNK_INFO = np.dtype([('offset', '<u8'), ('rows', '<u4'), ('reserved', '<u4'),
+                       ('min', '<f8', len(COLUMNS)), ('max', '<f8', len(COLUMNS))])
+TRAILER = np.dtype([('directoryOffset', '<u8'), ('chunkCount', '<u8'), ('rowCount', '<u8'),
+                    ('version', '<u4'), ('magic', '<u4')])
+HEADER = np.dtype([('magic', '<u4'), ('version', '<u4'), ('columnCount', '<u4'), ('chunkRows', '<u4'),
+                   ('reserved', '<u8', 2)])
+
+
+def chunk_bytes(rows):
+    """Size of a chunk of rows, every column padded to 8 bytes."""
+    return sum((rows * np.dtype(dtype).itemsize + 7) & ~7 for _, dtype in COLUMNS)
+
+
+def read_directory(file_name):
+    """Maps the file and returns (data, chunks), with the checks of EventFileReader::open:
+    the header, the trailer and the directory have to be consistent with the file size,
+    ValueError otherwise."""
+    error = ValueError('%s is not a complete event file' % file_name)
+    try:
+        data = np.memmap(file_name, dtype=np.uint8, mode='r')
+    except ValueError:      # empty file
+        raise error
+    size = len(data)
+    if size < HEADER.itemsize + TRAILER.itemsize:
+        raise error
+    header = data[:HEADER.itemsize].view(HEADER)[0]
+    trailer = data[size - TRAILER.itemsize:].view(TRAILER)[0]
+    directory = int(trailer['directoryOffset'])
+    count = int(trailer['chunkCount'])
+    if (header['magic'] != EVENTFILE_MAGIC or header['version'] != EVENTFILE_VERSION
+            or header['columnCount'] != len(COLUMNS)
+            or trailer['magic'] != EVENTFILE_MAGIC or trailer['version'] != EVENTFILE_VERSION
+            or directory < HEADER.itemsize or count > size // CHUNK_INFO.itemsize
+            or directory + count * CHUNK_INFO.itemsize + TRAILER.itemsize != size):
+        raise error
+    chunks = data[directory:directory + count * CHUNK_INFO.itemsize].view(CHUNK_INFO)
+    rows = 0
+    for chunk in chunks:
+        offset = int(chunk['offset'])
+        if offset & 7 or offset < HEADER.itemsize or offset + chunk_bytes(int(chunk['rows'])) > directory:
+            raise error
+        rows += int(chunk['rows'])
+    if rows != int(trailer['rowCount']):
+        raise error
+    return data, chunks
+
+
+def read_events(file_name, **ranges):
+    data, chunks = read_directory(file_name)
+
+    names = [name for name, _ in COLUMNS]
+    for name in ranges:
+        if name not in names:
+            raise ValueError('unknown column %s' % name)
+
+    parts = []
+    for chunk in chunks:
+        if any(lo > chunk['max'][names.index(name)] or hi < chunk['min'][names.index(name)]
+               for name, (lo, hi) in ranges.items()):
+            continue
+        rows = int(chunk['rows'])
+        offset = int(chunk['offset'])
+        columns = {}
+        for name, dtype in COLUMNS:
+            size = rows * np.dtype(dtype).itemsize
+            columns[name] = data[offset:offset + size].view(dtype)
+            offset += (size + 7) & ~7
+        mask = np.ones(rows, dtype=bool)
+        for name, (lo, hi) in ranges.items():
+            mask &= (columns[name] >= lo) & (columns[name] <= hi)
+        part = np.empty(int(mask.sum()), dtype=COLUMNS)
+        for name in names:
+            part[name] = columns[name][mask]
+        parts.append(part)
+    return np.concatenate(parts) if parts else np.empty(0, dtype=COLUMNS)
@@ -0,0 +1,451 @@
+/**
+ * @file      hitbus.cpp
+ *
+ * Shared memory bus of Timepix3 pixel batches.
+ *
+ */
+#include "hitbus.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define HITBUS_ALIGN            64
+
+static u64 alignUp(u64 value)
+{
+    return (value + HITBUS_ALIGN - 1) & ~(u64)(HITBUS_ALIGN - 1);
+}
+
+static u32 currentProcessId()
+{
+#ifdef WIN32
+    return (u32)GetCurrentProcessId();
+#else
+    return (u32)getpid();
+#endif
+}
+
+static bool processAlive(u32 pid)
+{
+#ifdef WIN32
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (!process)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#else
+    // EPERM: the process exists but belongs to another user
+    return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+// ############################################## Shared memory ############################################33
+
+HitBusMemory::HitBusMemory()
+    : mData(NULL)
+    , mSize(0)
+    , mOwner(false)
+#ifdef WIN32
+    , mHandle(NULL)
+#endif
+{
+    mName[0] = 0;
+}
+
+HitBusMemory::~HitBusMemory()
+{
+    close();
+}
+
+#ifdef WIN32
+
+int HitBusMemory::create(const char* name, u64 size)
+{
+    close();
+    HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+    if (!handle)
+        return PXCERR_UNEXPECTED_ERROR;
+    void* data = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+    if (!data) {
+        CloseHandle(handle);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    mHandle = handle;
+    mData = (byte*)data;
+    mSize = size;
+    mOwner = true;
+    return 0;
+}
+
+int HitBusMemory::open(const char* name)
+{
+    close();
+    HANDLE handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!handle)
+        return PXCERR_INVALID_ARGUMENT;
+    void* data = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!data) {
+        CloseHandle(handle);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(data, &info, sizeof(info));
+    mHandle = handle;
+    mData = (byte*)data;
+    mSize = info.RegionSize;
+    mOwner = false;
+    return 0;
+}
+
+void HitBusMemory::close()
+{
+    if (mData)
+        UnmapViewOfFile(mData);
+    if (mHandle)
+        CloseHandle((HANDLE)mHandle);
+    mData = NULL;
+    mHandle = NULL;
+    mSize = 0;
+}
+
+#else
+
+// POSIX shared memory names have to start with a slash
+static void shmName(const char* name, char* out, unsigned size)
+{
+    snprintf(out, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+int HitBusMemory::create(const char* name, u64 size)
+{
+    close();
+    shmName(name, mName, sizeof(mName));
+    shm_unlink(mName);
+    int fd = shm_open(mName, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0)
+        return PXCERR_UNEXPECTED_ERROR;
+    if (ftruncate(fd, (off_t)size) != 0) {
+        ::close(fd);
+        shm_unlink(mName);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(mName);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    mData = (byte*)data;
+    mSize = size;
+    mOwner = true;
+    return 0;
+}
+
+int HitBusMemory::open(const char* name)
+{
+    close();
+    shmName(name, mName, sizeof(mName));
+    int fd = shm_open(mName, O_RDWR, 0);
+    if (fd < 0)
+        return PXCERR_INVALID_ARGUMENT;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return PXCERR_UNEXPECTED_ERROR;
+    mData = (byte*)data;
+    mSize = (u64)st.st_size;
+    mOwner = false;
+    return 0;
+}
+
+void HitBusMemory::close()
+{
+    if (mData)
+        munmap(mData, (size_t)mSize);
+    if (mOwner && mName[0])
+        shm_unlink(mName);
+    mData = NULL;
+    mSize = 0;
+    mOwner = false;
+}
+
+#endif
+
+// ############################################## Producer ############################################33
+
+HitBusProducer::HitBusProducer()
+    : mHeader(NULL)
+{
+}
+
+HitBusProducer::~HitBusProducer()
+{
+    close();
+}
+
+int HitBusProducer::create(const char* name, unsigned slotCount, unsigned slotCapacity)
+{
+    if (!name || slotCount < 2 || slotCapacity == 0)
+        return PXCERR_INVALID_ARGUMENT;
+    close();
+
+    u64 slotBytes = alignUp(sizeof(HitBusSlot) + (u64)slotCapacity * sizeof(Tpx3Pixel));
+    u64 size = alignUp(sizeof(HitBusHeader)) + slotBytes * slotCount;
+    int rc = mMemory.create(name, size);
+    if (rc)
+        return rc;
+
+    memset(mMemory.data(), 0, (size_t)size);
+    mHeader = new (mMemory.data()) HitBusHeader;
+    mHeader->magic = HITBUS_MAGIC;
+    mHeader->version = HITBUS_VERSION;
+    mHeader->slotCount = slotCount;
+    mHeader->slotCapacity = slotCapacity;
+    mHeader->slotBytes = slotBytes;
+    mHeader->writeSeq.store(0);
+    mHeader->pixelsPublished.store(0);
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS; i++) {
+        mHeader->consumers[i].active.store(0);
+        mHeader->consumers[i].pid.store(0);
+        mHeader->consumers[i].readSeq.store(0);
+        mHeader->consumers[i].received.store(0);
+        mHeader->consumers[i].dropped.store(0);
+    }
+    for (unsigned i = 0; i < slotCount; i++)
+        new (slot(i + 1)) HitBusSlot;
+    mHeader->producerAlive.store(1, std::memory_order_release);
+    return 0;
+}
+
+void HitBusProducer::close()
+{
+    if (mHeader)
+        mHeader->producerAlive.store(0);
+    mHeader = NULL;
+    mMemory.close();
+}
+
+HitBusSlot* HitBusProducer::slot(u64 seq) const
+{
+    byte* slots = mMemory.data() + alignUp(sizeof(HitBusHeader));
+    return (HitBusSlot*)(slots + ((seq - 1) % mHeader->slotCount) * mHeader->slotBytes);
+}
+
+u64 HitBusProducer::publish(const Tpx3Pixel* pixels, unsigned pixelCount)
+{
+    if (!mHeader)
+        return 0;
+    u64 seq = mHeader->writeSeq.load(std::memory_order_relaxed);
+    if (pixelCount == 0)
+        return seq;
+    unsigned offset = 0;
+    do {
+        unsigned count = PXMIN(pixelCount - offset, mHeader->slotCapacity);
+        HitBusSlot* s = slot(++seq);
+        s->seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(s->pixels(), pixels + offset, count * sizeof(Tpx3Pixel));
+        s->pixelCount = count;
+        s->seq.store(seq, std::memory_order_release);
+        mHeader->writeSeq.store(seq, std::memory_order_release);
+        offset += count;
+    } while (offset < pixelCount);
+    mHeader->pixelsPublished.fetch_add(pixelCount, std::memory_order_relaxed);
+    return seq;
+}
+
+unsigned HitBusProducer::reapConsumers()
+{
+    if (!mHeader)
+        return 0;
+    unsigned reaped = 0;
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS; i++) {
+        HitBusConsumerInfo& c = mHeader->consumers[i];
+        u32 pid = c.pid.load();
+        if (!c.active.load() || pid == 0 || processAlive(pid))
+            continue;
+        // the pid is cleared first, a consumer attaching to the freed slot sets its own after the active flag
+        if (!c.pid.compare_exchange_strong(pid, 0))
+            continue;
+        printf("HitBus: consumer %.*s (pid %u) exited without detaching\n", HITBUS_NAME_LEN, c.name, pid);
+        c.active.store(0);
+        reaped++;
+    }
+    return reaped;
+}
+
+void HitBusProducer::printConsumerStats() const
+{
+    if (!mHeader)
+        return;
+    u64 written = mHeader->writeSeq.load();
+    printf("HitBus: %llu batches, %llu pixels published\n", written, mHeader->pixelsPublished.load());
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS; i++) {
+        const HitBusConsumerInfo& c = mHeader->consumers[i];
+        if (!c.active.load())
+            continue;
+        printf("  Consumer %-*s received=%llu lag=%llu dropped=%llu\n", HITBUS_NAME_LEN, c.name,
+               c.received.load(), written - PXMIN(c.readSeq.load(), written), c.dropped.load());
+    }
+}
+
+u64 HitBusProducer::maxConsumerLag() const
+{
+    if (!mHeader)
+        return 0;
+    u64 written = mHeader->writeSeq.load(std::memory_order_relaxed);
+    u64 lag = 0;
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS; i++)
+        if (mHeader->consumers[i].active.load(std::memory_order_relaxed))
+            lag = PXMAX(lag, written - PXMIN(mHeader->consumers[i].readSeq.load(std::memory_order_relaxed), written));
+    return lag;
+}
+
+u64 HitBusProducer::consumersDropped() const
+{
+    if (!mHeader)
+        return 0;
+    u64 dropped = 0;
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS; i++)
+        if (mHeader->consumers[i].active.load(std::memory_order_relaxed))
+            dropped += mHeader->consumers[i].dropped.load(std::memory_order_relaxed);
+    return dropped;
+}
+
+// ############################################## Consumer ############################################33
+
+HitBusConsumer::HitBusConsumer()
+    : mHeader(NULL)
+    , mInfo(NULL)
+    , mNextSeq(1)
+    , mCurrent(NULL)
+{
+}
+
+HitBusConsumer::~HitBusConsumer()
+{
+    detach();
+}
+
+int HitBusConsumer::attach(const char* name, const char* consumerName, bool fromStart)
+{
+    detach();
+    int rc = mMemory.open(name);
+    if (rc)
+        return rc;
+    HitBusHeader* header = (HitBusHeader*)mMemory.data();
+    if (mMemory.size() < sizeof(HitBusHeader) || header->magic != HITBUS_MAGIC || header->version != HITBUS_VERSION) {
+        mMemory.close();
+        return PXCERR_NOT_SUPPORTED;
+    }
+
+    for (unsigned i = 0; i < HITBUS_MAX_CONSUMERS && !mInfo; i++) {
+        u32 expected = 0;
+        if (header->consumers[i].active.compare_exchange_strong(expected, 1))
+            mInfo = &header->consumers[i];
+    }
+    if (!mInfo) {
+        mMemory.close();
+        return PXCERR_BUFFER_SMALL;
+    }
+
+    mHeader = header;
+    u64 written = mHeader->writeSeq.load(std::memory_order_acquire);
+    if (fromStart)
+        mNextSeq = written > mHeader->slotCount ? written - mHeader->slotCount + 2 : 1;
+    else
+        mNextSeq = written + 1;
+    memset(mInfo->name, 0, HITBUS_NAME_LEN);
+    strncpy(mInfo->name, consumerName ? consumerName : "", HITBUS_NAME_LEN - 1);
+    mInfo->readSeq.store(mNextSeq - 1);
+    mInfo->received.store(0);
+    mInfo->dropped.store(0);
+    mInfo->pid.store(currentProcessId());
+    return 0;
+}
+
+void HitBusConsumer::detach()
+{
+    if (mInfo) {
+        mInfo->pid.store(0);
+        mInfo->active.store(0);
+    }
+    mInfo = NULL;
+    mHeader = NULL;
+    mCurrent = NULL;
+    mMemory.close();
+}
+
+HitBusSlot* HitBusConsumer::slot(u64 seq) const
+{
+    byte* slots = mMemory.data() + alignUp(sizeof(HitBusHeader));
+    return (HitBusSlot*)(slots + ((seq - 1) % mHeader->slotCount) * mHeader->slotBytes);
+}
+
+const Tpx3Pixel* HitBusConsumer::acquire(unsigned* pixelCount, u64* seq)
+{
+    if (!mHeader || mCurrent)
+        return NULL;
+    u64 written = mHeader->writeSeq.load(std::memory_order_acquire);
+    if (mNextSeq > written)
+        return NULL;
+
+    // the slot after the newest batch may already be overwritten, skip to the oldest safe one
+    if (written - mNextSeq + 2 > mHeader->slotCount) {
+        u64 oldest = written - mHeader->slotCount + 2;
+        mInfo->dropped.fetch_add(oldest - mNextSeq, std::memory_order_relaxed);
+        mNextSeq = oldest;
+    }
+
+    HitBusSlot* s = slot(mNextSeq);
+    if (s->seq.load(std::memory_order_acquire) != mNextSeq) {
+        mInfo->dropped.fetch_add(1, std::memory_order_relaxed);
+        mInfo->readSeq.store(mNextSeq++, std::memory_order_relaxed);
+        return NULL;
+    }
+    mCurrent = s;
+    if (pixelCount)
+        *pixelCount = s->pixelCount;
+    if (seq)
+        *seq = mNextSeq;
+    return s->pixels();
+}
+
+bool HitBusConsumer::release()
+{
+    if (!mCurrent)
+        return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool valid = mCurrent->seq.load(std::memory_order_relaxed) == mNextSeq;
+    if (valid)
+        mInfo->received.fetch_add(1, std::memory_order_relaxed);
+    else
+        mInfo->dropped.fetch_add(1, std::memory_order_relaxed);
+    mInfo->readSeq.store(mNextSeq++, std::memory_order_relaxed);
+    mCurrent = NULL;
+    return valid;
+}
+
+u64 HitBusConsumer::lag() const
+{
+    if (!mHeader)
+        return 0;
+    u64 written = mHeader->writeSeq.load(std::memory_order_relaxed);
+    return written >= mNextSeq ? written - mNextSeq + 1 : 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file      hitbus.h
+ *
+ * Shared memory bus of Timepix3 pixel batches. The acquisition process
+ * publishes every data driven batch into a ring of fixed size slots in a
+ * named shared memory region; any number of local processes (writer, live
+ * view, clustering, monitoring) attach to it and read the batches in place,
+ * each at its own pace. The producer never waits for the consumers: a
+ * consumer that falls more than a ring behind loses the overwritten batches
+ * and sees them counted as dropped.
+ *
+ * Every slot carries the sequence number of the batch it holds. The
+ * producer zeroes it before overwriting the slot and sets it after the
+ * copy, the consumer checks it before and after reading the slot, so a
+ * batch overwritten while it was being read is detected and dropped.
+ *
+ * A consumer registers with its process id. A consumer process that exits
+ * without detaching (crash, kill) would keep its registration and its lag
+ * would grow without bound; reapConsumers() frees the registrations of
+ * processes that no longer exist. A reused process id keeps a dead
+ * registration alive until that process exits too.
+ *
+ */
+#ifndef HITBUS_H
+#define HITBUS_H
+#include "pxcapi.h"
+#include <atomic>
+
+#define HITBUS_MAGIC            0x53554248  // "HBUS"
+#define HITBUS_VERSION          2
+#define HITBUS_MAX_CONSUMERS    16
+#define HITBUS_NAME_LEN         32
+
+struct HitBusConsumerInfo
+{
+    std::atomic<u32> active;
+    std::atomic<u32> pid;       // process of the consumer, 0 while it attaches
+    char name[HITBUS_NAME_LEN];
+    std::atomic<u64> readSeq;   // sequence number of the last batch the consumer finished
+    std::atomic<u64> received;  // batches read completely
+    std::atomic<u64> dropped;   // batches overwritten before the consumer could read them
+};
+
+struct HitBusHeader
+{
+    u32 magic;
+    u32 version;
+    u32 slotCount;
+    u32 slotCapacity;           // pixels per slot
+    u64 slotBytes;
+    std::atomic<u64> writeSeq;  // sequence number of the last published batch (first batch is 1)
+    std::atomic<u64> pixelsPublished;
+    std::atomic<u32> producerAlive;
+    u32 reserved;
+    HitBusConsumerInfo consumers[HITBUS_MAX_CONSUMERS];
+};
+
+struct HitBusSlot
+{
+    std::atomic<u64> seq;       // 0 while the slot is written
+    u32 pixelCount;
+    u32 reserved;
+    // followed by slotCapacity Tpx3Pixels
+    Tpx3Pixel* pixels() { return (Tpx3Pixel*)(this + 1); }
+};
+
+// Named shared memory region, platform specific part of the bus
+class HitBusMemory
+{
+public:
+    HitBusMemory();
+    ~HitBusMemory();
+    int create(const char* name, u64 size);
+    int open(const char* name);
+    void close();
+    byte* data() const { return mData; }
+    u64 size() const { return mSize; }
+
+private:
+    byte* mData;
+    u64 mSize;
+    bool mOwner;
+    char mName[256];
+#ifdef WIN32
+    void* mHandle;
+#endif
+};
+
+class HitBusProducer
+{
+public:
+    HitBusProducer();
+    ~HitBusProducer();
+
+    // Creates the bus with slotCount slots of slotCapacity pixels each
+    int create(const char* name, unsigned slotCount, unsigned slotCapacity);
+    void close();
+
+    // Publishes the pixels, batches bigger than the slot capacity are split over several slots.
+    // Returns sequence number of the last written batch.
+    u64 publish(const Tpx3Pixel* pixels, unsigned pixelCount);
+
+    // Frees the registrations of consumers whose process exited without detaching.
+    // Returns their number.
+    unsigned reapConsumers();
+    // Prints received/lag/dropped statistics of all attached consumers
+    void printConsumerStats() const;
+    // Lag of the slowest attached consumer and batches dropped by all consumers
+    u64 maxConsumerLag() const;
+    u64 consumersDropped() const;
+
+    u64 writeSeq() const { return mHeader ? mHeader->writeSeq.load() : 0; }
+
+private:
+    HitBusSlot* slot(u64 seq) const;
+
+    HitBusMemory mMemory;
+    HitBusHeader* mHeader;
+};
+
+class HitBusConsumer
+{
+public:
+    HitBusConsumer();
+    ~HitBusConsumer();
+
+    // Attaches to an existing bus and registers the consumer under consumerName.
+    // With fromStart the consumer starts at the oldest batch still in the ring, otherwise at the next new batch.
+    int attach(const char* name, const char* consumerName, bool fromStart = false);
+    void detach();
+
+    // Returns pointer to the next batch in shared memory (no copy) or NULL if there is none yet.
+    // The pointer is valid until release() which reports if the batch was overwritten meanwhile.
+    const Tpx3Pixel* acquire(unsigned* pixelCount, u64* seq = NULL);
+    bool release();
+
+    // Number of published batches the consumer has not read yet
+    u64 lag() const;
+    u64 dropped() const { return mInfo ? mInfo->dropped.load() : 0; }
+    u64 received() const { return mInfo ? mInfo->received.load() : 0; }
+    bool producerAlive() const { return mHeader && mHeader->producerAlive.load(); }
+
+private:
+    HitBusSlot* slot(u64 seq) const;
+
+    HitBusMemory mMemory;
+    HitBusHeader* mHeader;
+    HitBusConsumerInfo* mInfo;
+    u64 mNextSeq;
+    HitBusSlot* mCurrent;
+};
+
+#endif /* end of include guard: HITBUS_H */
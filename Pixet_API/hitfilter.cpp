@@ -0,0 +1,124 @@
+/**
+ * @file      hitfilter.cpp
+ *
+ * Prefilter stage for data driven Timepix3 pixels.
+ *
+ */
+#include "hitfilter.h"
+#include <algorithm>
+#include <cstring>
+
+HitFilter::HitFilter(unsigned width, unsigned height)
+    : mWidth(width)
+    , mHeight(height)
+    , mToaGate(false)
+    , mMinToa(0)
+    , mMaxToa(0)
+    , mTotRange(false)
+    , mMinTot(0)
+    , mMaxTot(0)
+    , mRoi(false)
+    , mHitsIn(0)
+    , mHitsOut(0)
+{
+}
+
+void HitFilter::setToaGate(double minToa, double maxToa)
+{
+    mToaGate = true;
+    mMinToa = minToa;
+    mMaxToa = maxToa;
+}
+
+void HitFilter::clearToaGate()
+{
+    mToaGate = false;
+}
+
+void HitFilter::setTotRange(float minTot, float maxTot)
+{
+    mTotRange = true;
+    mMinTot = minTot;
+    mMaxTot = maxTot;
+}
+
+void HitFilter::clearTotRange()
+{
+    mTotRange = false;
+}
+
+int HitFilter::addRoiRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+{
+    if (x0 > x1 || y0 > y1 || x1 >= mWidth || y1 >= mHeight)
+        return PXCERR_INVALID_ARGUMENT;
+    if (!mRoi) {
+        mRoiMask.assign(mWidth * mHeight, 0);
+        mRoi = true;
+    }
+    for (unsigned y = y0; y <= y1; y++)
+        memset(&mRoiMask[y * mWidth + x0], 1, x1 - x0 + 1);
+    return 0;
+}
+
+int HitFilter::addRoiBitmap(const byte* bitmap, unsigned size)
+{
+    if (!bitmap || size != mWidth * mHeight)
+        return PXCERR_INVALID_ARGUMENT;
+    if (!mRoi) {
+        mRoiMask.assign(mWidth * mHeight, 0);
+        mRoi = true;
+    }
+    for (unsigned i = 0; i < size; i++)
+        mRoiMask[i] |= (bitmap[i] != 0);
+    return 0;
+}
+
+void HitFilter::clearRoi()
+{
+    mRoi = false;
+    mRoiMask.clear();
+}
+
+unsigned HitFilter::filter(Tpx3Pixel* pixels, unsigned pixelCount, const double* shotTimes, unsigned shotCount)
+{
+    // Each predicate evaluates to 0/1 and the pixel is always copied to the output slot,
+    // the slot only advances when the pixel is kept, so the compaction itself needs no branch.
+    const byte* roi = mRoi ? &mRoiMask[0] : NULL;
+    const unsigned roiSize = (unsigned)mRoiMask.size();
+    const bool useShots = mToaGate && shotTimes && shotCount > 0;
+    unsigned nextShot = 0; // first shot later than the current pixel
+    unsigned out = 0;
+
+    for (unsigned i = 0; i < pixelCount; i++) {
+        const Tpx3Pixel px = pixels[i];
+        unsigned keep = 1;
+
+        if (mToaGate) {
+            double origin = 0;
+            if (useShots) {
+                // pixels are nearly time ordered, so walk the cursor forward and only search when it goes back
+                if (nextShot > 0 && px.toa < shotTimes[nextShot - 1])
+                    nextShot = (unsigned)(std::upper_bound(shotTimes, shotTimes + shotCount, px.toa) - shotTimes);
+                else
+                    while (nextShot < shotCount && shotTimes[nextShot] <= px.toa)
+                        nextShot++;
+                // hits before the first shot have nothing to be relative to
+                keep = nextShot > 0;
+                origin = keep ? shotTimes[nextShot - 1] : 0;
+            }
+            const double rel = px.toa - origin;
+            keep &= (rel >= mMinToa) & (rel < mMaxToa);
+        }
+        if (mTotRange)
+            keep &= (px.tot >= mMinTot) & (px.tot <= mMaxTot);
+        if (roi)
+            keep &= (px.index < roiSize) && roi[px.index];
+
+        pixels[out] = px;
+        out += keep;
+    }
+
+    mHitsIn += pixelCount;
+    mHitsOut += out;
+    return out;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file      hitfilter.h
+ *
+ * Prefilter stage for data driven Timepix3 pixels. Applied right after
+ * the pixels are read in the data driven callback, it drops every hit
+ * outside the shot relative ToA gate, the spatial ROI or the ToT range
+ * and compacts the remaining pixels in place, so only the interesting
+ * hits reach storage and analysis.
+ *
+ */
+#ifndef HITFILTER_H
+#define HITFILTER_H
+#include "pxcapi.h"
+#include <vector>
+
+class HitFilter
+{
+public:
+    // width/height - detector dimensions in pixels (256x256 for a single chip)
+    HitFilter(unsigned width = 256, unsigned height = 256);
+
+    // Keeps hits arriving in [minToa, maxToa) ns after their shot (or after 0 when no shots are given)
+    void setToaGate(double minToa, double maxToa);
+    void clearToaGate();
+
+    // Keeps hits with ToT in [minTot, maxTot]
+    void setTotRange(float minTot, float maxTot);
+    void clearTotRange();
+
+    // Adds a rectangle (inclusive pixel coordinates) to the ROI. ROI is union of all rectangles and bitmaps.
+    int addRoiRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1);
+    // Adds a bitmap (width*height bytes, nonzero = keep) to the ROI
+    int addRoiBitmap(const byte* bitmap, unsigned size);
+    // Removes the ROI, all pixels are kept again
+    void clearRoi();
+
+    // Filters the pixels in place keeping their order and returns the number of remaining pixels.
+    // [in]    shotTimes - ascending ToA of the shots (ns) the gate is relative to, can be NULL
+    // [in]    shotCount - number of shots in shotTimes
+    unsigned filter(Tpx3Pixel* pixels, unsigned pixelCount, const double* shotTimes = NULL, unsigned shotCount = 0);
+
+    // Number of pixels passed to / kept by filter since the last reset
+    u64 hitsIn() const { return mHitsIn; }
+    u64 hitsOut() const { return mHitsOut; }
+    void resetCounters() { mHitsIn = mHitsOut = 0; }
+
+private:
+    unsigned mWidth;
+    unsigned mHeight;
+    bool mToaGate;
+    double mMinToa;
+    double mMaxToa;
+    bool mTotRange;
+    float mMinTot;
+    float mMaxTot;
+    bool mRoi;
+    std::vector<byte> mRoiMask;
+    u64 mHitsIn;
+    u64 mHitsOut;
+};
+
+#endif /* end of include guard: HITFILTER_H */
@@ -0,0 +1,279 @@
+/**
+ * @file      hitindex.cpp
+ *
+ * Spatial and temporal index over a time ordered window of hits.
+ *
+ */
+#include "hitindex.h"
+#include <algorithm>
+
+HitIndex::HitIndex(unsigned width, unsigned height, unsigned bucketHits, unsigned tileSize)
+    : mWidth(width)
+    , mHeight(height)
+    , mBucketHits(bucketHits)
+    , mTileSize(PXMAX(tileSize, 1u))
+    , mTilesX((width + mTileSize - 1) / mTileSize)
+    , mTilesY((height + mTileSize - 1) / mTileSize)
+    , mMask(0)
+    , mBegin(0)
+    , mEnd(0)
+    , mPixelFirst((size_t)width * height, HITINDEX_NONE)
+    , mPixelLast((size_t)width * height, HITINDEX_NONE)
+{
+}
+
+HitIndex::~HitIndex()
+{
+    for (size_t i = 0; i < mBuckets.size(); i++)
+        delete mBuckets[i];
+    for (size_t i = 0; i < mFreeBuckets.size(); i++)
+        delete mFreeBuckets[i];
+}
+
+// ##########################################################################################33
+//                                      UPDATES
+// ##########################################################################################33
+
+void HitIndex::grow(u64 size)
+{
+    size_t capacity = PXMAX(mEntries.size(), (size_t)1024);
+    while (capacity < size)
+        capacity *= 2;
+    if (capacity == mEntries.size())
+        return;
+    // the links are sequence numbers, only the positions in the ring change
+    std::vector<Entry> entries(capacity);
+    for (u64 seq = retained(); seq < mEnd; seq++)
+        entries[(size_t)(seq & (capacity - 1))] = entry(seq);
+    mEntries.swap(entries);
+    mMask = capacity - 1;
+}
+
+HitIndex::Bucket* HitIndex::newBucket(u64 first, double toa)
+{
+    Bucket* bucket;
+    if (mFreeBuckets.empty()) {
+        bucket = new Bucket;
+        bucket->tileHead.resize((size_t)mTilesX * mTilesY);
+        bucket->tileTail.resize((size_t)mTilesX * mTilesY);
+    } else {
+        bucket = mFreeBuckets.back();
+        mFreeBuckets.pop_back();
+    }
+    bucket->first = first;
+    bucket->count = 0;
+    bucket->minToa = toa;
+    bucket->maxToa = toa;
+    std::fill(bucket->tileHead.begin(), bucket->tileHead.end(), HITINDEX_NONE);
+    std::fill(bucket->tileTail.begin(), bucket->tileTail.end(), HITINDEX_NONE);
+    mBuckets.push_back(bucket);
+    return bucket;
+}
+
+u64 HitIndex::add(const Tpx3Pixel* pixels, unsigned count)
+{
+    u64 first = mEnd;
+    if (mEnd - retained() + count > mEntries.size())
+        grow(mEnd - retained() + count);
+    for (unsigned i = 0; i < count; i++) {
+        u64 seq = mEnd++;
+        u32 index = pixels[i].index;
+        Entry& e = entry(seq);
+        e.pixel = pixels[i];
+        e.removed = false;
+        e.next = HITINDEX_NONE;
+        e.tileNext = HITINDEX_NONE;
+        e.prev = mPixelLast[index];
+        e.jump = HITINDEX_NONE;
+        e.depth = 0;
+        if (e.prev != HITINDEX_NONE) {
+            Entry& p = entry(e.prev);
+            p.next = seq;
+            // Myers: jump twice as far as the previous hit when its two jumps are of equal length, else to it,
+            // an expired jump target ends the skips there
+            e.depth = p.depth + 1;
+            e.jump = e.prev;
+            if (p.jump != HITINDEX_NONE && p.jump >= mBegin) {
+                const Entry& j = entry(p.jump);
+                if (j.jump != HITINDEX_NONE && j.jump >= mBegin && p.depth - j.depth == j.depth - entry(j.jump).depth)
+                    e.jump = j.jump;
+            }
+        } else {
+            mPixelFirst[index] = seq;
+        }
+        mPixelLast[index] = seq;
+
+        if (!mBucketHits)
+            continue;
+        Bucket* bucket = mBuckets.empty() || mBuckets.back()->count == mBucketHits ? newBucket(seq, pixels[i].toa) : mBuckets.back();
+        unsigned tile = (index / mWidth / mTileSize) * mTilesX + index % mWidth / mTileSize;
+        if (bucket->tileTail[tile] != HITINDEX_NONE)
+            entry(bucket->tileTail[tile]).tileNext = seq;
+        else
+            bucket->tileHead[tile] = seq;
+        bucket->tileTail[tile] = seq;
+        bucket->maxToa = pixels[i].toa;
+        bucket->count++;
+    }
+    return first;
+}
+
+void HitIndex::unlink(u64 seq)
+{
+    Entry& e = entry(seq);
+    u32 index = e.pixel.index;
+    if (e.prev != HITINDEX_NONE)
+        entry(e.prev).next = e.next;
+    else
+        mPixelFirst[index] = e.next;
+    if (e.next != HITINDEX_NONE)
+        entry(e.next).prev = e.prev;
+    else
+        mPixelLast[index] = e.prev;
+}
+
+void HitIndex::dropBuckets()
+{
+    while (!mBuckets.empty() && mBuckets.front()->first + mBuckets.front()->count <= mBegin) {
+        mFreeBuckets.push_back(mBuckets.front());
+        mBuckets.pop_front();
+    }
+}
+
+void HitIndex::expire(u64 end)
+{
+    // the oldest hit of the window is the oldest of its pixel
+    for (; mBegin < end && mBegin < mEnd; mBegin++) {
+        if (!entry(mBegin).removed)
+            unlink(mBegin);
+    }
+    dropBuckets();
+}
+
+void HitIndex::expireBefore(double toa)
+{
+    for (; mBegin < mEnd && entry(mBegin).pixel.toa < toa; mBegin++) {
+        if (!entry(mBegin).removed)
+            unlink(mBegin);
+    }
+    dropBuckets();
+}
+
+void HitIndex::reset()
+{
+    expire(mEnd);
+    mBegin = mEnd = 0;
+}
+
+void HitIndex::remove(u64 seq)
+{
+    if (!contains(seq))
+        return;
+    unlink(seq);
+    entry(seq).removed = true;
+}
+
+// ##########################################################################################33
+//                                      QUERIES
+// ##########################################################################################33
+
+unsigned HitIndex::neighbours(u32 index, double t0, double t1, std::vector<u64>& out) const
+{
+    size_t start = out.size();
+    unsigned x = index % mWidth, y = index / mWidth;
+    unsigned xEnd = PXMIN(x + 1, mWidth - 1), yEnd = PXMIN(y + 1, mHeight - 1);
+    for (unsigned ny = y ? y - 1 : 0; ny <= yEnd; ny++) {
+        for (unsigned nx = x ? x - 1 : 0; nx <= xEnd; nx++) {
+            // the last hit at or before t1, over the skip pointers; a jump or link can lead to a removed hit,
+            // whose links still go to every older hit that is not removed
+            u64 seq = mPixelLast[ny * mWidth + nx];
+            while (seq != HITINDEX_NONE && seq >= mBegin && entry(seq).pixel.toa > t1) {
+                u64 jump = entry(seq).jump;
+                seq = jump != HITINDEX_NONE && jump >= mBegin && entry(jump).pixel.toa > t1 ? jump : entry(seq).prev;
+            }
+            for (; seq != HITINDEX_NONE && seq >= mBegin; seq = entry(seq).prev) {
+                const Entry& e = entry(seq);
+                if (e.pixel.toa < t0)
+                    break;
+                if (!e.removed)
+                    out.push_back(seq);
+            }
+        }
+    }
+    return (unsigned)(out.size() - start);
+}
+
+unsigned HitIndex::neighbours(u32 index, std::vector<u64>& out) const
+{
+    size_t start = out.size();
+    unsigned x = index % mWidth, y = index / mWidth;
+    unsigned xEnd = PXMIN(x + 1, mWidth - 1), yEnd = PXMIN(y + 1, mHeight - 1);
+    for (unsigned ny = y ? y - 1 : 0; ny <= yEnd; ny++)
+        for (unsigned nx = x ? x - 1 : 0; nx <= xEnd; nx++)
+            for (u64 seq = mPixelLast[ny * mWidth + nx]; seq != HITINDEX_NONE; seq = entry(seq).prev)
+                out.push_back(seq);
+    return (unsigned)(out.size() - start);
+}
+
+unsigned HitIndex::selectRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1, double t0, double t1, float minTot,
+                              std::vector<u64>& out) const
+{
+    size_t start = out.size();
+    x1 = PXMIN(x1, mWidth - 1);
+    y1 = PXMIN(y1, mHeight - 1);
+    if (x0 > x1 || y0 > y1 || mBegin == mEnd)
+        return 0;
+
+    if (!mBucketHits) {
+        // no grid, the hits are time sorted: the first hit of the range by bisection, then a scan
+        u64 lo = mBegin, hi = mEnd;
+        while (lo < hi) {
+            u64 mid = lo + (hi - lo) / 2;
+            if (entry(mid).pixel.toa < t0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (u64 seq = lo; seq < mEnd; seq++) {
+            const Entry& e = entry(seq);
+            if (e.pixel.toa > t1)
+                break;
+            unsigned x = e.pixel.index % mWidth, y = e.pixel.index / mWidth;
+            if (!e.removed && x - x0 <= x1 - x0 && y - y0 <= y1 - y0 && e.pixel.tot >= minTot)
+                out.push_back(seq);
+        }
+        return (unsigned)(out.size() - start);
+    }
+
+    // first bucket that ends at or after t0, the buckets are time ordered
+    size_t lo = 0, hi = mBuckets.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mBuckets[mid]->maxToa < t0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    unsigned tx0 = x0 / mTileSize, tx1 = x1 / mTileSize, ty0 = y0 / mTileSize, ty1 = y1 / mTileSize;
+    for (size_t b = lo; b < mBuckets.size() && mBuckets[b]->minToa <= t1; b++) {
+        const Bucket* bucket = mBuckets[b];
+        size_t mark = out.size();
+        for (unsigned ty = ty0; ty <= ty1; ty++) {
+            for (unsigned tx = tx0; tx <= tx1; tx++) {
+                for (u64 seq = bucket->tileHead[ty * mTilesX + tx]; seq != HITINDEX_NONE; seq = entry(seq).tileNext) {
+                    const Entry& e = entry(seq);
+                    // the front bucket can be partly expired
+                    if (seq < mBegin || e.removed || e.pixel.toa < t0 || e.pixel.toa > t1 || e.pixel.tot < minTot)
+                        continue;
+                    unsigned x = e.pixel.index % mWidth, y = e.pixel.index / mWidth;
+                    if (x - x0 <= x1 - x0 && y - y0 <= y1 - y0)
+                        out.push_back(seq);
+                }
+            }
+        }
+        // the lists of several tiles interleave in time
+        if (tx0 != tx1 || ty0 != ty1)
+            std::sort(out.begin() + mark, out.end());
+    }
+    return (unsigned)(out.size() - start);
+}
@@ -0,0 +1,130 @@
+/**
+ * @file      hitindex.h
+ *
+ * Spatial and temporal index over a time ordered window of hits, for
+ * neighbourhood and region of interest queries without scanning the whole
+ * window. Hits are added batch by batch at the new end of the window and
+ * expired from the old end; every hit gets a sequence number that stays
+ * valid while the hit is in the window.
+ *
+ * Two structures are kept up to date as the hits come and go:
+ *
+ *   pixel table - the latest hit of every pixel, the hits of a pixel are
+ *                 a doubly linked list back in time with skip pointers
+ *                 (Myers' jump pointers), the last hit at or before t1 is
+ *                 found in O(log hits of the pixel).
+ *                 The 8 neighbours of a pixel within [t0, t1] are found by
+ *                 walking 9 lists from there.
+ *   time grid   - the window cut into buckets of bucketHits consecutive
+ *                 hits (time slices), each with a list of hits per tile of
+ *                 tileSize x tileSize pixels. A region within [t0, t1]
+ *                 visits only the buckets overlapping the time range and
+ *                 only the tiles overlapping the region.
+ *
+ * A hit can be taken out of the queries before it expires (remove), as the
+ * clustering does with the hits it has used. A region query costs the
+ * hits returned plus the other hits of the boundary tiles, a neighbourhood
+ * query the hits returned plus the skips to t1 and the removed hits of the
+ * range, which the walk passes over.
+ *
+ * Not thread safe, one index per thread.
+ *
+ */
+#ifndef HITINDEX_H
+#define HITINDEX_H
+#include "tpx3proc.h"
+#include <deque>
+#include <vector>
+
+#define HITINDEX_NONE           0xffffffffffffffffULL   // no hit
+#define HITINDEX_BUCKET_HITS    4096                    // hits per time bucket
+#define HITINDEX_TILE           16                      // tile size of the time grid [pixels]
+
+class HitIndex
+{
+public:
+    // Matrix of width x height pixels (pixel index = y * width + x), bucketHits 0 = no time grid,
+    // the region queries then scan the time range of the window
+    HitIndex(unsigned width, unsigned height, unsigned bucketHits = HITINDEX_BUCKET_HITS, unsigned tileSize = HITINDEX_TILE);
+    ~HitIndex();
+
+    // Appends time sorted hits not earlier than the last hit of the window, returns the sequence number
+    // of the first one
+    u64 add(const Tpx3Pixel* pixels, unsigned count);
+    // Expires the hits with sequence number below end / with ToA below toa
+    void expire(u64 end);
+    void expireBefore(double toa);
+    // Expires all hits and numbers the next hits from 0 again
+    void reset();
+    // Takes a hit out of the queries
+    void remove(u64 seq);
+
+    // Window [begin, end) of sequence numbers, a hit of the window may have been removed
+    u64 begin() const { return mBegin; }
+    u64 end() const { return mEnd; }
+    u64 size() const { return mEnd - mBegin; }
+    bool contains(u64 seq) const { return seq >= mBegin && seq < mEnd && !entry(seq).removed; }
+    const Tpx3Pixel& hit(u64 seq) const { return entry(seq).pixel; }
+    // Latest hit of a pixel or HITINDEX_NONE
+    u64 latest(u32 index) const { return mPixelLast[index]; }
+
+    // Appends the hits of the 3 x 3 pixels around index with ToA in [t0, t1], the hits of every pixel
+    // latest first. Returns number of hits added.
+    unsigned neighbours(u32 index, double t0, double t1, std::vector<u64>& out) const;
+    unsigned neighbours(u32 index, std::vector<u64>& out) const;
+    // Appends the hits in the rectangle [x0, x1] x [y0, y1] with ToA in [t0, t1] and ToT >= minTot,
+    // in time order. Returns number of hits added.
+    unsigned selectRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1, double t0, double t1, float minTot,
+                        std::vector<u64>& out) const;
+
+    unsigned width() const { return mWidth; }
+    unsigned height() const { return mHeight; }
+
+private:
+    struct Entry
+    {
+        Tpx3Pixel pixel;
+        u64 prev;                   // previous / next hit of the same pixel
+        u64 next;
+        u64 jump;                   // earlier hit of the same pixel, a skip pointer set when the hit is added
+        u32 depth;                  // hits of the pixel added before this one (to the oldest still there)
+        u64 tileNext;               // next hit of the same tile in the bucket
+        bool removed;
+    };
+
+    struct Bucket
+    {
+        u64 first;                  // sequence number of the first hit
+        unsigned count;
+        double minToa;
+        double maxToa;
+        std::vector<u64> tileHead;
+        std::vector<u64> tileTail;
+    };
+
+    // The expired hits of the oldest bucket stay in the ring, the tile lists still go through them
+    u64 retained() const { return mBuckets.empty() ? mBegin : mBuckets.front()->first; }
+    Entry& entry(u64 seq) { return mEntries[(size_t)(seq & mMask)]; }
+    const Entry& entry(u64 seq) const { return mEntries[(size_t)(seq & mMask)]; }
+    void grow(u64 size);
+    void unlink(u64 seq);
+    void dropBuckets();
+    Bucket* newBucket(u64 first, double toa);
+
+    unsigned mWidth;
+    unsigned mHeight;
+    unsigned mBucketHits;
+    unsigned mTileSize;
+    unsigned mTilesX;
+    unsigned mTilesY;
+    std::vector<Entry> mEntries;    // ring of the window, power of 2
+    u64 mMask;
+    u64 mBegin;
+    u64 mEnd;
+    std::vector<u64> mPixelFirst;   // oldest / latest hit of every pixel
+    std::vector<u64> mPixelLast;
+    std::deque<Bucket*> mBuckets;   // time grid, oldest first
+    std::vector<Bucket*> mFreeBuckets;
+};
+
+#endif /* end of include guard: HITINDEX_H */
@@ -0,0 +1,621 @@
+/**
+ * @file      hitstream.cpp
+ *
+ * Network streaming of Timepix3 pixel batches.
+ *
+ */
+#include "hitstream.h"
+#include "netutil.h"
+#include <cmath>
+#include <cstring>
+
+#define HITSTREAM_SOCKBUF       (8 * 1024 * 1024)
+#define HITSTREAM_MAX_PAYLOAD   (256u * 1024 * 1024)
+
+// ############################################## Sockets ############################################33
+
+static void setBufferSizes(intptr_t sock)
+{
+    int size = HITSTREAM_SOCKBUF;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+}
+
+static HitStreamHeader makeHeader(u16 type, u16 flags, u64 seq, u32 pixelCount, u32 payloadBytes)
+{
+    HitStreamHeader header;
+    header.magic = HITSTREAM_MAGIC;
+    header.type = type;
+    header.flags = flags;
+    header.seq = seq;
+    header.pixelCount = pixelCount;
+    header.payloadBytes = payloadBytes;
+    return header;
+}
+
+// ############################################## Encoding ############################################33
+
+#define HITSTREAM_TOA_TICKS     64.0    // ToA resolution of the compact encoding, ticks per ns
+#define HITSTREAM_MAX_VARINTS   (10 + 5 + 3)
+
+static inline void putVarint(std::vector<byte>& out, u64 value)
+{
+    while (value >= 0x80) {
+        out.push_back((byte)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((byte)value);
+}
+
+static inline bool getVarint(const byte*& data, const byte* end, u64* value)
+{
+    u64 result = 0;
+    for (unsigned shift = 0; shift < 64 && data < end; shift += 7) {
+        byte b = *data++;
+        result |= (u64)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned hitStreamEncode(const Tpx3Pixel* pixels, unsigned pixelCount, unsigned flags, std::vector<byte>& out, size_t maxBytes)
+{
+    if (!(flags & HITSTREAM_COMPACT)) {
+        unsigned count = (unsigned)PXMIN((size_t)pixelCount, maxBytes / sizeof(Tpx3Pixel));
+        const byte* data = (const byte*)pixels;
+        out.insert(out.end(), data, data + count * sizeof(Tpx3Pixel));
+        return count;
+    }
+
+    size_t limit = out.size() + PXMIN(maxBytes, (size_t)-1 - out.size());
+    out.reserve(out.size() + PXMIN(maxBytes, (size_t)pixelCount * 8));
+    i64 prevToa = 0;
+    unsigned i = 0;
+    for (; i < pixelCount && out.size() + HITSTREAM_MAX_VARINTS <= limit; i++) {
+        i64 toa = (i64)llround(pixels[i].toa * HITSTREAM_TOA_TICKS);
+        i64 delta = toa - prevToa;
+        prevToa = toa;
+        putVarint(out, ((u64)delta << 1) ^ (u64)(delta >> 63)); // zigzag, pixels are only nearly time ordered
+        putVarint(out, pixels[i].index);
+        putVarint(out, (u64)PXMAX(0, (int)lround(pixels[i].tot)));
+    }
+    return i;
+}
+
+int hitStreamDecode(const byte* data, size_t size, unsigned pixelCount, unsigned flags, std::vector<Tpx3Pixel>& pixels)
+{
+    // the count comes from the header, check it against the payload before allocating for it
+    if (!(flags & HITSTREAM_COMPACT)) {
+        if (size != (size_t)pixelCount * sizeof(Tpx3Pixel))
+            return PXCERR_INVALID_ARGUMENT;
+        pixels.resize(pixelCount);
+        if (pixelCount)
+            memcpy(&pixels[0], data, size);
+        return 0;
+    }
+
+    // every pixel takes at least one byte for each of its 3 varints
+    if (pixelCount > size / 3)
+        return PXCERR_INVALID_ARGUMENT;
+    pixels.resize(pixelCount);
+    const byte* end = data + size;
+    i64 toa = 0;
+    for (unsigned i = 0; i < pixelCount; i++) {
+        u64 zz, index, tot;
+        if (!getVarint(data, end, &zz) || !getVarint(data, end, &index) || !getVarint(data, end, &tot))
+            return PXCERR_INVALID_ARGUMENT;
+        toa += (i64)(zz >> 1) ^ -(i64)(zz & 1);
+        pixels[i].toa = toa / HITSTREAM_TOA_TICKS;
+        pixels[i].index = (unsigned)index;
+        pixels[i].tot = (float)tot;
+    }
+    return data == end ? 0 : PXCERR_INVALID_ARGUMENT;
+}
+
+// ############################################## Server ############################################33
+
+struct HitStreamServer::Client
+{
+    intptr_t socket;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<HitStreamMessage> queue;
+    int credits;
+    bool closed;
+    u64 sent;
+    u64 dropped;
+    std::thread sender;
+    std::thread reader;
+    std::string address;
+};
+
+HitStreamServer::HitStreamServer()
+    : mListenSocket(SOCK_INVALID)
+    , mUdpSocket(SOCK_INVALID)
+    , mFlags(0)
+    , mQueueDepth(0)
+    , mDatagramSize(0)
+    , mRunning(false)
+    , mSeq(0)
+    , mBytesSent(0)
+    , mDropped(0)
+{
+}
+
+HitStreamServer::~HitStreamServer()
+{
+    stop();
+}
+
+int HitStreamServer::start(unsigned short port, unsigned flags, unsigned queueDepth)
+{
+    if (mRunning || queueDepth == 0 || !socketsInit())
+        return PXCERR_INVALID_ARGUMENT;
+
+    intptr_t sock = (intptr_t)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == SOCK_INVALID)
+        return PXCERR_UNEXPECTED_ERROR;
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 8) != 0) {
+        closeSocket(sock);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+
+    mListenSocket = sock;
+    mFlags = flags;
+    mQueueDepth = queueDepth;
+    mRunning = true;
+    mAcceptThread = std::thread(&HitStreamServer::acceptLoop, this);
+    return 0;
+}
+
+int HitStreamServer::startMulticast(const char* group, unsigned short port, unsigned flags, unsigned datagramSize, unsigned ttl)
+{
+    if (mRunning || !group || datagramSize < sizeof(HitStreamHeader) + sizeof(Tpx3Pixel) || !socketsInit())
+        return PXCERR_INVALID_ARGUMENT;
+
+    intptr_t sock = (intptr_t)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == SOCK_INVALID)
+        return PXCERR_UNEXPECTED_ERROR;
+    setBufferSizes(sock);
+    int ttlValue = (int)ttl;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttlValue, sizeof(ttlValue));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &addr.sin_addr) != 1) {
+        closeSocket(sock);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+
+    mUdpAddress.assign((byte*)&addr, (byte*)&addr + sizeof(addr));
+    mUdpSocket = sock;
+    mFlags = flags;
+    mDatagramSize = datagramSize;
+    mRunning = true;
+    return 0;
+}
+
+void HitStreamServer::stop()
+{
+    if (!mRunning)
+        return;
+    mRunning = false;
+
+    if (mUdpSocket != SOCK_INVALID) {
+        HitStreamHeader end = makeHeader(HITSTREAM_MSG_END, (u16)mFlags, mSeq.load() + 1, 0, 0);
+        sendto(mUdpSocket, (const char*)&end, sizeof(end), 0, (const sockaddr*)&mUdpAddress[0], (socklen_t)mUdpAddress.size());
+        closeSocket(mUdpSocket);
+        mUdpSocket = SOCK_INVALID;
+    }
+
+    if (mAcceptThread.joinable())
+        mAcceptThread.join();
+    if (mListenSocket != SOCK_INVALID) {
+        closeSocket(mListenSocket);
+        mListenSocket = SOCK_INVALID;
+    }
+
+    std::vector<std::shared_ptr<Client> > clients;
+    {
+        std::lock_guard<std::mutex> lock(mClientsMutex);
+        clients.swap(mClients);
+    }
+    for (size_t i = 0; i < clients.size(); i++)
+        finishClient(*clients[i]);
+}
+
+void HitStreamServer::finishClient(Client& c)
+{
+    {
+        std::lock_guard<std::mutex> lock(c.mutex);
+        c.closed = true;
+    }
+    c.cond.notify_all();
+    c.sender.join();    // the sender flushes the queue and sends END
+#ifdef WIN32
+    shutdown((SOCKET)c.socket, SD_BOTH);
+#else
+    shutdown((int)c.socket, SHUT_RDWR);
+#endif
+    c.reader.join();
+    closeSocket(c.socket);
+}
+
+void HitStreamServer::reapClients()
+{
+    // a client is closed when its connection went down (reader) or a send failed (sender)
+    std::vector<std::shared_ptr<Client> > closed;
+    {
+        std::lock_guard<std::mutex> lock(mClientsMutex);
+        for (size_t i = 0; i < mClients.size();) {
+            bool isClosed;
+            {
+                std::lock_guard<std::mutex> clientLock(mClients[i]->mutex);
+                isClosed = mClients[i]->closed;
+            }
+            if (isClosed) {
+                closed.push_back(mClients[i]);
+                mClients.erase(mClients.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+    for (size_t i = 0; i < closed.size(); i++) {
+        Client& c = *closed[i];
+        finishClient(c);
+        printf("HitStream: client %s disconnected, sent=%llu dropped=%llu\n", c.address.c_str(), c.sent, c.dropped);
+    }
+}
+
+void HitStreamServer::acceptLoop()
+{
+    while (mRunning) {
+        reapClients();
+        if (waitReadable(mListenSocket, 100) <= 0)
+            continue;
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        intptr_t sock = (intptr_t)accept(mListenSocket, (sockaddr*)&addr, &len);
+        if (sock == SOCK_INVALID)
+            continue;
+        int yes = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+        setBufferSizes(sock);
+
+        std::shared_ptr<Client> client(new Client);
+        client->socket = sock;
+        client->credits = 0;
+        client->closed = false;
+        client->sent = 0;
+        client->dropped = 0;
+        char host[64];
+        inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+        client->address = host;
+        client->sender = std::thread(&HitStreamServer::senderLoop, this, client);
+        client->reader = std::thread(&HitStreamServer::readerLoop, this, client);
+
+        std::lock_guard<std::mutex> lock(mClientsMutex);
+        mClients.push_back(client);
+    }
+}
+
+void HitStreamServer::readerLoop(std::shared_ptr<Client> client)
+{
+    // the client only sends credit messages
+    HitStreamHeader header;
+    while (recvAll(client->socket, (byte*)&header, sizeof(header))) {
+        if (header.magic != HITSTREAM_MAGIC || header.type != HITSTREAM_MSG_CREDIT)
+            break;
+        std::lock_guard<std::mutex> lock(client->mutex);
+        client->credits += header.pixelCount;
+        client->cond.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->closed = true;
+    client->cond.notify_all();
+}
+
+void HitStreamServer::senderLoop(std::shared_ptr<Client> client)
+{
+    for (;;) {
+        HitStreamMessage msg;
+        {
+            std::unique_lock<std::mutex> lock(client->mutex);
+            client->cond.wait(lock, [&]{ return client->closed || (client->credits > 0 && !client->queue.empty()); });
+            if (client->credits <= 0 || client->queue.empty())
+                break;
+            msg = client->queue.front();
+            client->queue.pop_front();
+            client->credits--;
+        }
+        if (!sendAll(client->socket, &(*msg)[0], msg->size()))
+            break;
+        client->sent++;
+        mBytesSent += msg->size();
+    }
+
+    HitStreamHeader end = makeHeader(HITSTREAM_MSG_END, (u16)mFlags, mSeq.load() + 1, 0, 0);
+    sendAll(client->socket, (const byte*)&end, sizeof(end));
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->closed = true;
+    client->queue.clear();
+}
+
+void HitStreamServer::publish(const Tpx3Pixel* pixels, unsigned pixelCount)
+{
+    if (!mRunning || pixelCount == 0)
+        return;
+
+    if (mUdpSocket != SOCK_INVALID) {
+        // one datagram per chunk of pixels, every datagram has its own sequence number
+        std::vector<byte> datagram;
+        size_t payloadMax = mDatagramSize - sizeof(HitStreamHeader);
+        unsigned offset = 0;
+        while (offset < pixelCount) {
+            datagram.resize(sizeof(HitStreamHeader));
+            unsigned count = hitStreamEncode(pixels + offset, pixelCount - offset, mFlags, datagram, payloadMax);
+            HitStreamHeader header = makeHeader(HITSTREAM_MSG_BATCH, (u16)mFlags, ++mSeq, count, (u32)(datagram.size() - sizeof(header)));
+            memcpy(&datagram[0], &header, sizeof(header));
+            int rc = (int)sendto(mUdpSocket, (const char*)&datagram[0], (int)datagram.size(), 0,
+                                 (const sockaddr*)&mUdpAddress[0], (socklen_t)mUdpAddress.size());
+            if (rc > 0)
+                mBytesSent += rc;
+            else
+                mDropped++;
+            offset += count;
+        }
+        return;
+    }
+
+    HitStreamMessage msg(new std::vector<byte>(sizeof(HitStreamHeader)));
+    hitStreamEncode(pixels, pixelCount, mFlags, *msg);
+    HitStreamHeader header = makeHeader(HITSTREAM_MSG_BATCH, (u16)mFlags, ++mSeq, pixelCount, (u32)(msg->size() - sizeof(header)));
+    memcpy(&(*msg)[0], &header, sizeof(header));
+
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    for (size_t i = 0; i < mClients.size(); i++) {
+        Client& c = *mClients[i];
+        std::lock_guard<std::mutex> clientLock(c.mutex);
+        if (c.closed)
+            continue;
+        // the client is behind by a whole queue - drop its oldest batch, it sees the gap in sequence numbers
+        if (c.queue.size() >= mQueueDepth) {
+            c.queue.pop_front();
+            c.dropped++;
+            mDropped++;
+        }
+        c.queue.push_back(msg);
+        c.cond.notify_all();
+    }
+}
+
+unsigned HitStreamServer::clientCount()
+{
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    unsigned count = 0;
+    for (size_t i = 0; i < mClients.size(); i++) {
+        std::lock_guard<std::mutex> clientLock(mClients[i]->mutex);
+        count += !mClients[i]->closed;
+    }
+    return count;
+}
+
+unsigned HitStreamServer::maxQueued()
+{
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    size_t queued = 0;
+    for (size_t i = 0; i < mClients.size(); i++) {
+        std::lock_guard<std::mutex> clientLock(mClients[i]->mutex);
+        queued = PXMAX(queued, mClients[i]->queue.size());
+    }
+    return (unsigned)queued;
+}
+
+void HitStreamServer::printStats()
+{
+    printf("HitStream: %llu batches published, %llu bytes sent, %llu batches dropped\n", mSeq.load(), mBytesSent.load(), mDropped.load());
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    for (size_t i = 0; i < mClients.size(); i++) {
+        Client& c = *mClients[i];
+        std::lock_guard<std::mutex> clientLock(c.mutex);
+        printf("  Client %s sent=%llu dropped=%llu queued=%u credits=%d%s\n", c.address.c_str(), c.sent, c.dropped,
+               (unsigned)c.queue.size(), c.credits, c.closed ? " (closed)" : "");
+    }
+}
+
+// ############################################## Client ############################################33
+
+HitStreamClient::HitStreamClient()
+    : mSocket(SOCK_INVALID)
+    , mMulticast(false)
+    , mCredits(0)
+    , mConsumed(0)
+    , mLastSeq(0)
+    , mReceived(0)
+    , mLost(0)
+    , mBytes(0)
+{
+}
+
+HitStreamClient::~HitStreamClient()
+{
+    close();
+}
+
+int HitStreamClient::connect(const char* host, unsigned short port, unsigned credits)
+{
+    close();
+    if (!host || credits == 0 || !socketsInit())
+        return PXCERR_INVALID_ARGUMENT;
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    sprintf(service, "%u", (unsigned)port);
+    addrinfo* info = NULL;
+    if (getaddrinfo(host, service, &hints, &info) != 0 || !info)
+        return PXCERR_INVALID_ARGUMENT;
+
+    intptr_t sock = (intptr_t)socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (sock == SOCK_INVALID || ::connect(sock, info->ai_addr, (socklen_t)info->ai_addrlen) != 0) {
+        if (sock != SOCK_INVALID)
+            closeSocket(sock);
+        freeaddrinfo(info);
+        return PXCERR_DEVICE_ERROR;
+    }
+    freeaddrinfo(info);
+    int yes = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+    setBufferSizes(sock);
+
+    HitStreamHeader header = makeHeader(HITSTREAM_MSG_CREDIT, 0, 0, credits, 0);
+    if (!sendAll(sock, (const byte*)&header, sizeof(header))) {
+        closeSocket(sock);
+        return PXCERR_DEVICE_ERROR;
+    }
+    mSocket = sock;
+    mMulticast = false;
+    mCredits = credits;
+    return 0;
+}
+
+int HitStreamClient::joinMulticast(const char* group, unsigned short port, const char* iface)
+{
+    close();
+    if (!group || !socketsInit())
+        return PXCERR_INVALID_ARGUMENT;
+
+    intptr_t sock = (intptr_t)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == SOCK_INVALID)
+        return PXCERR_UNEXPECTED_ERROR;
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    setBufferSizes(sock);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0
+        || inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1
+        || (iface && inet_pton(AF_INET, iface, &mreq.imr_interface) != 1)
+        || setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq)) != 0) {
+        closeSocket(sock);
+        return PXCERR_UNEXPECTED_ERROR;
+    }
+    mSocket = sock;
+    mMulticast = true;
+    mBuffer.resize(65536);
+    return 0;
+}
+
+void HitStreamClient::close()
+{
+    if (mSocket != SOCK_INVALID)
+        closeSocket(mSocket);
+    mSocket = SOCK_INVALID;
+    mConsumed = 0;
+    mLastSeq = 0;
+}
+
+void HitStreamClient::accountSeq(u64 seq, bool batch)
+{
+    if (mLastSeq && seq > mLastSeq + 1)
+        mLost += seq - mLastSeq - 1;
+    mLastSeq = seq;
+    mReceived += batch;
+}
+
+int HitStreamClient::receive(std::vector<Tpx3Pixel>& pixels, u64* seq, unsigned timeoutMs)
+{
+    if (mSocket == SOCK_INVALID)
+        return PXCERR_DEVICE_ERROR;
+    return mMulticast ? receiveUdp(pixels, seq, timeoutMs) : receiveTcp(pixels, seq, timeoutMs);
+}
+
+int HitStreamClient::receiveTcp(std::vector<Tpx3Pixel>& pixels, u64* seq, unsigned timeoutMs)
+{
+    int rc = waitReadable(mSocket, (int)timeoutMs);
+    if (rc <= 0)
+        return rc == 0 ? 0 : PXCERR_DEVICE_ERROR;
+
+    HitStreamHeader header;
+    if (!recvAll(mSocket, (byte*)&header, sizeof(header)) || header.magic != HITSTREAM_MAGIC) {
+        close();
+        return PXCERR_DEVICE_ERROR;
+    }
+    if (header.type == HITSTREAM_MSG_END || header.type != HITSTREAM_MSG_BATCH || header.payloadBytes > HITSTREAM_MAX_PAYLOAD) {
+        // batches dropped right before the end still count as lost
+        if (header.type == HITSTREAM_MSG_END)
+            accountSeq(header.seq, false);
+        close();
+        return PXCERR_DEVICE_ERROR;
+    }
+    mBuffer.resize(header.payloadBytes);
+    if (header.payloadBytes && !recvAll(mSocket, &mBuffer[0], header.payloadBytes)) {
+        close();
+        return PXCERR_DEVICE_ERROR;
+    }
+    mBytes += sizeof(header) + header.payloadBytes;
+    if (hitStreamDecode(mBuffer.empty() ? NULL : &mBuffer[0], mBuffer.size(), header.pixelCount, header.flags, pixels)) {
+        close();
+        return PXCERR_DEVICE_ERROR;
+    }
+    accountSeq(header.seq);
+    if (seq)
+        *seq = header.seq;
+
+    // return the credits in bunches to keep the number of messages low
+    if (++mConsumed >= PXMAX(mCredits / 2, 1u)) {
+        HitStreamHeader credit = makeHeader(HITSTREAM_MSG_CREDIT, 0, 0, mConsumed, 0);
+        sendAll(mSocket, (const byte*)&credit, sizeof(credit));
+        mConsumed = 0;
+    }
+    return 1;
+}
+
+int HitStreamClient::receiveUdp(std::vector<Tpx3Pixel>& pixels, u64* seq, unsigned timeoutMs)
+{
+    int rc = waitReadable(mSocket, (int)timeoutMs);
+    if (rc <= 0)
+        return rc == 0 ? 0 : PXCERR_DEVICE_ERROR;
+
+    int size = (int)recv(mSocket, (char*)&mBuffer[0], (int)mBuffer.size(), 0);
+    if (size < (int)sizeof(HitStreamHeader))
+        return 0;
+    HitStreamHeader header;
+    memcpy(&header, &mBuffer[0], sizeof(header));
+    if (header.magic != HITSTREAM_MAGIC || header.payloadBytes != size - sizeof(header))
+        return 0;
+    if (header.type == HITSTREAM_MSG_END) {
+        accountSeq(header.seq, false);
+        return PXCERR_DEVICE_ERROR;
+    }
+    mBytes += size;
+    if (hitStreamDecode(&mBuffer[sizeof(header)], header.payloadBytes, header.pixelCount, header.flags, pixels))
+        return 0;
+    accountSeq(header.seq);
+    if (seq)
+        *seq = header.seq;
+    return 1;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file      hitstream.h
+ *
+ * Network streaming of Timepix3 pixel batches from the detector PC to
+ * remote analysis nodes.
+ *
+ * TCP mode: HitStreamServer accepts any number of HitStreamClients. Every
+ * published batch is encoded once and queued for each client. A client
+ * grants the server credits (one credit = one batch) and returns them as
+ * it consumes batches, so a slow client is never flooded; when its queue
+ * is full the oldest batch is dropped and counted. Batches carry sequence
+ * numbers, so the client counts lost batches too. The threads of a client
+ * that disconnected are joined by the accept thread.
+ *
+ * Multicast mode: batches are split into UDP datagrams with their own
+ * sequence numbers and sent to a multicast group, subscribers detect loss
+ * from the gaps. There is no flow control in this mode.
+ *
+ * With HITSTREAM_COMPACT the pixels are sent as varints of ToA delta (in
+ * 1/64 ns, exact for the 1.5625 ns fine ToA step), pixel index and ToT
+ * (rounded to integer counts), typically 5-7 bytes instead of 16 per
+ * pixel. Without it the Tpx3Pixel structures are sent as they are.
+ * Both ends are assumed to be little endian.
+ *
+ */
+#ifndef HITSTREAM_H
+#define HITSTREAM_H
+#include "pxcapi.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define HITSTREAM_MAGIC             0x33585054  // "TPX3"
+#define HITSTREAM_DEFAULT_PORT      5555
+#define HITSTREAM_COMPACT           0x01
+
+#define HITSTREAM_MSG_BATCH         1
+#define HITSTREAM_MSG_CREDIT        2
+#define HITSTREAM_MSG_END           3
+
+#pragma pack(push, 1)
+typedef struct _HitStreamHeader
+{
+    u32 magic;
+    u16 type;
+    u16 flags;
+    u64 seq;
+    u32 pixelCount;     // pixels in a batch or credits granted
+    u32 payloadBytes;
+} HitStreamHeader;
+#pragma pack(pop)
+
+// Encodes pixels into out (appended), returns number of pixels encoded.
+// At most maxBytes are appended, the remaining pixels are left for the next call.
+unsigned hitStreamEncode(const Tpx3Pixel* pixels, unsigned pixelCount, unsigned flags, std::vector<byte>& out, size_t maxBytes = (size_t)-1);
+// Decodes pixelCount pixels from data, returns 0 or PXCERR_INVALID_ARGUMENT if the data are malformed
+int hitStreamDecode(const byte* data, size_t size, unsigned pixelCount, unsigned flags, std::vector<Tpx3Pixel>& pixels);
+
+typedef std::shared_ptr<std::vector<byte> > HitStreamMessage;
+
+class HitStreamServer
+{
+public:
+    HitStreamServer();
+    ~HitStreamServer();
+
+    // Listens for TCP clients on port. queueDepth is the number of batches kept per client.
+    int start(unsigned short port = HITSTREAM_DEFAULT_PORT, unsigned flags = HITSTREAM_COMPACT, unsigned queueDepth = 64);
+    // Sends to the multicast group (e.g. "239.1.1.1"). datagramSize should fit the path MTU.
+    int startMulticast(const char* group, unsigned short port = HITSTREAM_DEFAULT_PORT, unsigned flags = HITSTREAM_COMPACT,
+                       unsigned datagramSize = 8192, unsigned ttl = 1);
+    // Sends end of stream to the clients and stops all threads
+    void stop();
+
+    // Encodes the pixels and queues them for every client (or sends them to the group). Never blocks on clients.
+    void publish(const Tpx3Pixel* pixels, unsigned pixelCount);
+
+    unsigned clientCount();
+    // Batches waiting in the queue of the most loaded client
+    unsigned maxQueued();
+    u64 batchesPublished() const { return mSeq.load(); }
+    u64 bytesSent() const { return mBytesSent.load(); }
+    u64 batchesDropped() const { return mDropped.load(); }
+    void printStats();
+
+private:
+    struct Client;
+    void acceptLoop();
+    void reapClients();
+    static void finishClient(Client& client);
+    void senderLoop(std::shared_ptr<Client> client);
+    void readerLoop(std::shared_ptr<Client> client);
+
+    intptr_t mListenSocket;
+    intptr_t mUdpSocket;
+    std::vector<byte> mUdpAddress;
+    unsigned mFlags;
+    unsigned mQueueDepth;
+    unsigned mDatagramSize;
+    std::atomic<bool> mRunning;
+    std::atomic<u64> mSeq;
+    std::atomic<u64> mBytesSent;
+    std::atomic<u64> mDropped;
+    std::thread mAcceptThread;
+    std::mutex mClientsMutex;
+    std::vector<std::shared_ptr<Client> > mClients;
+};
+
+class HitStreamClient
+{
+public:
+    HitStreamClient();
+    ~HitStreamClient();
+
+    // Connects to a server and grants it `credits` batches in flight
+    int connect(const char* host, unsigned short port = HITSTREAM_DEFAULT_PORT, unsigned credits = 16);
+    // Joins a multicast group, iface is the local interface address or NULL for any
+    int joinMulticast(const char* group, unsigned short port = HITSTREAM_DEFAULT_PORT, const char* iface = NULL);
+    void close();
+
+    // Waits up to timeoutMs for the next batch.
+    // Returns 1 when a batch was received, 0 on timeout, PXCERR_DEVICE_ERROR when the stream ended or failed.
+    int receive(std::vector<Tpx3Pixel>& pixels, u64* seq = NULL, unsigned timeoutMs = 1000);
+
+    u64 received() const { return mReceived; }
+    u64 lost() const { return mLost; }
+    u64 bytesReceived() const { return mBytes; }
+
+private:
+    int receiveTcp(std::vector<Tpx3Pixel>& pixels, u64* seq, unsigned timeoutMs);
+    int receiveUdp(std::vector<Tpx3Pixel>& pixels, u64* seq, unsigned timeoutMs);
+    void accountSeq(u64 seq, bool batch = true);
+
+    intptr_t mSocket;
+    bool mMulticast;
+    unsigned mCredits;
+    unsigned mConsumed;
+    u64 mLastSeq;
+    u64 mReceived;
+    u64 mLost;
+    u64 mBytes;
+    std::vector<byte> mBuffer;
+};
+
+#endif /* end of include guard: HITSTREAM_H */
@@ -3,8 +3,19 @@
  * @author    Daniel Turecek <daniel.turecek@advacam.com>
  */
 #include "pxcapi.h"
+#include "hitfilter.h"
+#include "hitbus.h"
+#include "hitstream.h"
+#include "ddtuner.h"
+#include "pipestats.h"
+#include "pixelstats.h"
+#include "tpx3proc.h"
+#include "hitindex.h"
 #include <cstring>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #define SINGLE_CHIP_PIXSIZE      65536
 #define ERRMSG_BUFF_SIZE         512
@@ -60,17 +71,148 @@ int multipleMeasurementTestWithCallback(unsigned deviceIndex)
 
 // ############################################## Timepix3 Examples ############################################33
 
-#define PAR_DDBLOCKSIZE         "DDBlockSize"
-#define PAR_DDBUFFSIZE          "DDBuffSize"
 #define PAR_DUMMYSPEED          "DDDummyDataSpeed"
 #define PAR_BLOCKCOUNT          "BlockCount"
 #define PAR_PROCESSDATA         "ProcessData"
 #define PAR_TRG_STG             "TrgStg"
+#define PAR_OPERATIONMODE       "OperationMode"
+
+// LED trigger pixels, the shots are bursts of LED hits as with tpx3batch --led
+#define LED_X                   5
+#define LED_Y                   5
+#define LED_RADIUS              1
+#define LED_MIN_TOT             20
+#define LED_GAP_NS              10000   // LED hits closer than this belong to one shot
 
 Tpx3Pixel* gPixels;
+HitFilter gHitFilter;
+std::vector<double> gShotTimes;     // ascending ToA [ns] of the shots of the current batch, the ToA gate is relative to them
+PixelKernels* gKernels = NULL;      // kernels for the matrix and mode of the device, picked at the start of the run
+bool gLedShots = false;             // find the shots of every batch from the LED pixels
+HitIndex* gLedIndex = NULL;         // the current batch in time order, the LED hits are a region query on it
+std::vector<Tpx3Pixel> gLedBatch;
+std::vector<u64> gLedHits;
+ShotClusterer* gClusterer = NULL;   // clusters the shots of every batch when there are shots
+ClusterParams gClusterParams = { 10 * 25, 0, 100000, 1, 40 };
+std::vector<Tpx3Pixel> gShotPixels;
+std::vector<Tpx3Pixel> gSortScratch;
+std::vector<unsigned> gShotStarts;
+std::vector<Tpx3Cluster> gClusters;
+HitBusProducer gHitBus;
+HitStreamServer gHitStream;
+DDBufferTuner* gTuner = NULL;
+double gLastToa = 0;
+u64 gConsumerDrops = 0;
+PixelStats gPixelStats;
+std::chrono::steady_clock::time_point gHealthIntervalStart;
+
+// Current Timepix3 operation mode of the device (PXC_TPX3_OPM_XX), ToA+ToT if it cannot be read
+int getDeviceOpMode(unsigned deviceIndex)
+{
+    int opMode = pxcGetDeviceParameter(deviceIndex, PAR_OPERATIONMODE);
+    if (opMode < 0) {
+        printError("Could not get operation mode, assuming ToA+ToT");
+        return PXC_TPX3_OPM_TOATOT;
+    }
+    return opMode;
+}
+
+// Tells the buffer tuner (if tuning) about a callback, also the failed ones
+static void reportCallback(unsigned pixelsReported, unsigned pixelsRead, std::chrono::steady_clock::time_point callbackStart,
+                           bool readFailed = false)
+{
+    if (gTuner)
+        gTuner->onCallback(pixelsReported, pixelsRead,
+                           std::chrono::duration<double>(std::chrono::steady_clock::now() - callbackStart).count(), readFailed);
+}
+
+// Processing kernels for the pixel matrix of the device and the operation mode, picked once before
+// the measurement (single chip, quad or any other matrix)
+PixelKernels* createDeviceKernels(unsigned deviceIndex, int opMode)
+{
+    unsigned width = 0, height = 0;
+    if (pxcGetDeviceDimensions(deviceIndex, &width, &height)) {
+        printError("Could not get device dimensions");
+        return NULL;
+    }
+    int chipCount = pxcGetDeviceChipCount(deviceIndex);
+    PixelKernels* kernels = createPixelKernels(width, height, chipCount > 0 ? chipCount : 1, opMode);
+    if (kernels)
+        printf("Pixel matrix %ux%u, %d chips, ToA %s, ToT %s\n", width, height, chipCount, kernels->hasToa() ? "yes" : "no",
+               kernels->hasTot() ? "yes" : "no");
+    return kernels;
+}
+
+// Shots of a batch from the LED pixels: bursts of at least 2 LED hits separated by more than LED_GAP_NS,
+// the first hit of a burst is the shot time. The last shot of the previous batch stays first, the hits
+// before the first new shot belong to it.
+void findLedShots(const Tpx3Pixel* pixels, unsigned pixelCount, std::vector<double>& shotTimes)
+{
+    double previous = shotTimes.empty() ? -1 : shotTimes.back();
+    shotTimes.clear();
+    if (previous >= 0)
+        shotTimes.push_back(previous);
+    if (!pixelCount)
+        return;
+
+    // the pixels of a batch are only roughly time ordered, the index takes them sorted
+    gLedBatch.assign(pixels, pixels + pixelCount);
+    sortPixelsByToa(&gLedBatch[0], pixelCount, gSortScratch);
+    gLedIndex->reset();
+    gLedIndex->add(&gLedBatch[0], pixelCount);
+    // LED hits in time order, without ToT in the mode every hit of the LED pixels counts
+    gLedHits.clear();
+    gLedIndex->selectRect(PXMAX(LED_X - LED_RADIUS, 0), PXMAX(LED_Y - LED_RADIUS, 0), LED_X + LED_RADIUS, LED_Y + LED_RADIUS,
+                          gLedBatch[0].toa, gLedBatch[pixelCount - 1].toa, gKernels && !gKernels->hasTot() ? 0 : LED_MIN_TOT,
+                          gLedHits);
+
+    double burstStart = 0, last = 0;
+    unsigned burstHits = 0;
+    for (size_t k = 0; k <= gLedHits.size(); k++) {
+        bool end = k == gLedHits.size();
+        double toa = end ? 0 : gLedIndex->hit(gLedHits[k]).toa;
+        if (end || toa - last > LED_GAP_NS) {
+            // a burst split by the batch boundary is the shot of the previous batch
+            if (burstHits >= 2 && (previous < 0 || burstStart - previous > LED_GAP_NS))
+                shotTimes.push_back(burstStart);
+            burstStart = toa;
+            burstHits = 0;
+        }
+        last = toa;
+        burstHits++;
+    }
+}
+
+// Clusters the shots of a batch into gClusters, returns number of hits in the clusters. The hits of a
+// shot that continues in the next batch are clustered per batch.
+unsigned clusterBatch(const Tpx3Pixel* pixels, unsigned pixelCount)
+{
+    gClusters.clear();
+    if (!pixelCount)
+        return 0;
+    gShotPixels.assign(pixels, pixels + pixelCount);
+    sortPixelsByToa(&gShotPixels[0], pixelCount, gSortScratch);
+    segmentShots(&gShotPixels[0], pixelCount, &gShotTimes[0], (unsigned)gShotTimes.size(), gShotStarts);
+
+    for (unsigned shot = 0; shot < gShotTimes.size(); shot++) {
+        unsigned start = gShotStarts[shot], count = gShotStarts[shot + 1] - start;
+        if (!count)
+            continue;
+        for (unsigned i = start; i < start + count; i++)
+            gShotPixels[i].toa -= gShotTimes[shot];
+        gClusterer->clusterShot(&gShotPixels[start], count, shot, gClusters);
+    }
+
+    unsigned hits = 0;
+    for (size_t i = 0; i < gClusters.size(); i++)
+        hits += gClusters[i].size;
+    return hits;
+}
 
 void onTpx3Data(intptr_t eventData, intptr_t userData)
 {
+    std::chrono::steady_clock::time_point callbackStart = std::chrono::steady_clock::now();
+    StageTimer callbackTimer(PIPE_STAGE_CALLBACK);
     int deviceIndex = userData;
     unsigned pixelCount = 0;
     int rc = pxcGetMeasuredTpx3PixelsCount(deviceIndex, &pixelCount);
@@ -78,29 +220,216 @@ void onTpx3Data(intptr_t eventData, intptr_t userData)
 
     if (rc) {
         printError("");
+        reportCallback(0, 0, callbackStart, true);
         return;
     }
 
-    rc = pxcGetMeasuredTpx3Pixels(deviceIndex, gPixels, std::min(pixelCount, (unsigned)PIXEL_BUFF_LEN));
+    unsigned pixelsReported = pixelCount;
+    pixelCount = std::min(pixelCount, (unsigned)PIXEL_BUFF_LEN);
+    StageTimer copyTimer(PIPE_STAGE_COPY);
+    rc = pxcGetMeasuredTpx3Pixels(deviceIndex, gPixels, pixelCount);
+    copyTimer.stop(pixelsReported, pixelCount);
+    if (pixelsReported > pixelCount)
+        gPipelineStats.addLoss(PIPE_LOSS_TRUNCATED, pixelsReported - pixelCount);
     if (rc) {
         printError("");
+        reportCallback(pixelsReported, 0, callbackStart, true);
         return;
     }
+    gPipelineStats.checkOrder(gPixels, pixelCount, &gLastToa);
+
+    // detector health is judged on all hits, before the filter hides any of them
+    gPixelStats.update(gPixels, pixelCount);
+    double healthInterval = std::chrono::duration<double>(callbackStart - gHealthIntervalStart).count();
+    if (healthInterval >= 1.0) {
+        if (gPixelStats.closeInterval(healthInterval))
+            gPixelStats.printAnomalies();
+        gHealthIntervalStart = callbackStart;
+    }
+
+    // shots of the batch, the ToA gate of the filter is relative to them
+    if (gLedShots && gLedIndex)
+        findLedShots(gPixels, pixelCount, gShotTimes);
+
+    // drop the hits outside the gates before any further processing
+    StageTimer filterTimer(PIPE_STAGE_FILTER);
+    unsigned pixelsIn = pixelCount;
+    pixelCount = gHitFilter.filter(gPixels, pixelCount, gShotTimes.empty() ? NULL : &gShotTimes[0], (unsigned)gShotTimes.size());
+    filterTimer.stop(pixelsIn, pixelCount);
+
+    if (gClusterer && !gShotTimes.empty()) {
+        StageTimer clusterTimer(PIPE_STAGE_CLUSTER);
+        clusterTimer.stop(pixelCount, clusterBatch(gPixels, pixelCount));
+    }
+
+    // hand the pixels to local consumer processes (writer, live view, ...) attached to the bus
+    StageTimer writeTimer(PIPE_STAGE_WRITE);
+    gHitBus.publish(gPixels, pixelCount);
+    // and to the remote analysis nodes connected over the network
+    gHitStream.publish(gPixels, pixelCount);
+    writeTimer.stop(pixelCount, pixelCount);
+
+    gHitBus.reapConsumers();
+    gPipelineStats.setQueueDepth(PIPE_QUEUE_HITBUS, gHitBus.maxConsumerLag());
+    gPipelineStats.setQueueDepth(PIPE_QUEUE_STREAM, gHitStream.maxQueued());
+    u64 consumerDrops = gHitBus.consumersDropped() + gHitStream.batchesDropped();
+    gPipelineStats.addLoss(PIPE_LOSS_CONSUMER, consumerDrops - std::min(consumerDrops, gConsumerDrops));
+    gConsumerDrops = consumerDrops;
 
     for (unsigned i = 0; i < std::min(pixelCount, (unsigned)30); i++){
         printf("Pixel: [Index=%d, ToT=%f, Toa=%f] \n", gPixels[i].index, gPixels[i].tot, gPixels[i].toa);
     }
+
+    reportCallback(pixelsReported, std::min(pixelsReported, (unsigned)PIXEL_BUFF_LEN), callbackStart);
+    callbackTimer.stop(pixelsReported, pixelCount);
 }
 
 
 void timepix3DataDrivenGetPixelsTest(unsigned deviceIndex)
 {
     gPixels = new Tpx3Pixel[PIXEL_BUFF_LEN];
-    pxcMeasureTpx3DataDrivenMode(deviceIndex, 5, "", PXC_TRG_NO, onTpx3Data, (intptr_t)deviceIndex);
+
+    // the per pixel stages are sized for the matrix of the device
+    gKernels = createDeviceKernels(deviceIndex, getDeviceOpMode(deviceIndex));
+    unsigned width = gKernels ? gKernels->width() : 256;
+    unsigned height = gKernels ? gKernels->height() : 256;
+    gHitFilter = HitFilter(width, height);
+    gShotTimes.clear();
+    gClusterer = gKernels ? gKernels->createClusterer(gClusterParams) : NULL;
+    gLedIndex = new HitIndex(width, height);
+
+    // prefilter the pixels: ToA gate in ns after each shot of gShotTimes (after ToA 0 without shots), ROI and ToT range
+    //gHitFilter.setToaGate(0, 50000);
+    //gHitFilter.addRoiRect(64, 64, 191, 191);
+    //gHitFilter.setTotRange(1, 1022);
+    // shots from the LED pixels around LED_X, LED_Y (gShotTimes stays empty otherwise)
+    //gLedShots = true;
+
+    // shared memory bus "tpx3hits" with 64 slots of 100k pixels for other local processes
+    if (gHitBus.create("tpx3hits", 64, 100000))
+        printf("Could not create hit bus\n");
+
+    // TCP stream server for remote analysis (or gHitStream.startMulticast("239.1.1.1") to fan out over UDP)
+    if (gHitStream.start(HITSTREAM_DEFAULT_PORT))
+        printf("Could not start hit stream server\n");
+
+    // pipeline stats every second: text summary, binary log and Prometheus scrape on port 9100
+    PipelineStatsExporter statsExporter;
+    gPipelineStats.reset();
+    gPipelineStats.setEnabled(true);
+    gPixelStats.reset(width, height);
+    gHealthIntervalStart = std::chrono::steady_clock::now();
+    if (statsExporter.start(1.0, "pipestats.bin", 9100))
+        printf("Could not start pipeline stats export\n");
+
+    int rc = pxcMeasureTpx3DataDrivenMode(deviceIndex, 5, "", PXC_TRG_NO, onTpx3Data, (intptr_t)deviceIndex);
+    if (rc)
+        gPipelineStats.addLoss(PIPE_LOSS_SDK);
+    statsExporter.stop();
+    printf("Prefilter kept %llu of %llu pixels\n", gHitFilter.hitsOut(), gHitFilter.hitsIn());
+    gHitBus.printConsumerStats();
+    gHitBus.close();
+    gHitStream.printStats();
+    gHitStream.stop();
+    delete gClusterer;
+    gClusterer = NULL;
+    delete gLedIndex;
+    gLedIndex = NULL;
+    delete gKernels;
+    gKernels = NULL;
     delete[] gPixels;
 }
 
 
+// Repeats short measurements and tunes DDBlockSize/DDBuffSize to the observed hit rate between them
+void timepix3DataDrivenAdaptiveTest(unsigned deviceIndex, unsigned runCount)
+{
+    const char* tuningFile = "ddtuning.txt";
+    gPixels = new Tpx3Pixel[PIXEL_BUFF_LEN];
+    // the blocks have to fit the pixel buffer of onTpx3Data
+    DDBufferTuner tuner(deviceIndex, getDeviceOpMode(deviceIndex), PIXEL_BUFF_LEN);
+    if (tuner.load(tuningFile) == 0)
+        printf("Starting from stored settings: DDBlockSize=%d MB, DDBuffSize=%d MB\n", tuner.current().blockSize, tuner.current().buffSize);
+    gTuner = &tuner;
+    // nothing exports the pipeline stats here, the stage timers would only add to the callback time
+    gPipelineStats.setEnabled(false);
+    // the detector health check still runs on every batch
+    unsigned width = 0, height = 0;
+    if (pxcGetDeviceDimensions(deviceIndex, &width, &height)) {
+        printError("Could not get device dimensions");
+        width = height = 256;
+    }
+
+    for (unsigned run = 0; run < runCount; run++) {
+        if (tuner.apply())
+            printError("Could not set data driven buffer sizes");
+        gPixelStats.reset(width, height);
+        gHealthIntervalStart = std::chrono::steady_clock::now();
+        tuner.beginRun();
+        int rc = pxcMeasureTpx3DataDrivenMode(deviceIndex, 5, "", PXC_TRG_NO, onTpx3Data, (intptr_t)deviceIndex);
+        tuner.endRun(rc);
+        if (!tuner.adapt() && run > 0)
+            break; // settled
+    }
+
+    gTuner = NULL;
+    gPipelineStats.setEnabled(true);
+    tuner.printReport();
+    tuner.save(tuningFile);
+    delete[] gPixels;
+}
+
+
+// Runs in a separate process next to timepix3DataDrivenGetPixelsTest and reads the pixels from the hit bus
+int hitBusConsumerTest(const char* consumerName)
+{
+    HitBusConsumer consumer;
+    int rc = consumer.attach("tpx3hits", consumerName);
+    if (rc) {
+        printf("Could not attach to hit bus (rc=%d)\n", rc);
+        return rc;
+    }
+
+    u64 pixelTotal = 0;
+    while (consumer.producerAlive()) {
+        unsigned pixelCount = 0;
+        const Tpx3Pixel* pixels = consumer.acquire(&pixelCount);
+        if (!pixels) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        u64 batchPixels = 0;
+        for (unsigned i = 0; i < pixelCount; i++)
+            batchPixels += pixels[i].tot > 0;
+        // a batch overwritten while it was read is torn, its pixels do not count
+        if (consumer.release())
+            pixelTotal += batchPixels;
+    }
+    printf("Consumer %s: %llu batches, %llu pixels, %llu batches dropped\n", consumerName, consumer.received(), pixelTotal, consumer.dropped());
+    return 0;
+}
+
+
+// Runs on the analysis node and receives the pixels streamed by timepix3DataDrivenGetPixelsTest
+int hitStreamClientTest(const char* host)
+{
+    HitStreamClient client;
+    int rc = client.connect(host, HITSTREAM_DEFAULT_PORT);
+    if (rc) {
+        printf("Could not connect to %s (rc=%d)\n", host, rc);
+        return rc;
+    }
+
+    std::vector<Tpx3Pixel> pixels;
+    u64 pixelTotal = 0;
+    while ((rc = client.receive(pixels)) >= 0)
+        if (rc > 0)
+            pixelTotal += pixels.size();
+    printf("Received %llu batches, %llu pixels, %llu bytes, %llu batches lost\n", client.received(), pixelTotal, client.bytesReceived(), client.lost());
+    return 0;
+}
+
+
 void timepix3DataDrivenToFileTest(unsigned deviceIndex)
 {
     // set the block and buffer size
@@ -145,6 +474,9 @@ int main (int argc, char const* argv[])
     //singleMeasurementTest(0);
     //multipleMeasurementTestWithCallback(0);
     //timepix3DataDrivenGetPixelsTest(0);
+    //timepix3DataDrivenAdaptiveTest(0, 5);
+    //hitBusConsumerTest("monitor");
+    //hitStreamClientTest("127.0.0.1");
     timepix3DataDrivenToFileTest(0);
 
 
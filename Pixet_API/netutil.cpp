@@ -0,0 +1,67 @@
+/**
+ * @file      netutil.cpp
+ *
+ * Small portable socket helpers shared by the network modules.
+ *
+ */
+#include "netutil.h"
+
+bool socketsInit()
+{
+#ifdef WIN32
+    static bool initialized = false;
+    if (!initialized) {
+        WSADATA wsa;
+        initialized = WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+    }
+    return initialized;
+#else
+    return true;
+#endif
+}
+
+int waitReadable(intptr_t sock, int timeoutMs)
+{
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int rc = pollSockets(&pfd, 1, timeoutMs);
+    if (rc < 0)
+        return -1;
+    return rc > 0 ? 1 : 0;
+}
+
+bool sendAll(intptr_t sock, const byte* data, size_t size)
+{
+    while (size > 0) {
+        int chunk = (int)PXMIN(size, (size_t)(1 << 30));
+#ifdef WIN32
+        int sent = send((SOCKET)sock, (const char*)data, chunk, 0);
+#else
+        int sent = (int)send((int)sock, data, chunk, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool recvAll(intptr_t sock, byte* data, size_t size)
+{
+    while (size > 0) {
+        int chunk = (int)PXMIN(size, (size_t)(1 << 30));
+#ifdef WIN32
+        int got = recv((SOCKET)sock, (char*)data, chunk, 0);
+#else
+        int got = (int)recv((int)sock, data, chunk, 0);
+#endif
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= got;
+    }
+    return true;
+}
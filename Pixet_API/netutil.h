@@ -0,0 +1,45 @@
+/**
+ * @file      netutil.h
+ *
+ * Small portable socket helpers shared by the network modules. Sockets are
+ * passed around as intptr_t so the public headers do not need the system
+ * socket headers; include this file only from source files.
+ *
+ */
+#ifndef NETUTIL_H
+#define NETUTIL_H
+#include "common.h"
+#include <stdint.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define SOCK_INVALID            ((intptr_t)INVALID_SOCKET)
+#define closeSocket(s)          closesocket((SOCKET)(s))
+#define pollSockets             WSAPoll
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define SOCK_INVALID            ((intptr_t)-1)
+#define closeSocket(s)          ::close((int)(s))
+#define pollSockets             poll
+#endif
+
+// Initializes the socket library (WSAStartup on Windows), returns false on failure
+bool socketsInit();
+
+// Waits until the socket is readable, returns 1 if readable, 0 on timeout, -1 on error
+int waitReadable(intptr_t sock, int timeoutMs);
+
+// Sends/receives exactly size bytes, returns false if the connection failed
+bool sendAll(intptr_t sock, const byte* data, size_t size);
+bool recvAll(intptr_t sock, byte* data, size_t size);
+
+#endif /* end of include guard: NETUTIL_H */
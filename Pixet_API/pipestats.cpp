@@ -0,0 +1,389 @@
+/**
+ * @file      pipestats.cpp
+ *
+ * Instrumentation of the pixel processing pipeline.
+ *
+ */
+#include "pipestats.h"
+#include "netutil.h"
+#include <cstring>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define PIPESTATS_TOA_ROLLOVER_NS   (1073741824.0 * 25.0 / 2.0)   // half the ToA period (26.84 s / 2)
+
+PipelineStats gPipelineStats;
+
+static const char* gStageNames[PIPE_STAGE_COUNT] = { "callback", "copy", "filter", "cluster", "write" };
+static const char* gLossNames[PIPE_LOSS_COUNT] = { "sdk", "truncated", "consumer" };
+static const char* gQueueNames[PIPE_QUEUE_COUNT] = { "hitbus", "stream" };
+static const char* gEventNames[PIPE_EVENT_COUNT] = { "rollover", "reorder" };
+
+const char* pipeStageName(unsigned stage) { return stage < PIPE_STAGE_COUNT ? gStageNames[stage] : ""; }
+const char* pipeLossName(unsigned loss) { return loss < PIPE_LOSS_COUNT ? gLossNames[loss] : ""; }
+const char* pipeQueueName(unsigned queue) { return queue < PIPE_QUEUE_COUNT ? gQueueNames[queue] : ""; }
+const char* pipeEventName(unsigned event) { return event < PIPE_EVENT_COUNT ? gEventNames[event] : ""; }
+
+// ############################################## Histogram ############################################33
+
+static inline unsigned highestBit(u64 value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (unsigned)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+unsigned LatencyHistogram::bucketIndex(u64 value)
+{
+    if (value < PIPESTATS_SUB_COUNT)
+        return (unsigned)value;
+    unsigned msb = highestBit(value);
+    unsigned shift = msb - PIPESTATS_SUB_BITS;
+    return (shift + 1) * PIPESTATS_SUB_COUNT + (unsigned)((value >> shift) & (PIPESTATS_SUB_COUNT - 1));
+}
+
+u64 LatencyHistogram::bucketValue(unsigned index)
+{
+    if (index < PIPESTATS_SUB_COUNT)
+        return index;
+    unsigned shift = index / PIPESTATS_SUB_COUNT - 1;
+    return ((u64)PIPESTATS_SUB_COUNT + index % PIPESTATS_SUB_COUNT) << shift;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    for (unsigned i = 0; i < PIPESTATS_BUCKET_COUNT; i++)
+        mCounts[i].store(0, std::memory_order_relaxed);
+    mCount.store(0, std::memory_order_relaxed);
+    mSum.store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::snapshot(LatencySnapshot& out) const
+{
+    for (unsigned i = 0; i < PIPESTATS_BUCKET_COUNT; i++)
+        out.counts[i] = mCounts[i].load(std::memory_order_relaxed);
+    out.count = mCount.load(std::memory_order_relaxed);
+    out.sum = mSum.load(std::memory_order_relaxed);
+    out.max = mMax.load(std::memory_order_relaxed);
+}
+
+u64 LatencySnapshot::percentile(double fraction) const
+{
+    u64 total = 0;
+    for (unsigned i = 0; i < PIPESTATS_BUCKET_COUNT; i++)
+        total += counts[i];
+    if (!total)
+        return 0;
+    u64 target = (u64)(fraction * total);
+    u64 seen = 0;
+    for (unsigned i = 0; i < PIPESTATS_BUCKET_COUNT; i++) {
+        seen += counts[i];
+        if (seen > target)
+            return PXMIN(LatencyHistogram::bucketValue(i + 1) - 1, max);
+    }
+    return max;
+}
+
+// ############################################## Pipeline stats ############################################33
+
+PipelineStats::PipelineStats()
+    : mEnabled(true)
+{
+    reset();
+}
+
+void PipelineStats::reset()
+{
+    mStart = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        mLatency[i].reset();
+        mHitsIn[i].store(0);
+        mHitsOut[i].store(0);
+    }
+    for (unsigned i = 0; i < PIPE_LOSS_COUNT; i++)
+        mLosses[i].store(0);
+    for (unsigned i = 0; i < PIPE_QUEUE_COUNT; i++) {
+        mQueueDepth[i].store(0);
+        mQueueMax[i].store(0);
+    }
+    for (unsigned i = 0; i < PIPE_EVENT_COUNT; i++)
+        mEvents[i].store(0);
+}
+
+u64 PipelineStats::now() const
+{
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count();
+}
+
+void PipelineStats::setQueueDepth(PipeQueue queue, u64 depth)
+{
+    mQueueDepth[queue].store(depth, std::memory_order_relaxed);
+    u64 max = mQueueMax[queue].load(std::memory_order_relaxed);
+    while (depth > max && !mQueueMax[queue].compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+}
+
+void PipelineStats::checkOrder(const Tpx3Pixel* pixels, unsigned pixelCount, double* lastToa)
+{
+    if (!enabled() || pixelCount == 0)
+        return;
+    u64 rollovers = 0;
+    u64 reorders = 0;
+    double prev = *lastToa;
+    for (unsigned i = 0; i < pixelCount; i++) {
+        double toa = pixels[i].toa;
+        // a jump back by more than half the ToA period is the counter wrapping, anything else is reordering
+        rollovers += (prev - toa) > PIPESTATS_TOA_ROLLOVER_NS;
+        reorders += (toa < prev) & ((prev - toa) <= PIPESTATS_TOA_ROLLOVER_NS);
+        prev = toa;
+    }
+    *lastToa = prev;
+    if (rollovers)
+        addEvent(PIPE_EVENT_ROLLOVER, rollovers);
+    if (reorders)
+        addEvent(PIPE_EVENT_REORDER, reorders);
+}
+
+void PipelineStats::snapshot(PipelineSnapshot& out) const
+{
+    out.timestamp = now();
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        mLatency[i].snapshot(out.latency[i]);
+        out.hitsIn[i] = mHitsIn[i].load(std::memory_order_relaxed);
+        out.hitsOut[i] = mHitsOut[i].load(std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < PIPE_LOSS_COUNT; i++)
+        out.losses[i] = mLosses[i].load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < PIPE_QUEUE_COUNT; i++) {
+        out.queueDepth[i] = mQueueDepth[i].load(std::memory_order_relaxed);
+        out.queueMax[i] = mQueueMax[i].load(std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < PIPE_EVENT_COUNT; i++)
+        out.events[i] = mEvents[i].load(std::memory_order_relaxed);
+}
+
+// ############################################## Exporter ############################################33
+
+PipelineStatsExporter::PipelineStatsExporter(PipelineStats& stats)
+    : mStats(stats)
+    , mRunning(false)
+    , mPeriod(1.0)
+    , mPrint(true)
+    , mLog(NULL)
+    , mListenSocket(SOCK_INVALID)
+{
+}
+
+PipelineStatsExporter::~PipelineStatsExporter()
+{
+    stop();
+}
+
+int PipelineStatsExporter::start(double period, const char* logFile, unsigned short scrapePort, bool printSummary)
+{
+    if (mRunning || period <= 0)
+        return PXCERR_INVALID_ARGUMENT;
+    if (logFile && !(mLog = fopen(logFile, "ab")))
+        return PXCERR_COULD_NOT_SAVE;
+
+    if (scrapePort) {
+        intptr_t sock = socketsInit() ? (intptr_t)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) : SOCK_INVALID;
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(scrapePort);
+        int yes = 1;
+        if (sock != SOCK_INVALID)
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+        if (sock == SOCK_INVALID || bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+            if (sock != SOCK_INVALID)
+                closeSocket(sock);
+            if (mLog)
+                fclose(mLog);
+            mLog = NULL;
+            return PXCERR_UNEXPECTED_ERROR;
+        }
+        mListenSocket = sock;
+    }
+
+    mPeriod = period;
+    mPrint = printSummary;
+    mRunning = true;
+    mThread = std::thread(&PipelineStatsExporter::loop, this);
+    return 0;
+}
+
+void PipelineStatsExporter::stop()
+{
+    if (!mRunning)
+        return;
+    mRunning = false;
+    mThread.join();
+    exportNow();
+    if (mListenSocket != SOCK_INVALID)
+        closeSocket(mListenSocket);
+    mListenSocket = SOCK_INVALID;
+    if (mLog)
+        fclose(mLog);
+    mLog = NULL;
+}
+
+void PipelineStatsExporter::exportNow()
+{
+    std::vector<PipelineSnapshot> snap(1);
+    mStats.snapshot(snap[0]);
+    if (mLog) {
+        writeLogRecord(snap[0], mLog);
+        fflush(mLog);
+    }
+    if (mPrint)
+        printSummary(snap[0]);
+}
+
+void PipelineStatsExporter::loop()
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point next = Clock::now() + std::chrono::microseconds((i64)(mPeriod * 1e6));
+    while (mRunning) {
+        int waitMs = (int)PXMAX(0LL, (long long)std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count());
+        if (mListenSocket != SOCK_INVALID)
+            serveScrape(PXMIN(waitMs, 100));
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(PXMIN(waitMs, 100)));
+        if (Clock::now() >= next) {
+            exportNow();
+            next += std::chrono::microseconds((i64)(mPeriod * 1e6));
+        }
+    }
+}
+
+void PipelineStatsExporter::serveScrape(int timeoutMs)
+{
+    if (waitReadable(mListenSocket, timeoutMs) <= 0)
+        return;
+    intptr_t sock = (intptr_t)accept(mListenSocket, NULL, NULL);
+    if (sock == SOCK_INVALID)
+        return;
+
+    // any request gets the metrics, read whatever the client sent first
+    char request[1024];
+    if (waitReadable(sock, 1000) > 0)
+        recv(sock, request, sizeof(request), 0);
+
+    std::vector<PipelineSnapshot> snap(1);
+    mStats.snapshot(snap[0]);
+    std::string body = prometheusText(snap[0]);
+    char header[160];
+    sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+            (unsigned)body.size());
+    sendAll(sock, (const byte*)header, strlen(header));
+    sendAll(sock, (const byte*)body.data(), body.size());
+    closeSocket(sock);
+}
+
+void PipelineStatsExporter::printSummary(const PipelineSnapshot& snap, FILE* out)
+{
+    fprintf(out, "Pipeline stats at %.3f s\n", snap.timestamp * 1e-9);
+    fprintf(out, "  %-9s %10s %14s %14s %10s %10s %10s %10s\n", "stage", "batches", "hits in", "hits out", "p50[us]", "p99[us]", "max[us]", "mean[us]");
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        const LatencySnapshot& l = snap.latency[i];
+        if (!l.count)
+            continue;
+        fprintf(out, "  %-9s %10llu %14llu %14llu %10.1f %10.1f %10.1f %10.1f\n", pipeStageName(i), l.count, snap.hitsIn[i], snap.hitsOut[i],
+                l.percentile(0.5) * 1e-3, l.percentile(0.99) * 1e-3, l.max * 1e-3, l.mean() * 1e-3);
+    }
+    fprintf(out, "  losses:");
+    for (unsigned i = 0; i < PIPE_LOSS_COUNT; i++)
+        fprintf(out, " %s=%llu", pipeLossName(i), snap.losses[i]);
+    fprintf(out, "\n  queues:");
+    for (unsigned i = 0; i < PIPE_QUEUE_COUNT; i++)
+        fprintf(out, " %s=%llu(max %llu)", pipeQueueName(i), snap.queueDepth[i], snap.queueMax[i]);
+    fprintf(out, "\n  events:");
+    for (unsigned i = 0; i < PIPE_EVENT_COUNT; i++)
+        fprintf(out, " %s=%llu", pipeEventName(i), snap.events[i]);
+    fprintf(out, "\n");
+}
+
+std::string PipelineStatsExporter::prometheusText(const PipelineSnapshot& snap)
+{
+    std::string text;
+    char line[256];
+    text += "# TYPE tpx3_stage_latency_seconds summary\n";
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        const LatencySnapshot& l = snap.latency[i];
+        const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+        for (unsigned k = 0; k < sizeof(q) / sizeof(q[0]); k++) {
+            sprintf(line, "tpx3_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", pipeStageName(i), q[k], l.percentile(q[k]) * 1e-9);
+            text += line;
+        }
+        sprintf(line, "tpx3_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", pipeStageName(i), l.sum * 1e-9);
+        text += line;
+        sprintf(line, "tpx3_stage_latency_seconds_count{stage=\"%s\"} %llu\n", pipeStageName(i), l.count);
+        text += line;
+    }
+    text += "# TYPE tpx3_stage_hits_in_total counter\n";
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        sprintf(line, "tpx3_stage_hits_in_total{stage=\"%s\"} %llu\n", pipeStageName(i), snap.hitsIn[i]);
+        text += line;
+    }
+    text += "# TYPE tpx3_stage_hits_out_total counter\n";
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        sprintf(line, "tpx3_stage_hits_out_total{stage=\"%s\"} %llu\n", pipeStageName(i), snap.hitsOut[i]);
+        text += line;
+    }
+    text += "# TYPE tpx3_loss_total counter\n";
+    for (unsigned i = 0; i < PIPE_LOSS_COUNT; i++) {
+        sprintf(line, "tpx3_loss_total{cause=\"%s\"} %llu\n", pipeLossName(i), snap.losses[i]);
+        text += line;
+    }
+    text += "# TYPE tpx3_queue_depth gauge\n";
+    for (unsigned i = 0; i < PIPE_QUEUE_COUNT; i++) {
+        sprintf(line, "tpx3_queue_depth{queue=\"%s\"} %llu\n", pipeQueueName(i), snap.queueDepth[i]);
+        text += line;
+    }
+    text += "# TYPE tpx3_events_total counter\n";
+    for (unsigned i = 0; i < PIPE_EVENT_COUNT; i++) {
+        sprintf(line, "tpx3_events_total{event=\"%s\"} %llu\n", pipeEventName(i), snap.events[i]);
+        text += line;
+    }
+    return text;
+}
+
+void PipelineStatsExporter::writeLogRecord(const PipelineSnapshot& snap, FILE* out)
+{
+    // record: magic, version, timestamp, counts, then per stage the nonzero buckets as (index, count)
+    u32 head[6] = { PIPESTATS_LOG_MAGIC, PIPESTATS_LOG_VERSION, PIPE_STAGE_COUNT, PIPE_LOSS_COUNT, PIPE_QUEUE_COUNT, PIPE_EVENT_COUNT };
+    fwrite(head, sizeof(head), 1, out);
+    fwrite(&snap.timestamp, sizeof(u64), 1, out);
+    for (unsigned i = 0; i < PIPE_STAGE_COUNT; i++) {
+        const LatencySnapshot& l = snap.latency[i];
+        u64 values[5] = { snap.hitsIn[i], snap.hitsOut[i], l.count, l.sum, l.max };
+        fwrite(values, sizeof(values), 1, out);
+        u32 nonzero = 0;
+        for (unsigned b = 0; b < PIPESTATS_BUCKET_COUNT; b++)
+            nonzero += l.counts[b] != 0;
+        fwrite(&nonzero, sizeof(nonzero), 1, out);
+        for (u32 b = 0; b < PIPESTATS_BUCKET_COUNT; b++) {
+            if (!l.counts[b])
+                continue;
+            fwrite(&b, sizeof(b), 1, out);
+            fwrite(&l.counts[b], sizeof(u64), 1, out);
+        }
+    }
+    fwrite(snap.losses, sizeof(u64), PIPE_LOSS_COUNT, out);
+    fwrite(snap.queueDepth, sizeof(u64), PIPE_QUEUE_COUNT, out);
+    fwrite(snap.queueMax, sizeof(u64), PIPE_QUEUE_COUNT, out);
+    fwrite(snap.events, sizeof(u64), PIPE_EVENT_COUNT, out);
+}
@@ -0,0 +1,230 @@
+/**
+ * @file      pipestats.h
+ *
+ * Instrumentation of the pixel processing pipeline: latency histograms per
+ * stage, hit in/out counters, loss counters, queue depths and ToA rollover
+ * and reorder events.
+ *
+ * All recording is done with relaxed atomic increments, no locks. Stages
+ * are timed per batch, not per pixel, so with batches of thousands of
+ * pixels the cost is two clock reads and a few increments per stage and
+ * callback, plus the order check over the ToA of the batch. tpx3bench
+ * measures it against the same callback work without stats: the timers
+ * add well under 1 %, the order check a few ns per pixel (about 5 % of
+ * converting, sorting and encoding a batch). Snapshots are taken by PipelineStatsExporter, which writes
+ * them to a binary log, prints a text summary and serves them in the
+ * Prometheus text format on a TCP port.
+ *
+ */
+#ifndef PIPESTATS_H
+#define PIPESTATS_H
+#include "pxcapi.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// log-linear (HDR) buckets: 2^PIPESTATS_SUB_BITS buckets per power of two, ~6 % relative precision
+#define PIPESTATS_SUB_BITS          4
+#define PIPESTATS_SUB_COUNT         (1 << PIPESTATS_SUB_BITS)
+#define PIPESTATS_BUCKET_COUNT      ((64 - PIPESTATS_SUB_BITS + 1) * PIPESTATS_SUB_COUNT)
+
+#define PIPESTATS_LOG_MAGIC         0x54535050  // "PPST"
+#define PIPESTATS_LOG_VERSION       1
+
+typedef enum _PipeStage
+{
+    PIPE_STAGE_CALLBACK = 0,    // whole new data callback
+    PIPE_STAGE_COPY,            // reading the pixels from the SDK
+    PIPE_STAGE_FILTER,
+    PIPE_STAGE_CLUSTER,
+    PIPE_STAGE_WRITE,           // storage / bus / network
+    PIPE_STAGE_COUNT,
+} PipeStage;
+
+typedef enum _PipeLoss
+{
+    PIPE_LOSS_SDK = 0,          // measurement failed / SDK buffer overflow
+    PIPE_LOSS_TRUNCATED,        // more pixels than the read buffer (PIXEL_BUFF_LEN)
+    PIPE_LOSS_CONSUMER,         // batches dropped for a slow consumer
+    PIPE_LOSS_COUNT,
+} PipeLoss;
+
+typedef enum _PipeQueue
+{
+    PIPE_QUEUE_HITBUS = 0,      // hit bus batches not read by the slowest consumer
+    PIPE_QUEUE_STREAM,          // batches queued for network clients
+    PIPE_QUEUE_COUNT,
+} PipeQueue;
+
+typedef enum _PipeEvent
+{
+    PIPE_EVENT_ROLLOVER = 0,    // ToA counter wrapped around
+    PIPE_EVENT_REORDER,         // pixel older than the previous one
+    PIPE_EVENT_COUNT,
+} PipeEvent;
+
+const char* pipeStageName(unsigned stage);
+const char* pipeLossName(unsigned loss);
+const char* pipeQueueName(unsigned queue);
+const char* pipeEventName(unsigned event);
+
+// Plain copy of a histogram for reporting
+struct LatencySnapshot
+{
+    u64 counts[PIPESTATS_BUCKET_COUNT];
+    u64 count;
+    u64 sum;
+    u64 max;
+
+    double mean() const { return count ? (double)sum / count : 0; }
+    // Value (ns) below which the given fraction (0-1) of the samples lies
+    u64 percentile(double fraction) const;
+};
+
+// Lock-free HDR style histogram of latencies in ns
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    void record(u64 ns)
+    {
+        mCounts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        mSum.fetch_add(ns, std::memory_order_relaxed);
+        u64 max = mMax.load(std::memory_order_relaxed);
+        while (ns > max && !mMax.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+    void snapshot(LatencySnapshot& out) const;
+    void reset();
+
+    static unsigned bucketIndex(u64 value);
+    // lowest value falling into the bucket
+    static u64 bucketValue(unsigned index);
+
+private:
+    std::atomic<u64> mCounts[PIPESTATS_BUCKET_COUNT];
+    std::atomic<u64> mCount;
+    std::atomic<u64> mSum;
+    std::atomic<u64> mMax;
+};
+
+struct PipelineSnapshot
+{
+    u64 timestamp;              // ns since the stats were reset
+    LatencySnapshot latency[PIPE_STAGE_COUNT];
+    u64 hitsIn[PIPE_STAGE_COUNT];
+    u64 hitsOut[PIPE_STAGE_COUNT];
+    u64 losses[PIPE_LOSS_COUNT];
+    u64 queueDepth[PIPE_QUEUE_COUNT];
+    u64 queueMax[PIPE_QUEUE_COUNT];
+    u64 events[PIPE_EVENT_COUNT];
+};
+
+class PipelineStats
+{
+public:
+    PipelineStats();
+
+    void setEnabled(bool enabled) { mEnabled.store(enabled, std::memory_order_relaxed); }
+    bool enabled() const { return mEnabled.load(std::memory_order_relaxed); }
+
+    void recordLatency(PipeStage stage, u64 ns) { mLatency[stage].record(ns); }
+    void addHits(PipeStage stage, u64 in, u64 out)
+    {
+        mHitsIn[stage].fetch_add(in, std::memory_order_relaxed);
+        mHitsOut[stage].fetch_add(out, std::memory_order_relaxed);
+    }
+    void addLoss(PipeLoss loss, u64 count = 1) { mLosses[loss].fetch_add(count, std::memory_order_relaxed); }
+    void addEvent(PipeEvent event, u64 count = 1) { mEvents[event].fetch_add(count, std::memory_order_relaxed); }
+    void setQueueDepth(PipeQueue queue, u64 depth);
+
+    // Counts rollover and reorder events in a batch, lastToa carries the previous batch's last ToA
+    void checkOrder(const Tpx3Pixel* pixels, unsigned pixelCount, double* lastToa);
+
+    void snapshot(PipelineSnapshot& out) const;
+    void reset();
+
+    // ns since reset, the time base of the snapshots
+    u64 now() const;
+
+private:
+    std::atomic<bool> mEnabled;
+    std::chrono::steady_clock::time_point mStart;
+    LatencyHistogram mLatency[PIPE_STAGE_COUNT];
+    std::atomic<u64> mHitsIn[PIPE_STAGE_COUNT];
+    std::atomic<u64> mHitsOut[PIPE_STAGE_COUNT];
+    std::atomic<u64> mLosses[PIPE_LOSS_COUNT];
+    std::atomic<u64> mQueueDepth[PIPE_QUEUE_COUNT];
+    std::atomic<u64> mQueueMax[PIPE_QUEUE_COUNT];
+    std::atomic<u64> mEvents[PIPE_EVENT_COUNT];
+};
+
+extern PipelineStats gPipelineStats;
+
+// Times a scope into a stage histogram, does nothing when the stats are disabled
+class StageTimer
+{
+public:
+    StageTimer(PipeStage stage, PipelineStats& stats = gPipelineStats)
+        : mStats(stats)
+        , mStage(stage)
+        , mActive(stats.enabled())
+    {
+        if (mActive)
+            mStart = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() { stop(); }
+
+    // Records the latency now instead of at the end of the scope, optionally with the hits in/out of the stage
+    void stop(u64 hitsIn = 0, u64 hitsOut = 0)
+    {
+        if (!mActive)
+            return;
+        mActive = false;
+        u64 ns = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count();
+        mStats.recordLatency(mStage, ns);
+        if (hitsIn || hitsOut)
+            mStats.addHits(mStage, hitsIn, hitsOut);
+    }
+
+private:
+    PipelineStats& mStats;
+    PipeStage mStage;
+    bool mActive;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+// Periodically snapshots the stats: binary log, text summary and Prometheus scrape endpoint
+class PipelineStatsExporter
+{
+public:
+    PipelineStatsExporter(PipelineStats& stats = gPipelineStats);
+    ~PipelineStatsExporter();
+
+    // logFile - binary snapshot log (NULL = none), scrapePort - HTTP port for /metrics (0 = none),
+    // printSummary - print a text summary every period
+    int start(double period, const char* logFile, unsigned short scrapePort = 0, bool printSummary = true);
+    void stop();
+
+    // Writes one snapshot/summary immediately
+    void exportNow();
+
+    static void printSummary(const PipelineSnapshot& snap, FILE* out = stdout);
+    static std::string prometheusText(const PipelineSnapshot& snap);
+    static void writeLogRecord(const PipelineSnapshot& snap, FILE* out);
+
+private:
+    void loop();
+    void serveScrape(int timeoutMs);
+
+    PipelineStats& mStats;
+    std::atomic<bool> mRunning;
+    std::thread mThread;
+    double mPeriod;
+    bool mPrint;
+    FILE* mLog;
+    intptr_t mListenSocket;
+};
+
+#endif /* end of include guard: PIPESTATS_H */
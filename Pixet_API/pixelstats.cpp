@@ -0,0 +1,290 @@
+/**
+ * @file      pixelstats.cpp
+ *
+ * Streaming per-pixel statistics for detector health monitoring.
+ *
+ */
+#include "pixelstats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const char* gAnomalyNames[PIXEL_ANOMALY_COUNT] = { "noisy", "rate jump", "dead", "ToT drift", "noisy column" };
+
+const char* pixelAnomalyName(unsigned type) { return type < PIXEL_ANOMALY_COUNT ? gAnomalyNames[type] : ""; }
+
+void pixelStatsDefaultThresholds(PixelStatsThresholds& thresholds)
+{
+    thresholds.baselineAlpha = 0.05;
+    thresholds.warmupIntervals = 5;
+    thresholds.noisyFactor = 20;
+    thresholds.minNoisyRate = 10;
+    thresholds.jumpFactor = 10;
+    thresholds.jumpMinHits = 50;
+    thresholds.deadExpected = 20;
+    thresholds.totDriftSigma = 6;
+    thresholds.totMinHits = 50;
+    thresholds.columnFactor = 5;
+}
+
+PixelStats::PixelStats(unsigned width, unsigned height)
+    : mWidth(width)
+    , mHeight(height)
+    , mSize(width * height)
+    , mIntervals(0)
+{
+    pixelStatsDefaultThresholds(mThresholds);
+    resizeArrays();
+}
+
+void PixelStats::resizeArrays()
+{
+    mCount.assign(mSize, 0);
+    mMean.assign(mSize, 0);
+    mM2.assign(mSize, 0);
+    mLastToa.assign(mSize, 0);
+    mIntervalCount.assign(mSize, 0);
+    mIntervalTot.assign(mSize, 0);
+    mBatchCount.assign(mSize, 0);
+    mBatchTot.assign(mSize, 0);
+    mBatchTot2.assign(mSize, 0);
+    mRate.assign(mSize, 0);
+    mBaseRate.assign(mSize, 0);
+    mBaseTot.assign(mSize, 0);
+    mScratch.assign(PXMAX(mSize, mWidth), 0);
+    mFlagged.assign(mSize, 0);
+}
+
+void PixelStats::setThresholds(const PixelStatsThresholds& thresholds)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mThresholds = thresholds;
+}
+
+void PixelStats::reset(unsigned width, unsigned height)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (width && height) {
+        mWidth = width;
+        mHeight = height;
+        mSize = width * height;
+    }
+    mIntervals = 0;
+    mAnomalies.clear();
+    resizeArrays();
+}
+
+// ##########################################################################################33
+//                                      UPDATES
+// ##########################################################################################33
+
+void PixelStats::update(const Tpx3Pixel* pixels, unsigned pixelCount)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    double* __restrict count = &mCount[0];
+    double* __restrict mean = &mMean[0];
+    double* __restrict m2 = &mM2[0];
+    double* __restrict lastToa = &mLastToa[0];
+    double* __restrict intervalCount = &mIntervalCount[0];
+    double* __restrict intervalTot = &mIntervalTot[0];
+
+    if (pixelCount < mSize) {
+        // Welford's update directly, cheaper than a pass over the whole chip
+        for (unsigned i = 0; i < pixelCount; i++) {
+            unsigned idx = pixels[i].index;
+            if (idx >= mSize)
+                continue;
+            double tot = pixels[i].tot;
+            double n = ++count[idx];
+            double delta = tot - mean[idx];
+            mean[idx] += delta / n;
+            m2[idx] += delta * (tot - mean[idx]);
+            lastToa[idx] = pixels[i].toa;
+            intervalCount[idx] += 1;
+            intervalTot[idx] += tot;
+        }
+        return;
+    }
+
+    double* __restrict batchCount = &mBatchCount[0];
+    double* __restrict batchTot = &mBatchTot[0];
+    double* __restrict batchTot2 = &mBatchTot2[0];
+    for (unsigned i = 0; i < pixelCount; i++) {
+        unsigned idx = pixels[i].index;
+        if (idx >= mSize)
+            continue;
+        double tot = pixels[i].tot;
+        batchCount[idx] += 1;
+        batchTot[idx] += tot;
+        batchTot2[idx] += tot * tot;
+        lastToa[idx] = pixels[i].toa;
+    }
+    mergeBatch();
+}
+
+void PixelStats::mergeBatch()
+{
+    double* __restrict count = &mCount[0];
+    double* __restrict mean = &mMean[0];
+    double* __restrict m2 = &mM2[0];
+    double* __restrict intervalCount = &mIntervalCount[0];
+    double* __restrict intervalTot = &mIntervalTot[0];
+    double* __restrict batchCount = &mBatchCount[0];
+    double* __restrict batchTot = &mBatchTot[0];
+    double* __restrict batchTot2 = &mBatchTot2[0];
+
+    // Chan et al.: combine (n, mean, M2) of the pixel with the batch, branch free so that the loop vectorizes
+    for (unsigned i = 0; i < mSize; i++) {
+        double nb = batchCount[i];
+        double n = count[i] + nb;
+        double invNb = 1.0 / PXMAX(nb, 1.0);
+        double invN = 1.0 / PXMAX(n, 1.0);
+        double meanB = batchTot[i] * invNb;
+        double m2B = batchTot2[i] - batchTot[i] * meanB;
+        double delta = meanB - mean[i];
+        double w = nb * invN;
+        mean[i] += delta * w;
+        m2[i] += m2B + delta * delta * count[i] * w;
+        count[i] = n;
+        intervalCount[i] += nb;
+        intervalTot[i] += batchTot[i];
+    }
+    memset(batchCount, 0, mSize * sizeof(double));
+    memset(batchTot, 0, mSize * sizeof(double));
+    memset(batchTot2, 0, mSize * sizeof(double));
+}
+
+// ##########################################################################################33
+//                                     INTERVALS
+// ##########################################################################################33
+
+static float median(std::vector<float>& values, size_t count)
+{
+    if (!count)
+        return 0;
+    std::nth_element(values.begin(), values.begin() + count / 2, values.begin() + count);
+    return values[count / 2];
+}
+
+unsigned PixelStats::closeInterval(double seconds)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mAnomalies.clear();
+    if (seconds <= 0)
+        return 0;
+
+    const PixelStatsThresholds& th = mThresholds;
+    float invSeconds = (float)(1.0 / seconds);
+    float* __restrict rate = &mRate[0];
+    const double* __restrict intervalCount = &mIntervalCount[0];
+    for (unsigned i = 0; i < mSize; i++)
+        rate[i] = (float)intervalCount[i] * invSeconds;
+
+    std::copy(mRate.begin(), mRate.end(), mScratch.begin());
+    float medianRate = median(mScratch, mSize);
+    float noisyRate = (float)PXMAX(th.noisyFactor * medianRate, th.minNoisyRate);
+
+    // columns: summed rates against the median column
+    for (unsigned x = 0; x < mWidth; x++) {
+        float sum = 0;
+        for (unsigned y = 0; y < mHeight; y++)
+            sum += rate[y * mWidth + x];
+        mScratch[x] = sum;
+    }
+    std::vector<float> columns(mScratch.begin(), mScratch.begin() + mWidth);
+    float medianColumn = median(mScratch, mWidth);
+
+    bool warm = mIntervals >= th.warmupIntervals;
+    for (unsigned i = 0; i < mSize; i++) {
+        PixelAnomaly a;
+        a.index = i;
+        a.type = PIXEL_ANOMALY_COUNT;
+        double hits = intervalCount[i];
+        if (rate[i] > noisyRate) {
+            a.type = PIXEL_NOISY;
+            a.value = rate[i];
+            a.baseline = medianRate;
+        } else if (warm && rate[i] > th.jumpFactor * mBaseRate[i] && hits >= th.jumpMinHits) {
+            a.type = PIXEL_RATE_JUMP;
+            a.value = rate[i];
+            a.baseline = mBaseRate[i];
+        } else if (warm && hits == 0 && mBaseRate[i] * seconds >= th.deadExpected) {
+            a.type = PIXEL_DEAD;
+            a.value = 0;
+            a.baseline = mBaseRate[i];
+        } else if (warm && hits >= th.totMinHits && mCount[i] > 1) {
+            // standard error of the interval mean from the long term variance
+            double mean = mIntervalTot[i] / hits;
+            double sem = sqrt(mM2[i] / (mCount[i] - 1) / hits);
+            if (fabs(mean - mBaseTot[i]) > th.totDriftSigma * PXMAX(sem, 0.5)) {
+                a.type = PIXEL_TOT_DRIFT;
+                a.value = (float)mean;
+                a.baseline = mBaseTot[i];
+            }
+        }
+        mFlagged[i] = a.type != PIXEL_ANOMALY_COUNT;
+        if (mFlagged[i])
+            mAnomalies.push_back(a);
+    }
+    for (unsigned x = 0; x < mWidth; x++) {
+        if (columns[x] > th.columnFactor * medianColumn && columns[x] > th.minNoisyRate) {
+            PixelAnomaly a;
+            a.index = x;
+            a.type = PIXEL_NOISY_COLUMN;
+            a.value = columns[x];
+            a.baseline = medianColumn;
+            mAnomalies.push_back(a);
+        }
+    }
+
+    // rolling baselines, the flagged pixels are left out so that a fault does not become the new normal
+    float alpha = mIntervals ? (float)th.baselineAlpha : 1.0f;
+    for (unsigned i = 0; i < mSize; i++) {
+        if (mFlagged[i])
+            continue;
+        double hits = intervalCount[i];
+        mBaseRate[i] += alpha * (rate[i] - mBaseRate[i]);
+        if (hits > 0) {
+            float mean = (float)(mIntervalTot[i] / hits);
+            mBaseTot[i] = mBaseTot[i] == 0 ? mean : mBaseTot[i] + alpha * (mean - mBaseTot[i]);
+        }
+    }
+
+    std::fill(mIntervalCount.begin(), mIntervalCount.end(), 0);
+    std::fill(mIntervalTot.begin(), mIntervalTot.end(), 0);
+    mIntervals++;
+    return (unsigned)mAnomalies.size();
+}
+
+void PixelStats::snapshot(PixelStatsSnapshot& out) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    out.count = mCount;
+    out.totMean = mMean;
+    out.totVariance.resize(mSize);
+    for (unsigned i = 0; i < mSize; i++)
+        out.totVariance[i] = mCount[i] > 1 ? mM2[i] / (mCount[i] - 1) : 0;
+    out.lastToa = mLastToa;
+    out.rate = mRate;
+    out.baseRate = mBaseRate;
+    out.intervals = mIntervals;
+}
+
+void PixelStats::printAnomalies(unsigned maxLines) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    unsigned counts[PIXEL_ANOMALY_COUNT] = { 0 };
+    for (size_t i = 0; i < mAnomalies.size(); i++)
+        counts[mAnomalies[i].type]++;
+    printf("Pixel health (interval %u):", mIntervals);
+    for (unsigned t = 0; t < PIXEL_ANOMALY_COUNT; t++)
+        printf(" %s %u%s", pixelAnomalyName(t), counts[t], t + 1 < PIXEL_ANOMALY_COUNT ? "," : "\n");
+    for (size_t i = 0; i < PXMIN(mAnomalies.size(), (size_t)maxLines); i++) {
+        const PixelAnomaly& a = mAnomalies[i];
+        if (a.type == PIXEL_NOISY_COLUMN)
+            printf("  column %3u       %-12s %10.2f (baseline %.2f)\n", a.index, pixelAnomalyName(a.type), a.value, a.baseline);
+        else
+            printf("  pixel [%3u, %3u] %-12s %10.2f (baseline %.2f)\n", a.index % mWidth, a.index / mWidth,
+                   pixelAnomalyName(a.type), a.value, a.baseline);
+    }
+}
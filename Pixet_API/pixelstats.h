@@ -0,0 +1,132 @@
+/**
+ * @file      pixelstats.h
+ *
+ * Streaming per-pixel statistics for detector health monitoring: hit
+ * count and rate, running mean and variance of ToT (Welford) and the
+ * time of the last hit, for every pixel of the chip.
+ *
+ * The statistics are kept as structure of arrays, one contiguous array per
+ * quantity. A batch is first scattered into per-pixel batch sums, which
+ * are then merged into the running statistics in one pass over the arrays
+ * (Chan's parallel form of Welford's update). That pass has no branches
+ * and is vectorized by the compiler. Batches with fewer hits than the
+ * chip has pixels are cheaper to merge hit by hit, so they are.
+ *
+ * closeInterval() turns the hits since the previous call into rates and
+ * compares each pixel with its rolling (exponentially averaged) baseline
+ * and with the chip median. Noisy and dead pixels, noisy columns and ToT
+ * drift are reported as anomalies.
+ *
+ */
+#ifndef PIXELSTATS_H
+#define PIXELSTATS_H
+#include "pxcapi.h"
+#include <mutex>
+#include <vector>
+
+typedef enum _PixelAnomalyType
+{
+    PIXEL_NOISY = 0,        // rate far above the chip median
+    PIXEL_RATE_JUMP,        // rate far above the pixel's own baseline
+    PIXEL_DEAD,             // no hits where the baseline expects some
+    PIXEL_TOT_DRIFT,        // interval ToT mean away from the baseline
+    PIXEL_NOISY_COLUMN,     // column rate far above the median column (index = column)
+    PIXEL_ANOMALY_COUNT,
+} PixelAnomalyType;
+
+const char* pixelAnomalyName(unsigned type);
+
+typedef struct _PixelAnomaly
+{
+    unsigned index;         // pixel index, column for PIXEL_NOISY_COLUMN
+    PixelAnomalyType type;
+    float value;            // rate [hits/s] or ToT mean in the interval
+    float baseline;
+} PixelAnomaly;
+
+typedef struct _PixelStatsThresholds
+{
+    double baselineAlpha;   // weight of a new interval in the rolling baseline
+    unsigned warmupIntervals;
+    double noisyFactor;     // rate > noisyFactor * chip median (and > minNoisyRate)
+    double minNoisyRate;    // hits/s
+    double jumpFactor;      // rate > jumpFactor * baseline
+    unsigned jumpMinHits;   // hits in the interval needed for a rate jump (Poisson noise of quiet pixels)
+    double deadExpected;    // dead if no hits while the baseline expects at least this many
+    double totDriftSigma;   // |mean - baseline| > totDriftSigma * standard error of the mean
+    unsigned totMinHits;    // hits in the interval needed for the ToT check
+    double columnFactor;    // column rate > columnFactor * median column rate
+} PixelStatsThresholds;
+
+void pixelStatsDefaultThresholds(PixelStatsThresholds& thresholds);
+
+// Copy of the statistics for readers (live view, logging)
+struct PixelStatsSnapshot
+{
+    std::vector<double> count;
+    std::vector<double> totMean;
+    std::vector<double> totVariance;
+    std::vector<double> lastToa;
+    std::vector<float> rate;        // last closed interval [hits/s]
+    std::vector<float> baseRate;
+    unsigned intervals;
+};
+
+class PixelStats
+{
+public:
+    PixelStats(unsigned width = 256, unsigned height = 256);
+
+    void setThresholds(const PixelStatsThresholds& thresholds);
+    const PixelStatsThresholds& thresholds() const { return mThresholds; }
+
+    void update(const Tpx3Pixel* pixels, unsigned pixelCount);
+
+    // Ends the current interval of the given duration, updates the baselines and the anomalies.
+    // Returns number of anomalies.
+    unsigned closeInterval(double seconds);
+    const std::vector<PixelAnomaly>& anomalies() const { return mAnomalies; }
+
+    void snapshot(PixelStatsSnapshot& out) const;
+    // Clears the statistics, a nonzero width and height change the size of the matrix
+    void reset(unsigned width = 0, unsigned height = 0);
+
+    // Prints the anomalies of the last interval, at most maxLines of them
+    void printAnomalies(unsigned maxLines = 20) const;
+
+    unsigned width() const { return mWidth; }
+    unsigned height() const { return mHeight; }
+
+private:
+    void mergeBatch();
+    void resizeArrays();
+
+    mutable std::mutex mMutex;
+    unsigned mWidth;
+    unsigned mHeight;
+    unsigned mSize;
+    PixelStatsThresholds mThresholds;
+
+    // running statistics
+    std::vector<double> mCount;
+    std::vector<double> mMean;
+    std::vector<double> mM2;
+    std::vector<double> mLastToa;
+    // current interval
+    std::vector<double> mIntervalCount;
+    std::vector<double> mIntervalTot;
+    // per-batch sums
+    std::vector<double> mBatchCount;
+    std::vector<double> mBatchTot;
+    std::vector<double> mBatchTot2;
+    // baselines and last closed interval
+    std::vector<float> mRate;
+    std::vector<float> mBaseRate;
+    std::vector<float> mBaseTot;
+    std::vector<float> mScratch;
+    std::vector<byte> mFlagged;
+    unsigned mIntervals;
+    std::vector<PixelAnomaly> mAnomalies;
+};
+
+#endif /* end of include guard: PIXELSTATS_H */
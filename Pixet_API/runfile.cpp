@@ -0,0 +1,361 @@
+/**
+ * @file      runfile.cpp
+ *
+ * Chunked reading of recorded run files.
+ *
+ */
+#include "runfile.h"
+#include "tpx3proc.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#ifdef TPX3_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+// ##########################################################################################33
+//                                   FILE DISCOVERY
+// ##########################################################################################33
+
+static bool endsWith(const std::string& name, const char* suffix)
+{
+    size_t length = strlen(suffix);
+    return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+}
+
+// PyPix writes <name>_0000.hdf5, older runs are .h5
+static bool isRunFile(const std::string& name)
+{
+    return endsWith(name, ".h5") || endsWith(name, ".hdf5");
+}
+
+static void scanDirectory(const std::string& dir, std::vector<std::string>& files)
+{
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        std::string name = data.cFileName;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + PATH_SEPAR_STR + name;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            scanDirectory(path, files);
+        else if (isRunFile(name))
+            files.push_back(path);
+    } while (FindNextFileA(h, &data));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return;
+    while (struct dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + PATH_SEPAR_STR + name;
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            scanDirectory(path, files);
+        else if (isRunFile(name))
+            files.push_back(path);
+    }
+    closedir(d);
+#endif
+}
+
+int discoverRunFiles(const char* path, std::vector<std::string>& files)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return PXCERR_INVALID_ARGUMENT;
+    size_t before = files.size();
+    if (S_ISDIR(st.st_mode))
+        scanDirectory(path, files);
+    else
+        files.push_back(path);
+    std::sort(files.begin() + before, files.end());
+    return 0;
+}
+
+// ##########################################################################################33
+//                                      RUN FILE
+// ##########################################################################################33
+
+#ifdef TPX3_HAVE_HDF5
+
+// the HDF5 library (serial build) must not be entered from two threads at once
+static std::mutex gHdf5Mutex;
+
+static hsize_t datasetLength(hid_t file, const char* name)
+{
+    hid_t ds = H5Dopen2(file, name, H5P_DEFAULT);
+    if (ds < 0)
+        return 0;
+    hid_t space = H5Dget_space(ds);
+    hsize_t dims[2] = { 0, 0 };
+    if (H5Sget_simple_extent_ndims(space) == 1)
+        H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    H5Dclose(ds);
+    return dims[0];
+}
+
+// Reads rows [first, first + count) of a 1D dataset converted to memType
+static int readRows(hid_t file, const char* name, u64 first, u64 count, hid_t memType, void* out)
+{
+    hid_t ds = H5Dopen2(file, name, H5P_DEFAULT);
+    if (ds < 0)
+        return PXCERR_INVALID_ARGUMENT;
+    hid_t space = H5Dget_space(ds);
+    hsize_t start = first, n = count;
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, &start, NULL, &n, NULL);
+    hid_t mem = H5Screate_simple(1, &n, NULL);
+    herr_t rc = H5Dread(ds, memType, mem, space, H5P_DEFAULT, out);
+    H5Sclose(mem);
+    H5Sclose(space);
+    H5Dclose(ds);
+    return rc < 0 ? PXCERR_UNEXPECTED_ERROR : 0;
+}
+
+static herr_t collectName(hid_t, const char* name, const H5L_info_t*, void* data)
+{
+    ((std::vector<std::string>*)data)->push_back(name);
+    return 0;
+}
+
+static bool byBatchTime(const std::string& a, const std::string& b)
+{
+    return atof(a.c_str()) < atof(b.c_str());
+}
+
+#endif
+
+RunFile::RunFile()
+    : mFile(-1)
+    , mLayout(RUN_LAYOUT_NONE)
+    , mWidth(TPX3_CHIP_WIDTH)
+    , mHitCount(0)
+    , mFirstToa(0)
+    , mFirstTime(0)
+{
+}
+
+RunFile::~RunFile()
+{
+    close();
+}
+
+int RunFile::open(const char* fileName, u64 chunkHits, unsigned width)
+{
+    close();
+    mWidth = width;
+#ifdef TPX3_HAVE_HDF5
+    std::lock_guard<std::mutex> lock(gHdf5Mutex);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+    hid_t file = H5Fopen(fileName, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file < 0) {
+        printf("Cannot open %s\n", fileName);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    mFile = file;
+    mFileName = fileName;
+    chunkHits = PXMAX(chunkHits, (u64)1);
+    int rc = PXCERR_NOT_SUPPORTED;
+    if (H5Lexists(file, "ToA", H5P_DEFAULT) > 0 && H5Lexists(file, "Frame", H5P_DEFAULT) > 0)
+        rc = splitEvents(chunkHits);
+    else if (H5Lexists(file, "Index", H5P_DEFAULT) > 0 && H5Lexists(file, "ToA", H5P_DEFAULT) > 0)
+        rc = splitBatches(chunkHits);
+    else
+        printf("%s: unknown layout\n", fileName);
+    if (rc) {
+        H5Fclose(file);
+        mFile = -1;
+    }
+    return rc;
+#else
+    (void)chunkHits;
+    printf("%s: built without HDF5 support\n", fileName);
+    return PXCERR_NOT_SUPPORTED;
+#endif
+}
+
+void RunFile::close()
+{
+#ifdef TPX3_HAVE_HDF5
+    if (mFile >= 0) {
+        std::lock_guard<std::mutex> lock(gHdf5Mutex);
+        H5Fclose((hid_t)mFile);
+    }
+#endif
+    mFile = -1;
+    mLayout = RUN_LAYOUT_NONE;
+    mHitCount = 0;
+    mFirstToa = 0;
+    mFirstTime = 0;
+    mChunks.clear();
+}
+
+int RunFile::splitEvents(u64 chunkHits)
+{
+#ifdef TPX3_HAVE_HDF5
+    hid_t file = (hid_t)mFile;
+    mLayout = RUN_LAYOUT_EVENTS;
+    mHitCount = datasetLength(file, "ToA");
+    if (datasetLength(file, "Frame") != mHitCount)
+        return PXCERR_INVALID_ARGUMENT;
+
+    // move every nominal boundary forward to the start of the next shot
+    std::vector<u32> frames(4096);
+    u64 first = 0;
+    while (first < mHitCount) {
+        u64 end = PXMIN(first + chunkHits, mHitCount);
+        if (end < mHitCount) {
+            u32 shot;
+            readRows(file, "Frame", end - 1, 1, H5T_NATIVE_UINT32, &shot);
+            bool found = false;
+            while (!found && end < mHitCount) {
+                u64 n = PXMIN((u64)frames.size(), mHitCount - end);
+                readRows(file, "Frame", end, n, H5T_NATIVE_UINT32, &frames[0]);
+                u64 k = 0;
+                while (k < n && frames[k] == shot)
+                    k++;
+                end += k;
+                found = k < n;
+            }
+        }
+        Chunk c;
+        c.first = first;
+        c.count = end - first;
+        c.time = 0;
+        mChunks.push_back(c);
+        first = end;
+    }
+    return 0;
+#else
+    (void)chunkHits;
+    return PXCERR_NOT_SUPPORTED;
+#endif
+}
+
+int RunFile::splitBatches(u64 chunkHits)
+{
+#ifdef TPX3_HAVE_HDF5
+    hid_t file = (hid_t)mFile;
+    mLayout = RUN_LAYOUT_BATCHES;
+    hid_t group = H5Gopen2(file, "Index", H5P_DEFAULT);
+    if (group < 0)
+        return PXCERR_INVALID_ARGUMENT;
+    std::vector<std::string> names;
+    H5Literate(group, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, collectName, &names);
+    H5Gclose(group);
+    std::sort(names.begin(), names.end(), byBatchTime);
+
+    Chunk c;
+    c.first = 0;
+    c.count = 0;
+    c.time = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        u64 n = datasetLength(file, ("Index/" + names[i]).c_str());
+        if (c.datasets.empty())
+            c.time = atof(names[i].c_str());
+        c.datasets.push_back(names[i]);
+        c.count += n;
+        mHitCount += n;
+        if (c.count >= chunkHits) {
+            mChunks.push_back(c);
+            c.datasets.clear();
+            c.first += c.count;
+            c.count = 0;
+        }
+    }
+    if (!c.datasets.empty())
+        mChunks.push_back(c);
+
+    // raw ToA of the first pixel and time of the first batch anchor the unwrapping of the chunks
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string name = "ToA/" + names[i];
+        if (datasetLength(file, name.c_str()) && !readRows(file, name.c_str(), 0, 1, H5T_NATIVE_DOUBLE, &mFirstToa)) {
+            mFirstTime = atof(names[i].c_str());
+            break;
+        }
+    }
+    return 0;
+#else
+    (void)chunkHits;
+    return PXCERR_NOT_SUPPORTED;
+#endif
+}
+
+int RunFile::readChunk(unsigned index, RunChunkData& out) const
+{
+    if (index >= mChunks.size())
+        return PXCERR_INVALID_ARGUMENT;
+    const Chunk& c = mChunks[index];
+    out.pixels.resize(c.count);
+    out.shots.clear();
+    out.batchTime = c.time;
+    out.shotRelative = mLayout == RUN_LAYOUT_EVENTS;
+    if (!c.count)
+        return 0;
+
+#ifdef TPX3_HAVE_HDF5
+    hid_t file = (hid_t)mFile;
+    std::vector<u32> a(c.count), b(c.count);
+    std::vector<double> toa(c.count), tot;
+    int rc = 0;
+    {
+        std::lock_guard<std::mutex> lock(gHdf5Mutex);
+        if (mLayout == RUN_LAYOUT_EVENTS) {
+            out.shots.resize(c.count);
+            tot.resize(c.count);
+            rc |= readRows(file, "X", c.first, c.count, H5T_NATIVE_UINT32, &a[0]);
+            rc |= readRows(file, "Y", c.first, c.count, H5T_NATIVE_UINT32, &b[0]);
+            rc |= readRows(file, "ToA", c.first, c.count, H5T_NATIVE_DOUBLE, &toa[0]);
+            rc |= readRows(file, "ToT", c.first, c.count, H5T_NATIVE_DOUBLE, &tot[0]);
+            rc |= readRows(file, "Frame", c.first, c.count, H5T_NATIVE_UINT32, &out.shots[0]);
+        } else {
+            u64 row = 0;
+            for (size_t d = 0; d < c.datasets.size() && !rc; d++) {
+                std::string name = c.datasets[d];
+                u64 n = datasetLength(file, ("Index/" + name).c_str());
+                if (!n)
+                    continue;
+                rc |= readRows(file, ("Index/" + name).c_str(), 0, n, H5T_NATIVE_UINT32, &a[row]);
+                rc |= readRows(file, ("ToT/" + name).c_str(), 0, n, H5T_NATIVE_UINT32, &b[row]);
+                rc |= readRows(file, ("ToA/" + name).c_str(), 0, n, H5T_NATIVE_DOUBLE, &toa[row]);
+                row += n;
+            }
+        }
+    }
+    if (rc)
+        return PXCERR_UNEXPECTED_ERROR;
+
+    for (u64 i = 0; i < c.count; i++) {
+        Tpx3Pixel& p = out.pixels[i];
+        if (mLayout == RUN_LAYOUT_EVENTS) {
+            p.index = b[i] * mWidth + a[i];
+            p.tot = (float)tot[i];
+        } else {
+            p.index = a[i];
+            p.tot = (float)b[i];
+        }
+        p.toa = toa[i];
+    }
+    return 0;
+#else
+    return PXCERR_NOT_SUPPORTED;
+#endif
+}
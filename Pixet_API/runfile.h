@@ -0,0 +1,94 @@
+/**
+ * @file      runfile.h
+ *
+ * Reading of recorded run files (HDF5) in independent chunks for offline
+ * (re)processing. Two layouts are recognised:
+ *
+ *   events  - flat datasets X, Y, ToA, ToT, Frame with ToA relative to the
+ *             shot and the shot number (the input of centroid_shots)
+ *   batches - groups Index, ToT and ToA with one dataset per data driven
+ *             batch, named by the acquisition time in seconds (PyPix.py);
+ *             ToA is the raw, wrapping ToA
+ *
+ * Chunks of the events layout never split a shot. Chunks of the batches
+ * layout are runs of whole batches; the batch time is returned so that
+ * the chunk can be unwrapped on its own (ToaUnwrapper::setReference).
+ *
+ * The HDF5 library is not thread safe, all calls are serialized by a
+ * global lock. Build with TPX3_HAVE_HDF5 defined and linked to HDF5,
+ * without it open() returns PXCERR_NOT_SUPPORTED.
+ *
+ */
+#ifndef RUNFILE_H
+#define RUNFILE_H
+#include "tpx3proc.h"
+#include <string>
+#include <vector>
+
+typedef enum _RunLayout
+{
+    RUN_LAYOUT_NONE = 0,
+    RUN_LAYOUT_EVENTS,
+    RUN_LAYOUT_BATCHES,
+} RunLayout;
+
+// Finds the run files (.h5, .hdf5) in path (file or directory, recursively), sorted by name
+int discoverRunFiles(const char* path, std::vector<std::string>& files);
+
+struct RunChunkData
+{
+    std::vector<Tpx3Pixel> pixels;
+    std::vector<u32> shots;     // shot of every pixel (events layout)
+    bool shotRelative;          // ToA relative to the shot (events layout) or raw (batches layout)
+    double batchTime;           // acquisition time of the first batch [s] (batches layout)
+};
+
+class RunFile
+{
+public:
+    RunFile();
+    ~RunFile();
+
+    // Opens the file and splits it into chunks of about chunkHits pixels, width is the width of the
+    // detector matrix (pixel index = y * width + x)
+    int open(const char* fileName, u64 chunkHits, unsigned width = TPX3_CHIP_WIDTH);
+    void close();
+
+    RunLayout layout() const { return mLayout; }
+    unsigned chunkCount() const { return (unsigned)mChunks.size(); }
+    u64 hitCount() const { return mHitCount; }
+    const std::string& fileName() const { return mFileName; }
+
+    // Batches layout: raw ToA of the first pixel of the run, start of the unwrapped time axis
+    double firstToa() const { return mFirstToa; }
+    // Batches layout: unwrapped ToA [ns] expected at the acquisition time batchTime [s]
+    double expectedToa(double batchTime) const { return mFirstToa + (batchTime - mFirstTime) * 1e9; }
+    // Batches layout: acquisition time of the first batch of a chunk [s], known without reading it
+    double chunkTime(unsigned index) const { return index < mChunks.size() ? mChunks[index].time : 0; }
+
+    // Reads one chunk, can be called from several threads
+    int readChunk(unsigned index, RunChunkData& out) const;
+
+private:
+    struct Chunk
+    {
+        u64 first;                  // events: first row
+        u64 count;
+        double time;                // batches: acquisition time of the first batch
+        std::vector<std::string> datasets;
+    };
+
+    int splitEvents(u64 chunkHits);
+    int splitBatches(u64 chunkHits);
+
+    std::string mFileName;
+    i64 mFile;                      // hid_t
+    RunLayout mLayout;
+    unsigned mWidth;
+    u64 mHitCount;
+    double mFirstToa;
+    double mFirstTime;
+    std::vector<Chunk> mChunks;
+};
+
+#endif /* end of include guard: RUNFILE_H */
@@ -0,0 +1,204 @@
+/**
+ * @file      cluster_test.cpp
+ *
+ * Checks the clusterers against a direct port of centroid_shots from the
+ * centroiding notebook on deterministic synthetic shots: the number of
+ * clusters, their centroids, summed ToT, size, seed ToA and spread must
+ * be the same.
+ *
+ * The port keeps the notebook's search: the seed is the first unused hit
+ * of the shot with ToA in [min_t, max_t], then at most max_cluster_size + 10
+ * sweeps over the hits after the seed, a hit within the time window of the
+ * seed joins when its 3x3 neighbourhood (centre included) has a member, the
+ * centroid is weighted by 1 / (t - t_seed + 1). It sums the ToT of the
+ * members where the notebook keeps the ToT of the seed. The synthetic hits
+ * stay off the matrix edge, where the notebook's image wraps around.
+ *
+ */
+#include "../tpx3proc.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+
+static int gFailures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); gFailures++; } } while (0)
+
+struct Rng
+{
+    Rng(u64 seed) : state(seed) {}
+    unsigned next(unsigned range)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned)(state >> 33) % range;
+    }
+    u64 state;
+};
+
+// ##########################################################################################33
+//                                 NOTEBOOK REFERENCE
+// ##########################################################################################33
+
+static void centroidShot(const std::vector<Tpx3Pixel>& hits, u32 shot, const ClusterParams& params, std::vector<Tpx3Cluster>& out)
+{
+    const unsigned side = TPX3_CHIP_WIDTH;
+    std::vector<unsigned> image(side * side, 0);    // image[row = x, col = y], event number of the hit there
+    std::vector<bool> found(hits.size(), false);
+    std::vector<size_t> cluster;
+    unsigned eventNo = 0;
+
+    for (size_t i = 0; i < hits.size(); i++) {
+        if (found[i])
+            continue;
+        double seedT = hits[i].toa;
+        if (seedT < params.minToa || seedT > params.maxToa)
+            continue;
+        found[i] = true;
+        eventNo++;
+        cluster.assign(1, i);
+        image[(hits[i].index % side) * side + hits[i].index / side] = eventNo;
+        double maxT = seedT + params.timeWindow;
+
+        bool foundNeighbour = true;
+        for (unsigned sweep = 0; sweep < params.maxSize + 10 && foundNeighbour; sweep++) {
+            foundNeighbour = false;
+            for (size_t j = i; j < hits.size(); j++) {
+                if (found[j] || hits[j].toa < seedT || hits[j].toa > maxT)
+                    continue;
+                int row = (int)(hits[j].index % side);
+                int col = (int)(hits[j].index / side);
+                bool touches = false;
+                for (int r = row - 1; r <= row + 1 && !touches; r++)
+                    for (int c = col - 1; c <= col + 1 && !touches; c++)
+                        touches = r >= 0 && c >= 0 && r < (int)side && c < (int)side && image[r * side + c] == eventNo;
+                if (touches) {
+                    found[j] = true;
+                    image[row * side + col] = eventNo;
+                    cluster.push_back(j);
+                    foundNeighbour = true;
+                }
+            }
+        }
+
+        if (cluster.size() < params.minSize || cluster.size() > params.maxSize)
+            continue;
+        double xSum = 0, ySum = 0, tSum = 0, totSum = 0;
+        double minT = seedT, maxClusterT = seedT;
+        for (size_t k = 0; k < cluster.size(); k++) {
+            const Tpx3Pixel& p = hits[cluster[k]];
+            double time = p.toa - seedT + 1;
+            xSum += (p.index % side) / time;
+            ySum += (p.index / side) / time;
+            tSum += 1 / time;
+            totSum += p.tot;
+            minT = PXMIN(minT, p.toa);
+            maxClusterT = PXMAX(maxClusterT, p.toa);
+        }
+        Tpx3Cluster c;
+        c.toa = seedT;
+        c.x = (float)(xSum / tSum);
+        c.y = (float)(ySum / tSum);
+        c.tot = (float)totSum;
+        c.spread = (float)(maxClusterT - minT);
+        c.shot = shot;
+        c.size = (u32)cluster.size();
+        out.push_back(c);
+    }
+}
+
+// ##########################################################################################33
+//                                   SYNTHETIC SHOTS
+// ##########################################################################################33
+
+// Time sorted hits of one shot, ToA relative to the shot in fine ToA steps so that hits tie
+static std::vector<Tpx3Pixel> makeShot(Rng& rng)
+{
+    std::vector<Tpx3Pixel> hits;
+    unsigned clusters = 20 + rng.next(60);
+    for (unsigned k = 0; k < clusters; k++) {
+        // dense spots so that clusters touch and compete for hits
+        unsigned x = 2 + rng.next(40);
+        unsigned y = 2 + rng.next(40);
+        double t = 1.5625 * rng.next(70000);
+        unsigned size = 1 + rng.next(12);
+        for (unsigned h = 0; h < size; h++) {
+            Tpx3Pixel p;
+            p.index = y * TPX3_CHIP_WIDTH + x;
+            p.toa = t + 1.5625 * rng.next(200);     // partly beyond the time window
+            p.tot = 25.0f * (1 + rng.next(40));
+            hits.push_back(p);
+            // random walk, staying put repeats the pixel
+            unsigned dx = rng.next(3), dy = rng.next(3);
+            x = PXMIN(PXMAX(x + dx - 1, 1u), TPX3_CHIP_WIDTH - 2);
+            y = PXMIN(PXMAX(y + dy - 1, 1u), TPX3_CHIP_HEIGHT - 2);
+        }
+    }
+    // a line whose hits come later towards the seed, each sweep finds one more hit
+    unsigned line = 20;
+    for (unsigned h = 0; h < line; h++) {
+        Tpx3Pixel p;
+        p.index = 100 * TPX3_CHIP_WIDTH + 100 + h;
+        p.toa = 50000 + (h ? 1.5625 * (line - h) : 0);
+        p.tot = 100;
+        hits.push_back(p);
+    }
+    // noise, some of it outside the seed range
+    for (unsigned h = 0; h < 200; h++) {
+        Tpx3Pixel p;
+        p.index = (1 + rng.next(TPX3_CHIP_HEIGHT - 2)) * TPX3_CHIP_WIDTH + 1 + rng.next(TPX3_CHIP_WIDTH - 2);
+        p.toa = 1.5625 * rng.next(80000);
+        p.tot = 25;
+        hits.push_back(p);
+    }
+    std::stable_sort(hits.begin(), hits.end(), [](const Tpx3Pixel& a, const Tpx3Pixel& b) { return a.toa < b.toa; });
+    return hits;
+}
+
+static bool sameCluster(const Tpx3Cluster& a, const Tpx3Cluster& b)
+{
+    return a.toa == b.toa && a.shot == b.shot && a.size == b.size && a.tot == b.tot && a.spread == b.spread
+        && fabs(a.x - b.x) < 1e-4 && fabs(a.y - b.y) < 1e-4;
+}
+
+static void testClusterer(const char* name, ShotClusterer& clusterer, const ClusterParams& params)
+{
+    printf("%s: window %.0f, seeds [%.0f, %.0f], size [%u, %u]\n", name, params.timeWindow, params.minToa, params.maxToa,
+           params.minSize, params.maxSize);
+    Rng rng(12345);
+    unsigned total = 0;
+    for (u32 shot = 0; shot < 20; shot++) {
+        std::vector<Tpx3Pixel> hits = makeShot(rng);
+        std::vector<Tpx3Cluster> expected, actual;
+        centroidShot(hits, shot, params, expected);
+        // the clusterer is reused from shot to shot
+        unsigned added = clusterer.clusterShot(&hits[0], (unsigned)hits.size(), shot, actual);
+        CHECK(added == actual.size());
+        CHECK(actual.size() == expected.size());
+        unsigned mismatches = 0;
+        for (size_t k = 0; k < PXMIN(actual.size(), expected.size()); k++)
+            mismatches += !sameCluster(actual[k], expected[k]);
+        CHECK(mismatches == 0);
+        total += (unsigned)expected.size();
+    }
+    printf("  %u clusters\n", total);
+    CHECK(total > 0);
+}
+
+int main()
+{
+    ClusterParams params[] = {
+        { 10 * 25, 0, 100000, 1, 40 },      // the defaults of the demo and tpx3batch
+        { 250, 10000, 60000, 2, 5 },        // narrow seed range, large clusters rejected
+        { 40, 0, 100000, 1, 3 },            // short window, few sweeps
+    };
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        HitClusterer single(params[i]);
+        testClusterer("single chip", single, params[i]);
+        std::unique_ptr<PixelKernels> kernels(createPixelKernels(TPX3_CHIP_WIDTH, TPX3_CHIP_HEIGHT, 1, PXC_TPX3_OPM_TOATOT));
+        std::unique_ptr<ShotClusterer> clusterer(kernels->createClusterer(params[i]));
+        testClusterer("kernels", *clusterer, params[i]);
+    }
+    printf(gFailures ? "FAILED (%d)\n" : "OK\n", gFailures);
+    return gFailures ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file      eventfile_test.cpp
+ *
+ * Round trip of the event file: the writer writes deterministic events in
+ * small chunks, the reader has to return them unchanged, a query on shots
+ * has to skip the chunks outside its range and damaged files have to be
+ * rejected. The file is kept for the numpy reader, eventfile_test.py
+ * checks it the same way.
+ *
+ *     eventfile_test <file.t3ev>
+ *
+ */
+#include "../eventfile.h"
+#include <cstdio>
+#include <cstring>
+
+static int gFailures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); gFailures++; } } while (0)
+
+#define EVENT_COUNT     10007
+#define CHUNK_ROWS      1000
+
+// Event i, the values are exact in float, eventfile_test.py computes the same
+static EventRecord expectedEvent(unsigned i)
+{
+    EventRecord e;
+    e.shot = i / 7;
+    e.x = (float)((i * 37) % 256) + 0.25f;
+    e.y = (float)((i * 91) % 256) + 0.5f;
+    e.toa = (i % 1000) * 1.5625;
+    e.tot = (float)((i % 50) * 25);
+    e.size = 1 + i % 9;
+    return e;
+}
+
+static bool sameEvent(const EventRecord& a, const EventRecord& b)
+{
+    return a.shot == b.shot && a.x == b.x && a.y == b.y && a.toa == b.toa && a.tot == b.tot && a.size == b.size;
+}
+
+static int writeEvents(const char* fileName)
+{
+    std::vector<Tpx3Cluster> clusters(EVENT_COUNT);
+    for (unsigned i = 0; i < EVENT_COUNT; i++) {
+        EventRecord e = expectedEvent(i);
+        Tpx3Cluster& c = clusters[i];
+        memset(&c, 0, sizeof(c));
+        c.shot = (u32)e.shot;
+        c.x = e.x;
+        c.y = e.y;
+        c.toa = e.toa;
+        c.tot = e.tot;
+        c.size = e.size;
+    }
+    EventFileWriter writer;
+    int rc = writer.open(fileName, CHUNK_ROWS);
+    // in two calls that do not end on a chunk boundary
+    if (!rc)
+        rc = writer.write(&clusters[0], 1234);
+    if (!rc)
+        rc = writer.write(&clusters[1234], EVENT_COUNT - 1234);
+    int rcClose = writer.close();
+    return rc ? rc : rcClose;
+}
+
+// Copies the file with the bytes in [offset, offset + size) replaced by data (NULL = cut the file at offset)
+static void writeDamaged(const char* fileName, const char* damagedName, long offset, const void* data, size_t size)
+{
+    std::vector<byte> bytes;
+    FILE* f = fopen(fileName, "rb");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        bytes.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        if (fread(&bytes[0], 1, bytes.size(), f) != bytes.size())
+            bytes.clear();
+        fclose(f);
+    }
+    if (offset < 0)
+        offset += (long)bytes.size();
+    if (data)
+        memcpy(&bytes[offset], data, size);
+    else
+        bytes.resize(offset);
+    f = fopen(damagedName, "wb");
+    if (f) {
+        if (!bytes.empty())
+            fwrite(&bytes[0], 1, bytes.size(), f);
+        fclose(f);
+    }
+}
+
+static void testDamaged(const char* fileName)
+{
+    std::string damaged = std::string(fileName) + ".damaged";
+    EventFileTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    FILE* f = fopen(fileName, "rb");
+    CHECK(f && fseek(f, -(long)sizeof(trailer), SEEK_END) == 0 && fread(&trailer, sizeof(trailer), 1, f) == 1);
+    if (f)
+        fclose(f);
+    u64 directory = trailer.directoryOffset;
+    EventFileReader reader;
+
+    printf("  expect 4 rejected files:\n");
+    // not closed: no trailer
+    writeDamaged(fileName, damaged.c_str(), (long)directory, NULL, 0);
+    CHECK(reader.open(damaged.c_str()) != 0);
+    // row count of the trailer does not add up
+    EventFileTrailer wrongRows = trailer;
+    wrongRows.rowCount++;
+    writeDamaged(fileName, damaged.c_str(), -(long)sizeof(trailer), &wrongRows, sizeof(wrongRows));
+    CHECK(reader.open(damaged.c_str()) != 0);
+    // chunk reaching into the directory
+    u64 offset = directory;
+    writeDamaged(fileName, damaged.c_str(), (long)directory, &offset, sizeof(offset));
+    CHECK(reader.open(damaged.c_str()) != 0);
+    // more chunks than the file holds
+    EventFileTrailer wrongCount = trailer;
+    wrongCount.chunkCount = 1ULL << 60;
+    writeDamaged(fileName, damaged.c_str(), -(long)sizeof(trailer), &wrongCount, sizeof(wrongCount));
+    CHECK(reader.open(damaged.c_str()) != 0);
+    remove(damaged.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    const char* fileName = argc > 1 ? argv[1] : "eventfile_test.t3ev";
+    printf("Writing %u events to %s\n", EVENT_COUNT, fileName);
+    CHECK(writeEvents(fileName) == 0);
+
+    EventFileReader reader;
+    CHECK(reader.open(fileName) == 0);
+    CHECK(reader.rowCount() == EVENT_COUNT);
+    CHECK(reader.chunkCount() == (EVENT_COUNT + CHUNK_ROWS - 1) / CHUNK_ROWS);
+
+    std::vector<EventRecord> all;
+    CHECK(reader.select(EventQuery(), all) == EVENT_COUNT);
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < PXMIN((unsigned)all.size(), (unsigned)EVENT_COUNT); i++)
+        mismatches += !sameEvent(all[i], expectedEvent(i));
+    CHECK(mismatches == 0);
+
+    // shots 300..500 are events 2100..3506, in chunks 2 and 3
+    EventQuery query;
+    query.where(EVCOL_SHOT, 300, 500).where(EVCOL_SIZE, 2, 8);
+    unsigned skipped = 0;
+    for (unsigned i = 0; i < reader.chunkCount(); i++)
+        skipped += !reader.chunkMayMatch(i, query);
+    printf("Query skips %u of %u chunks\n", skipped, reader.chunkCount());
+    CHECK(skipped == reader.chunkCount() - 2);
+    std::vector<EventRecord> selected;
+    reader.select(query, selected);
+    std::vector<EventRecord> expected;
+    for (unsigned i = 0; i < EVENT_COUNT; i++) {
+        EventRecord e = expectedEvent(i);
+        if (e.shot >= 300 && e.shot <= 500 && e.size >= 2 && e.size <= 8)
+            expected.push_back(e);
+    }
+    CHECK(selected.size() == expected.size());
+    mismatches = 0;
+    for (size_t i = 0; i < PXMIN(selected.size(), expected.size()); i++)
+        mismatches += !sameEvent(selected[i], expected[i]);
+    CHECK(mismatches == 0);
+    reader.close();
+
+    testDamaged(fileName);
+    printf(gFailures ? "FAILED (%d)\n" : "OK\n", gFailures);
+    return gFailures ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+"""
+Reads the event file written by eventfile_test (make test runs both) with
+the numpy reader: the events have to be the ones the writer got, a query on
+shots must not read the chunks outside its range and damaged files have to
+raise ValueError.
+
+    python3 eventfile_test.py <file.t3ev>
+"""
+import os
+import sys
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from eventfile import CHUNK_INFO, TRAILER, read_directory, read_events  # noqa: E402
+
+EVENT_COUNT = 10007
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print('check failed: %s' % what)
+        failures += 1
+
+
+def expected_events():
+    """The events of expectedEvent() in eventfile_test.cpp."""
+    i = np.arange(EVENT_COUNT, dtype=np.uint64)
+    return {'shot': i // 7,
+            'x': ((i * 37) % 256).astype(np.float32) + np.float32(0.25),
+            'y': ((i * 91) % 256).astype(np.float32) + np.float32(0.5),
+            'toa': (i % 1000) * 1.5625,
+            'tot': ((i % 50) * 25).astype(np.float32),
+            'size': (1 + i % 9).astype(np.uint32)}
+
+
+def same(events, expected, mask=None):
+    return all(np.array_equal(events[name], column if mask is None else column[mask])
+               for name, column in expected.items())
+
+
+def damaged(file_name, offset, data=None):
+    """Copy of the file with data written at offset (negative from the end), cut at offset without data."""
+    raw = bytearray(open(file_name, 'rb').read())
+    if offset < 0:
+        offset += len(raw)
+    if data is None:
+        del raw[offset:]
+    else:
+        raw[offset:offset + len(data)] = data
+    name = file_name + '.damaged'
+    with open(name, 'wb') as f:
+        f.write(raw)
+    return name
+
+
+def rejected(name):
+    try:
+        read_events(name)
+    except ValueError:
+        return True
+    return False
+
+
+def main(file_name):
+    expected = expected_events()
+    check(same(read_events(file_name), expected), 'all events')
+
+    query = {'shot': (300, 500), 'size': (2, 8)}
+    mask = np.ones(EVENT_COUNT, dtype=bool)
+    for name, (lo, hi) in query.items():
+        mask &= (expected[name] >= lo) & (expected[name] <= hi)
+    check(same(read_events(file_name, **query), expected, mask), 'query')
+
+    # overwrite the data of the chunks outside the query, the result must not change
+    data, chunks = read_directory(file_name)
+    raw = bytearray(data)
+    skipped = 0
+    for chunk in chunks:
+        if chunk['max'][0] < 300 or chunk['min'][0] > 500:
+            start = int(chunk['offset'])
+            raw[start:start + int(chunk['rows']) * 8] = b'\xff' * (int(chunk['rows']) * 8)
+            skipped += 1
+    print('Query skips %d of %d chunks' % (skipped, len(chunks)))
+    check(skipped == len(chunks) - 2, 'skipped chunks')
+    trailer = data[len(data) - TRAILER.itemsize:].view(TRAILER)[0]
+    directory = int(trailer['directoryOffset'])
+    del data, chunks
+    scrambled = damaged(file_name, 0, bytes(raw))
+    check(same(read_events(scrambled, **query), expected, mask), 'query reads only the matching chunks')
+    check(not same(read_events(scrambled), expected), 'full read sees the scrambled chunks')
+
+    # the checks of EventFileReader::open
+    check(rejected(damaged(file_name, directory)), 'no trailer')
+    wrong_rows = trailer.copy()
+    wrong_rows['rowCount'] += 1
+    check(rejected(damaged(file_name, -TRAILER.itemsize, wrong_rows.tobytes())), 'row count')
+    check(rejected(damaged(file_name, directory, np.uint64(directory).tobytes())), 'chunk in the directory')
+    wrong_count = trailer.copy()
+    wrong_count['chunkCount'] = 1 << 60
+    check(rejected(damaged(file_name, -TRAILER.itemsize, wrong_count.tobytes())), 'chunk count')
+    check(rejected(damaged(file_name, 0)), 'empty file')
+    check(rejected(damaged(file_name, 0, b'\0' * CHUNK_INFO.itemsize)), 'header')
+    os.remove(file_name + '.damaged')
+
+    print('FAILED (%d)' % failures if failures else 'OK')
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1] if len(sys.argv) > 1 else 'eventfile_test.t3ev'))
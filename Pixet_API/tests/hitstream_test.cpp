@@ -0,0 +1,153 @@
+/**
+ * @file      hitstream_test.cpp
+ *
+ * Loopback test of the hit stream, no detector needed: a server on this
+ * machine streams raw and compact batches to a client on 127.0.0.1, the
+ * compact quantization and the credit back-pressure are checked.
+ *
+ */
+#include "../hitstream.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+static int gFailures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); gFailures++; } } while (0)
+
+// Polls cond for up to 2 s
+template <typename F> static bool waitFor(F cond)
+{
+    for (int i = 0; i < 200; i++) {
+        if (cond())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return cond();
+}
+
+static std::vector<Tpx3Pixel> makeBatch(unsigned count, unsigned seed)
+{
+    std::vector<Tpx3Pixel> pixels(count);
+    double toa = 1e9 * seed;
+    for (unsigned i = 0; i < count; i++) {
+        toa += 0.37 + (i * 7919 + seed) % 1000;    // not a multiple of the fine ToA step
+        pixels[i].toa = toa;
+        pixels[i].tot = 25.0f * ((i + seed) % 40) + 0.3f * (i % 3);
+        pixels[i].index = (i * 2654435761u + seed) % 65536;
+    }
+    if (count > 2)
+        pixels[count - 1].toa = pixels[0].toa - 10;    // ToA deltas may be negative
+    return pixels;
+}
+
+// Starts a server on the first free port above the default one
+static unsigned short startServer(HitStreamServer& server, unsigned flags, unsigned queueDepth)
+{
+    for (unsigned short port = HITSTREAM_DEFAULT_PORT + 10000; port < HITSTREAM_DEFAULT_PORT + 10100; port++)
+        if (server.start(port, flags, queueDepth) == 0)
+            return port;
+    return 0;
+}
+
+static void testRoundTrip(unsigned flags)
+{
+    printf("Round trip, flags=%u\n", flags);
+    HitStreamServer server;
+    unsigned short port = startServer(server, flags, 64);
+    CHECK(port != 0);
+    HitStreamClient client;
+    CHECK(client.connect("127.0.0.1", port, 16) == 0);
+    CHECK(waitFor([&]{ return server.clientCount() == 1; }));
+
+    const unsigned batchCount = 20;
+    for (unsigned b = 0; b < batchCount; b++) {
+        std::vector<Tpx3Pixel> sent = makeBatch(1 + b * 97, b + 1);
+        server.publish(&sent[0], (unsigned)sent.size());
+
+        std::vector<Tpx3Pixel> received;
+        u64 seq = 0;
+        CHECK(client.receive(received, &seq, 2000) == 1);
+        CHECK(seq == b + 1);
+        CHECK(received.size() == sent.size());
+        for (size_t i = 0; i < PXMIN(received.size(), sent.size()); i++) {
+            const Tpx3Pixel& s = sent[i];
+            const Tpx3Pixel& r = received[i];
+            if (flags & HITSTREAM_COMPACT) {
+                // ToA in 1/64 ns, ToT in integer counts
+                CHECK(r.toa == llround(s.toa * 64) / 64.0);
+                CHECK(r.tot == (float)lround(s.tot));
+            } else {
+                CHECK(r.toa == s.toa && r.tot == s.tot);
+            }
+            CHECK(r.index == s.index);
+        }
+    }
+    CHECK(client.received() == batchCount);
+    CHECK(client.lost() == 0);
+    CHECK(server.batchesDropped() == 0);
+
+    // a disconnected client is reaped, the server keeps serving the others
+    client.close();
+    CHECK(waitFor([&]{ return server.clientCount() == 0; }));
+    HitStreamClient next;
+    CHECK(next.connect("127.0.0.1", port, 16) == 0);
+    CHECK(waitFor([&]{ return server.clientCount() == 1; }));
+    std::vector<Tpx3Pixel> sent = makeBatch(10, 99);
+    server.publish(&sent[0], (unsigned)sent.size());
+    std::vector<Tpx3Pixel> received;
+    CHECK(next.receive(received, NULL, 2000) == 1);
+    CHECK(received.size() == sent.size());
+
+    // stop sends END, the client sees the stream end
+    server.stop();
+    CHECK(next.receive(received, NULL, 2000) == PXCERR_DEVICE_ERROR);
+}
+
+static void testBackPressure()
+{
+    printf("Back-pressure\n");
+    const unsigned queueDepth = 4;
+    HitStreamServer server;
+    unsigned short port = startServer(server, HITSTREAM_COMPACT, queueDepth);
+    CHECK(port != 0);
+    HitStreamClient client;
+    CHECK(client.connect("127.0.0.1", port, 2) == 0);
+    CHECK(waitFor([&]{ return server.clientCount() == 1; }));
+
+    // the two credits are used up by the first two batches
+    std::vector<Tpx3Pixel> batch = makeBatch(50, 1);
+    for (int i = 0; i < 2; i++)
+        server.publish(&batch[0], (unsigned)batch.size());
+    CHECK(waitFor([&]{ return server.maxQueued() == 0; }));
+
+    // without credits the queue fills up and the oldest batches are dropped
+    for (int i = 0; i < 8; i++)
+        server.publish(&batch[0], (unsigned)batch.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(server.maxQueued() == queueDepth);
+    CHECK(server.batchesDropped() == 8 - queueDepth);
+
+    // consuming returns credits: 1, 2, then the last queueDepth batches
+    const u64 expected[] = { 1, 2, 7, 8, 9, 10 };
+    std::vector<Tpx3Pixel> received;
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        u64 seq = 0;
+        CHECK(client.receive(received, &seq, 2000) == 1);
+        CHECK(seq == expected[i]);
+    }
+    CHECK(client.receive(received, NULL, 100) == 0);
+    CHECK(client.received() == 6);
+    CHECK(client.lost() == 8 - queueDepth);
+    server.stop();
+}
+
+int main()
+{
+    testRoundTrip(0);
+    testRoundTrip(HITSTREAM_COMPACT);
+    testBackPressure();
+    printf(gFailures ? "FAILED (%d)\n" : "OK\n", gFailures);
+    return gFailures ? 1 : 0;
+}
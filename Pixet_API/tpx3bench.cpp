@@ -0,0 +1,690 @@
+/**
+ * @file      tpx3bench.cpp
+ *
+ * Throughput and latency benchmark of the hit processing pipeline. Runs
+ * without hardware: a synthetic hit stream (or a recorded .t3pa file) is
+ * driven batch by batch through each stage and every batch is timed.
+ *
+ * Stages: raw pixel conversion, pixel health stats, ToA unwrapping,
+ * sorting, the sliding hit index with a region query per batch,
+ * clustering (per shot), ToF/ToT histogramming, the coincidence map,
+ * event file writing, stream encoding and writing to a file.
+ * For each stage the Mhits/s, p50/p99 batch latency and bytes per hit are
+ * printed. --save-baseline stores the results, --check compares them with
+ * a stored baseline and returns 1 if a stage got slower than the tolerance.
+ * A baseline records the stream options it was measured with and is only
+ * compared with a run of the same options; "make bench-check" compares the
+ * default run with tpx3bench_baseline.txt.
+ *
+ * The synthetic stream is processed as fast as the stages go, --rate is
+ * the hit rate it is generated with: with --shot-rate it sets the hits
+ * per shot, which the clustering and above all the coincidence map (all
+ * pairs of events of a shot) depend on.
+ * The cost of the pipeline stats (pipestats.h) is measured by running the
+ * per batch work of the new data callback with and without them.
+ *
+ * Build with "make bench" (Linux, no SDK needed).
+ *
+ */
+#include "pxcapi.h"
+#include "tpx3proc.h"
+#include "hitindex.h"
+#include "coincmap.h"
+#include "eventfile.h"
+#include "pipestats.h"
+#include "pixelstats.h"
+#include "hitstream.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+typedef enum _BurstShape
+{
+    BURST_FLAT = 0,     // ToF uniform over the whole ToF range
+    BURST_PEAKS,        // ion ToF peaks
+    BURST_PULSE,        // everything within the first 2 us after the shot
+} BurstShape;
+
+static const char* gBurstNames[] = { "flat", "peaks", "pulse" };
+
+struct BenchConfig
+{
+    u64 hits;
+    double rate;            // hits/s of the synthetic stream
+    double shotRate;        // Hz
+    double tofRange;        // ns
+    double clusterSize;     // mean pixels per cluster
+    BurstShape burst;
+    unsigned batchSize;     // pixels per SDK batch
+    unsigned repeats;
+    double tolerance;
+    const char* input;
+    const char* outFile;
+    const char* saveBaseline;
+    const char* checkBaseline;
+    u32 seed;
+};
+
+struct StageResult
+{
+    std::string name;
+    u64 hits;
+    u64 bytes;
+    double seconds;
+    u64 p50;
+    u64 p99;
+
+    double mhits() const { return seconds > 0 ? hits / seconds / 1e6 : 0; }
+    double bytesPerHit() const { return hits ? (double)bytes / hits : 0; }
+};
+
+// ##########################################################################################33
+//                                     INPUT DATA
+// ##########################################################################################33
+
+struct HitStream
+{
+    std::vector<RawTpx3Pixel> raw;
+    std::vector<double> shotTimes;  // unwrapped ns
+};
+
+static void addRaw(HitStream& stream, double toa, unsigned index, unsigned tot, double toaStart)
+{
+    // coarse ToA rounded up, the fine ToA counts back from it
+    double t = toa + toaStart;
+    u64 clocks = (u64)ceil(t / TPX3_CLOCK_NS);
+    int ftoa = (int)((clocks * TPX3_CLOCK_NS - t) / TPX3_FTOA_NS + 0.5);
+    RawTpx3Pixel p;
+    memset(&p, 0, sizeof(p));
+    p.index = index;
+    p.toa = clocks % (u64)(TPX3_TOA_PERIOD_NS / TPX3_CLOCK_NS);
+    p.ftoa = (byte)PXMIN(ftoa, 15);
+    p.tot = (u16)PXMIN(tot, 1023u);
+    stream.raw.push_back(p);
+}
+
+static void generateStream(const BenchConfig& cfg, HitStream& stream)
+{
+    std::mt19937 rng(cfg.seed);
+    std::uniform_real_distribution<double> uni(0, 1);
+    std::normal_distribution<double> norm(0, 1);
+    std::geometric_distribution<int> sizeDist(1.0 / PXMAX(cfg.clusterSize, 1.0));
+
+    double hitsPerShot = cfg.rate / cfg.shotRate;
+    std::poisson_distribution<int> eventsDist(PXMAX(hitsPerShot / PXMAX(cfg.clusterSize, 1.0), 1.0));
+    double shotPeriod = 1e9 / cfg.shotRate;
+    // start a few shots before the ToA counter wraps so that the unwrapping has work to do
+    double toaStart = TPX3_TOA_PERIOD_NS - 3 * shotPeriod;
+    const double peaks[] = { 0.12, 0.23, 0.31, 0.45, 0.70 };
+
+    stream.raw.reserve((size_t)(cfg.hits * 1.05));
+    std::vector<Tpx3Pixel> shotHits;
+    for (u32 shot = 0; stream.raw.size() < cfg.hits; shot++) {
+        double shotTime = shot * shotPeriod;
+        stream.shotTimes.push_back(shotTime + toaStart);
+        shotHits.clear();
+        int events = eventsDist(rng);
+        for (int e = 0; e < events; e++) {
+            double tof;
+            if (cfg.burst == BURST_PEAKS)
+                tof = cfg.tofRange * peaks[(unsigned)(uni(rng) * 5)] + norm(rng) * 20;
+            else if (cfg.burst == BURST_PULSE)
+                tof = uni(rng) * 2000;
+            else
+                tof = uni(rng) * cfg.tofRange;
+            tof = PXMAX(tof, 0.0);
+            double cx = 128 + norm(rng) * 50;
+            double cy = 128 + norm(rng) * 50;
+            int size = PXMIN(sizeDist(rng) + 1, 40);
+            for (int k = 0; k < size; k++) {
+                int x = (int)(cx + norm(rng) * sqrt((double)size) * 0.5);
+                int y = (int)(cy + norm(rng) * sqrt((double)size) * 0.5);
+                if (x < 0 || x >= TPX3_CHIP_WIDTH || y < 0 || y >= TPX3_CHIP_HEIGHT)
+                    continue;
+                // time walk: later and smaller ToT away from the centre
+                double dist = fabs(x - cx) + fabs(y - cy);
+                Tpx3Pixel p;
+                p.toa = shotTime + tof + dist * 5 + uni(rng) * 10;
+                p.tot = (float)PXMAX(400 - dist * 60 + norm(rng) * 20, 1.0);
+                p.index = y * TPX3_CHIP_WIDTH + x;
+                shotHits.push_back(p);
+            }
+        }
+
+        // the readout is time ordered per shot, but not strictly: swap some neighbours
+        std::sort(shotHits.begin(), shotHits.end(), [](const Tpx3Pixel& a, const Tpx3Pixel& b) { return a.toa < b.toa; });
+        for (size_t i = 1; i < shotHits.size(); i++)
+            if (uni(rng) < 0.05)
+                std::swap(shotHits[i - 1], shotHits[i]);
+        for (size_t i = 0; i < shotHits.size(); i++)
+            addRaw(stream, shotHits[i].toa, shotHits[i].index, (unsigned)shotHits[i].tot, toaStart);
+    }
+    stream.raw.resize(PXMIN(stream.raw.size(), (size_t)cfg.hits));
+}
+
+// Reads Pixet .t3pa file (Index, Matrix Index, ToA, ToT, FToA, Overflow)
+static int loadT3pa(const char* fileName, const BenchConfig& cfg, HitStream& stream)
+{
+    FILE* f = fopen(fileName, "r");
+    if (!f) {
+        printf("Cannot open %s\n", fileName);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+    char line[256];
+    unsigned long long idx, toa;
+    unsigned matrixIndex, tot, ftoa, overflow;
+    while (fgets(line, sizeof(line), f) && stream.raw.size() < cfg.hits) {
+        if (sscanf(line, "%llu %u %llu %u %u %u", &idx, &matrixIndex, &toa, &tot, &ftoa, &overflow) != 6)
+            continue;
+        RawTpx3Pixel p;
+        memset(&p, 0, sizeof(p));
+        p.index = matrixIndex;
+        p.toa = toa;
+        p.ftoa = (byte)ftoa;
+        p.tot = (u16)tot;
+        p.overflow = (byte)overflow;
+        stream.raw.push_back(p);
+    }
+    fclose(f);
+    if (stream.raw.empty()) {
+        printf("No pixels in %s\n", fileName);
+        return PXCERR_INVALID_ARGUMENT;
+    }
+
+    // no trigger information in the file, shots are placed at the shot rate over the unwrapped time range
+    std::vector<Tpx3Pixel> pixels(stream.raw.size());
+    convertRawPixels(&stream.raw[0], (unsigned)pixels.size(), &pixels[0]);
+    ToaUnwrapper unwrapper;
+    unwrapper.unwrap(&pixels[0], (unsigned)pixels.size());
+    double first = pixels[0].toa, last = pixels[0].toa;
+    for (size_t i = 1; i < pixels.size(); i++) {
+        first = PXMIN(first, pixels[i].toa);
+        last = PXMAX(last, pixels[i].toa);
+    }
+    double shotPeriod = 1e9 / cfg.shotRate;
+    for (double t = first; t <= last; t += shotPeriod)
+        stream.shotTimes.push_back(t);
+    return 0;
+}
+
+// ##########################################################################################33
+//                                     BENCHMARK
+// ##########################################################################################33
+
+class StageClock
+{
+public:
+    StageClock(const char* name) { mResult.name = name; mResult.hits = 0; mResult.bytes = 0; mTotal = 0; }
+    void begin() { mStart = Clock::now(); }
+    void end(u64 hits, u64 bytes = 0)
+    {
+        u64 ns = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mStart).count();
+        mHist.record(ns);
+        mTotal += ns;
+        mResult.hits += hits;
+        mResult.bytes += bytes;
+    }
+    StageResult result()
+    {
+        LatencySnapshot snap;
+        mHist.snapshot(snap);
+        mResult.seconds = mTotal * 1e-9;
+        mResult.p50 = snap.percentile(0.5);
+        mResult.p99 = snap.percentile(0.99);
+        return mResult;
+    }
+
+private:
+    StageResult mResult;
+    LatencyHistogram mHist;
+    u64 mTotal;
+    Clock::time_point mStart;
+};
+
+static void runPipeline(const BenchConfig& cfg, const HitStream& stream, std::vector<StageResult>& results)
+{
+    unsigned count = (unsigned)stream.raw.size();
+    unsigned batch = cfg.batchSize;
+    std::vector<Tpx3Pixel> pixels(count);
+    std::vector<Tpx3Pixel> scratch;
+
+    StageClock convert("convert");
+    for (unsigned i = 0; i < count; i += batch) {
+        unsigned n = PXMIN(batch, count - i);
+        convert.begin();
+        convertRawPixels(&stream.raw[i], n, &pixels[i]);
+        convert.end(n);
+    }
+
+    // detector health stats on the raw stream, an interval per ten batches
+    StageClock statsStage("pixstats");
+    PixelStats pixelStats;
+    for (unsigned i = 0, b = 1; i < count; i += batch, b++) {
+        unsigned n = PXMIN(batch, count - i);
+        statsStage.begin();
+        pixelStats.update(&pixels[i], n);
+        if (b % 10 == 0)
+            pixelStats.closeInterval(1.0);
+        statsStage.end(n);
+    }
+
+    StageClock unwrapStage("unwrap");
+    ToaUnwrapper unwrapper;
+    for (unsigned i = 0; i < count; i += batch) {
+        unsigned n = PXMIN(batch, count - i);
+        unwrapStage.begin();
+        unwrapper.unwrap(&pixels[i], n);
+        unwrapStage.end(n);
+    }
+
+    StageClock sortStage("sort");
+    for (unsigned i = 0; i < count; i += batch) {
+        unsigned n = PXMIN(batch, count - i);
+        sortStage.begin();
+        sortPixelsByToa(&pixels[i], n, scratch);
+        sortStage.end(n);
+    }
+    // batches overlap in time a little, the shots are cut from the whole sorted stream
+    sortPixelsByToa(&pixels[0], count, scratch);
+
+    // 1 ms window sliding over the stream, the hits of a 16 x 16 region in the last batch
+    StageClock indexStage("index");
+    HitIndex index(TPX3_CHIP_WIDTH, TPX3_CHIP_HEIGHT);
+    std::vector<u64> selected;
+    for (unsigned i = 0; i < count; i += batch) {
+        unsigned n = PXMIN(batch, count - i);
+        indexStage.begin();
+        index.add(&pixels[i], n);
+        index.expireBefore(pixels[i + n - 1].toa - 1e6);
+        selected.clear();
+        index.selectRect(120, 120, 135, 135, pixels[i].toa, pixels[i + n - 1].toa, 0, selected);
+        indexStage.end(n);
+    }
+
+    std::vector<unsigned> shotStarts;
+    const std::vector<double>& shots = stream.shotTimes;
+    segmentShots(&pixels[0], count, &shots[0], (unsigned)shots.size(), shotStarts);
+    std::vector<Tpx3Pixel> relative;
+
+    ClusterParams params;
+    params.timeWindow = 10 * 25;
+    params.minToa = 0;
+    params.maxToa = cfg.tofRange;
+    params.minSize = 1;
+    params.maxSize = 40;
+    HitClusterer clusterer(params);
+    std::vector<Tpx3Cluster> clusters;
+    StageClock clusterStage("cluster");
+    TofHistogram tof(1.5625, cfg.tofRange);
+    TotImage totImage;
+    StageClock histStage("histogram");
+    for (unsigned s = 0; s < shots.size(); s++) {
+        unsigned first = shotStarts[s];
+        unsigned n = shotStarts[s + 1] - first;
+        relative.assign(pixels.begin() + first, pixels.begin() + first + n);
+        for (unsigned i = 0; i < n; i++)
+            relative[i].toa -= shots[s];
+        if (!n)
+            continue;
+
+        clusterStage.begin();
+        clusterer.clusterShot(&relative[0], n, s, clusters);
+        clusterStage.end(n);
+
+        histStage.begin();
+        tof.fill(&relative[0], n);
+        totImage.fill(&relative[0], n);
+        histStage.end(n);
+    }
+
+    // coincidence/covariance maps over the centroided events, blocks of 100 shots
+    StageClock coincStage("coinc");
+    CoincidenceMap coinc(0, cfg.tofRange, 1024);
+    for (size_t c = 0; c < clusters.size();) {
+        size_t end = c;
+        while (end < clusters.size() && clusters[end].shot < clusters[c].shot + 100)
+            end++;
+        coincStage.begin();
+        coinc.addShots(&clusters[c], end - c);
+        coincStage.end(end - c);
+        c = end;
+    }
+    std::vector<double> covariance;
+    coincStage.begin();
+    coinc.covariance(covariance);
+    coincStage.end(0);
+
+    // centroided events to the binary event list, in blocks as the batch tool exports them
+    StageClock eventStage("events");
+    std::string eventsName = cfg.outFile ? std::string(cfg.outFile) + ".t3ev" : std::string("tpx3bench.t3ev");
+    EventFileWriter events;
+    if (!events.open(eventsName.c_str())) {
+        for (size_t c = 0; c < clusters.size();) {
+            size_t end = PXMIN(c + (size_t)4096, clusters.size());
+            u64 written = events.bytesWritten();
+            eventStage.begin();
+            events.write(&clusters[c], end - c);
+            eventStage.end(end - c, events.bytesWritten() - written);
+            c = end;
+        }
+        u64 written = events.bytesWritten();
+        eventStage.begin();
+        events.close();
+        eventStage.end(0, events.bytesWritten() - written);
+        if (!cfg.outFile)
+            remove(eventsName.c_str());
+    }
+
+    StageClock encodeStage("encode");
+    StageClock writeStage("write");
+    FILE* out = cfg.outFile ? fopen(cfg.outFile, "wb") : tmpfile();
+    std::vector<byte> encoded;
+    for (unsigned i = 0; i < count; i += batch) {
+        unsigned n = PXMIN(batch, count - i);
+        encoded.clear();
+        encodeStage.begin();
+        hitStreamEncode(&pixels[i], n, HITSTREAM_COMPACT, encoded);
+        encodeStage.end(n, encoded.size());
+
+        writeStage.begin();
+        if (out)
+            fwrite(&encoded[0], 1, encoded.size(), out);
+        writeStage.end(n, encoded.size());
+    }
+    if (out) {
+        writeStage.begin();
+        fflush(out);
+        writeStage.end(0);
+        fclose(out);
+    }
+
+    StageClock* stages[] = { &convert, &statsStage, &unwrapStage, &sortStage, &indexStage, &clusterStage, &histStage, &coincStage, &eventStage, &encodeStage, &writeStage };
+    for (unsigned i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        StageResult r = stages[i]->result();
+        // keep the best repeat
+        bool found = false;
+        for (size_t k = 0; k < results.size(); k++) {
+            if (results[k].name == r.name) {
+                if (r.mhits() > results[k].mhits())
+                    results[k] = r;
+                found = true;
+            }
+        }
+        if (!found)
+            results.push_back(r);
+    }
+    printf("  %u pixels, %u shots, %u rollovers, %u clusters\n", count, (unsigned)shots.size(),
+           (unsigned)unwrapper.rollovers(), (unsigned)clusters.size());
+}
+
+// ##########################################################################################33
+//                                 INSTRUMENTATION COST
+// ##########################################################################################33
+
+// The per batch work of onTpx3Data (conversion, order check, sorting, stream encoding) with its stage
+// timers, with the stats enabled and disabled. Every batch runs in both ways alternately a few times and
+// the fastest of each counts, so drift and interrupts do not end up in the difference. Returns the
+// relative slowdown.
+static double measureStatsOverhead(const BenchConfig& cfg, const HitStream& stream, double* nsPerBatch)
+{
+    unsigned count = (unsigned)stream.raw.size();
+    unsigned batch = cfg.batchSize;
+    std::vector<Tpx3Pixel> pixels(batch);
+    std::vector<Tpx3Pixel> scratch;
+    std::vector<byte> encoded;
+    PipelineStats stats;
+    double total[2] = { 0, 0 };
+    double lastToa = 0;
+    u64 batches = 0;
+    for (unsigned i = 0; i < count; i += batch, batches++) {
+        unsigned n = PXMIN(batch, count - i);
+        double best[2] = { HUGE_VAL, HUGE_VAL };
+        for (unsigned k = 0; k < 6; k++) {
+            int enabled = (k + batches) % 2;
+            stats.setEnabled(enabled != 0);
+            Clock::time_point start = Clock::now();
+            {
+                StageTimer callbackTimer(PIPE_STAGE_CALLBACK, stats);
+                StageTimer copyTimer(PIPE_STAGE_COPY, stats);
+                convertRawPixels(&stream.raw[i], n, &pixels[0]);
+                copyTimer.stop(n, n);
+                double toa = lastToa;
+                stats.checkOrder(&pixels[0], n, &toa);
+                StageTimer filterTimer(PIPE_STAGE_FILTER, stats);
+                sortPixelsByToa(&pixels[0], n, scratch);
+                filterTimer.stop(n, n);
+                StageTimer writeTimer(PIPE_STAGE_WRITE, stats);
+                encoded.clear();
+                hitStreamEncode(&pixels[0], n, HITSTREAM_COMPACT, encoded);
+                writeTimer.stop(n, n);
+                callbackTimer.stop(n, n);
+            }
+            best[enabled] = PXMIN(best[enabled], std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        lastToa = pixels[n - 1].toa;
+        total[0] += best[0];
+        total[1] += best[1];
+    }
+    *nsPerBatch = (total[1] - total[0]) * 1e9 / PXMAX(batches, (u64)1);
+    return total[0] > 0 ? total[1] / total[0] - 1 : 0;
+}
+
+// ##########################################################################################33
+//                                      BASELINES
+// ##########################################################################################33
+
+// Options of the measured stream, a baseline is only comparable with a run of the same options
+static std::string configLine(const BenchConfig& cfg)
+{
+    char line[512];
+    if (cfg.input)
+        sprintf(line, "# config input=%.200s batch=%u\n", cfg.input, cfg.batchSize);
+    else
+        sprintf(line, "# config hits=%llu rate=%g shot-rate=%g tof-range=%g cluster-size=%g burst=%s batch=%u seed=%u\n",
+                cfg.hits, cfg.rate, cfg.shotRate, cfg.tofRange, cfg.clusterSize, gBurstNames[cfg.burst], cfg.batchSize,
+                cfg.seed);
+    return line;
+}
+
+static int saveBaseline(const char* fileName, const BenchConfig& cfg, const std::vector<StageResult>& results)
+{
+    FILE* f = fopen(fileName, "w");
+    if (!f)
+        return PXCERR_COULD_NOT_SAVE;
+    fputs(configLine(cfg).c_str(), f);
+    fprintf(f, "# stage Mhits/s p50[ns] p99[ns] bytes/hit\n");
+    for (size_t i = 0; i < results.size(); i++)
+        fprintf(f, "%s %.3f %llu %llu %.3f\n", results[i].name.c_str(), results[i].mhits(), results[i].p50, results[i].p99,
+                results[i].bytesPerHit());
+    fclose(f);
+    return 0;
+}
+
+// Returns number of regressed stages or -1 if the baseline cannot be read or was measured with other options
+static int checkBaseline(const char* fileName, const BenchConfig& cfg, const std::vector<StageResult>& results, double tolerance)
+{
+    FILE* f = fopen(fileName, "r");
+    if (!f) {
+        printf("Cannot open baseline %s\n", fileName);
+        return -1;
+    }
+    char line[256], name[64];
+    double mhits, bytesPerHit;
+    unsigned long long p50, p99;
+    int regressions = 0;
+    bool header = false;
+    std::string config = configLine(cfg);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "# config ", 9) == 0 && config != line) {
+            printf("Baseline %s was measured with other options:\n%s", fileName, line + 2);
+            fclose(f);
+            return -1;
+        }
+        if (line[0] == '#' || sscanf(line, "%63s %lf %llu %llu %lf", name, &mhits, &p50, &p99, &bytesPerHit) != 5)
+            continue;
+        for (size_t i = 0; i < results.size(); i++) {
+            const StageResult& r = results[i];
+            if (r.name != name)
+                continue;
+            if (!header)
+                printf("\n%-10s %12s %12s %8s %10s\n", "Stage", "Base[Mh/s]", "Now[Mh/s]", "Change", "");
+            header = true;
+            double change = mhits > 0 ? r.mhits() / mhits - 1 : 0;
+            bool slower = change < -tolerance;
+            bool bigger = r.bytesPerHit() > bytesPerHit * (1 + tolerance) + 1e-9;
+            regressions += slower || bigger;
+            printf("%-10s %12.2f %12.2f %+7.1f%% %s%s\n", name, mhits, r.mhits(), change * 100,
+                   slower ? "SLOWER " : "", bigger ? "BIGGER" : "");
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static void printResults(const std::vector<StageResult>& results)
+{
+    printf("\n%-10s %10s %12s %12s %10s\n", "Stage", "Mhits/s", "p50[us]", "p99[us]", "bytes/hit");
+    for (size_t i = 0; i < results.size(); i++) {
+        const StageResult& r = results[i];
+        printf("%-10s %10.2f %12.2f %12.2f %10.2f\n", r.name.c_str(), r.mhits(), r.p50 * 1e-3, r.p99 * 1e-3, r.bytesPerHit());
+    }
+}
+
+static void printUsage()
+{
+    printf("Usage: tpx3bench [options]\n"
+           "  --hits N            number of pixels (default 2000000)\n"
+           "  --rate R            hit rate the stream is generated with [hits/s], sets the hits\n"
+           "                      per shot, the stream is not replayed at this rate (default 2e6)\n"
+           "  --shot-rate F       shot rate [Hz] (default 100)\n"
+           "  --tof-range NS      ToF range after the shot [ns] (default 100000)\n"
+           "  --cluster-size S    mean pixels per cluster (default 4)\n"
+           "  --burst SHAPE       flat | peaks | pulse (default peaks)\n"
+           "  --batch N           pixels per batch (default 10000)\n"
+           "  --repeat N          repeats, the best one is reported (default 2)\n"
+           "  --input FILE.t3pa   recorded pixels instead of the synthetic stream\n"
+           "  --out FILE          file for the write stage (default temporary file)\n"
+           "  --save-baseline F   save the results as baseline\n"
+           "  --check F           compare with baseline, exit code 1 on regression\n"
+           "  --tolerance T       allowed relative slowdown (default 0.15)\n"
+           "  --seed N            random seed\n");
+}
+
+int main(int argc, char const* argv[])
+{
+    BenchConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.hits = 2000000;
+    cfg.rate = 2e6;
+    cfg.shotRate = 100;
+    cfg.tofRange = 100000;
+    cfg.clusterSize = 4;
+    cfg.burst = BURST_PEAKS;
+    cfg.batchSize = 10000;
+    cfg.repeats = 2;
+    cfg.tolerance = 0.15;
+    cfg.seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool used = true;
+        if (arg == "--help" || arg == "-h") {
+            printUsage();
+            return 0;
+        } else if (!value) {
+            used = false;
+        } else if (arg == "--hits") {
+            cfg.hits = (u64)atof(value);
+        } else if (arg == "--rate") {
+            cfg.rate = atof(value);
+        } else if (arg == "--shot-rate") {
+            cfg.shotRate = atof(value);
+        } else if (arg == "--tof-range") {
+            cfg.tofRange = atof(value);
+        } else if (arg == "--cluster-size") {
+            cfg.clusterSize = atof(value);
+        } else if (arg == "--burst") {
+            used = false;
+            for (unsigned b = 0; b < sizeof(gBurstNames) / sizeof(gBurstNames[0]); b++)
+                if (strcmp(value, gBurstNames[b]) == 0) {
+                    cfg.burst = (BurstShape)b;
+                    used = true;
+                }
+        } else if (arg == "--batch") {
+            cfg.batchSize = (unsigned)atoi(value);
+        } else if (arg == "--repeat") {
+            cfg.repeats = (unsigned)atoi(value);
+        } else if (arg == "--input") {
+            cfg.input = value;
+        } else if (arg == "--out") {
+            cfg.outFile = value;
+        } else if (arg == "--save-baseline") {
+            cfg.saveBaseline = value;
+        } else if (arg == "--check") {
+            cfg.checkBaseline = value;
+        } else if (arg == "--tolerance") {
+            cfg.tolerance = atof(value);
+        } else if (arg == "--seed") {
+            cfg.seed = (u32)atoi(value);
+        } else {
+            used = false;
+        }
+        if (!used) {
+            printf("Invalid argument %s\n", arg.c_str());
+            printUsage();
+            return 2;
+        }
+        i++;
+    }
+    if (!cfg.hits || cfg.rate <= 0 || cfg.shotRate <= 0 || !cfg.batchSize || !cfg.repeats) {
+        printUsage();
+        return 2;
+    }
+
+    HitStream stream;
+    if (cfg.input) {
+        printf("Reading %s\n", cfg.input);
+        if (loadT3pa(cfg.input, cfg, stream))
+            return 2;
+    } else {
+        printf("Generating %llu pixels, %.1f Mhits/s, %g Hz shots, %s bursts, cluster size %.1f\n", cfg.hits,
+               cfg.rate / 1e6, cfg.shotRate, gBurstNames[cfg.burst], cfg.clusterSize);
+        generateStream(cfg, stream);
+    }
+
+    std::vector<StageResult> results;
+    for (unsigned r = 0; r < cfg.repeats; r++) {
+        printf("Run %u/%u\n", r + 1, cfg.repeats);
+        runPipeline(cfg, stream, results);
+    }
+    printResults(results);
+    double statsNs = 0;
+    double statsOverhead = measureStatsOverhead(cfg, stream, &statsNs);
+    printf("\nPipeline stats overhead: %+.2f %% of the callback work, %.0f ns per batch of %u\n", statsOverhead * 100, statsNs,
+           cfg.batchSize);
+
+    if (cfg.saveBaseline) {
+        if (saveBaseline(cfg.saveBaseline, cfg, results))
+            printf("Cannot save baseline %s\n", cfg.saveBaseline);
+        else
+            printf("Baseline saved to %s\n", cfg.saveBaseline);
+    }
+    if (cfg.checkBaseline) {
+        int regressions = checkBaseline(cfg.checkBaseline, cfg, results, cfg.tolerance);
+        if (regressions < 0)
+            return 2;
+        if (regressions) {
+            printf("%d stage(s) regressed by more than %.0f %%\n", regressions, cfg.tolerance * 100);
+            return 1;
+        }
+        printf("No regressions\n");
+    }
+    return 0;
+}
@@ -0,0 +1,500 @@
+/**
+ * @file      tpx3proc.cpp
+ *
+ * Processing kernels for data driven Timepix3 pixels.
+ *
+ */
+#include "tpx3proc.h"
+#include "hitindex.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// ##########################################################################################33
+//                                 CONVERSION, UNWRAPPING
+// ##########################################################################################33
+
+template <class Mode> void convertRawPixelsMode(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels)
+{
+    for (unsigned i = 0; i < count; i++) {
+        pixels[i].toa = Mode::hasToa ? (double)raw[i].toa * TPX3_CLOCK_NS - raw[i].ftoa * TPX3_FTOA_NS : 0;
+        pixels[i].tot = Mode::hasTot ? (float)raw[i].tot : 0;
+        pixels[i].index = raw[i].index;
+    }
+}
+
+ToaUnwrapper::ToaUnwrapper(double period)
+    : mPeriod(period)
+    , mEpoch(0)
+    , mLast(0)
+    , mReference(0)
+    , mHasReference(false)
+{
+}
+
+void ToaUnwrapper::unwrap(Tpx3Pixel* pixels, unsigned count)
+{
+    // the counter wrapped when the ToA jumps back by more than half the period; a late pixel of the
+    // previous epoch arriving after the wrap jumps forward by more than half the period
+    if (mHasReference && count) {
+        double epoch = floor((mReference - pixels[0].toa) / mPeriod + 0.5);
+        mEpoch = epoch > 0 ? (u64)epoch : 0;
+        mLast = pixels[0].toa;
+        mHasReference = false;
+    }
+    double half = mPeriod / 2;
+    double offset = mEpoch * mPeriod;
+    for (unsigned i = 0; i < count; i++) {
+        double toa = pixels[i].toa;
+        if (mLast - toa > half) {
+            mEpoch++;
+            offset += mPeriod;
+            mLast = toa;
+        } else if (toa - mLast > half && mEpoch) {
+            pixels[i].toa = toa + offset - mPeriod;
+            continue;
+        } else if (toa > mLast) {
+            mLast = toa;
+        }
+        pixels[i].toa = toa + offset;
+    }
+}
+
+// ##########################################################################################33
+//                                      SORTING
+// ##########################################################################################33
+
+#define TPX3_SORT_SCALE     64.0    // sort key resolution 1/64 ns, finer than the fine ToA step
+#define TPX3_SORT_BITS      11
+#define TPX3_SORT_BUCKETS   (1 << TPX3_SORT_BITS)
+
+void sortPixelsByToa(Tpx3Pixel* pixels, unsigned count, std::vector<Tpx3Pixel>& scratch)
+{
+    if (count < 2)
+        return;
+
+    // batches are mostly ordered already
+    bool sorted = true;
+    for (unsigned i = 1; i < count && sorted; i++)
+        sorted = pixels[i].toa >= pixels[i - 1].toa;
+    if (sorted)
+        return;
+
+    if (count < 256) {
+        std::stable_sort(pixels, pixels + count, [](const Tpx3Pixel& a, const Tpx3Pixel& b) { return a.toa < b.toa; });
+        return;
+    }
+
+    // keys relative to the minimum, only the passes covering the key range are done
+    double minToa = pixels[0].toa;
+    double maxToa = pixels[0].toa;
+    for (unsigned i = 1; i < count; i++) {
+        minToa = PXMIN(minToa, pixels[i].toa);
+        maxToa = PXMAX(maxToa, pixels[i].toa);
+    }
+    u64 maxKey = (u64)((maxToa - minToa) * TPX3_SORT_SCALE);
+    unsigned passes = 0;
+    while (maxKey) {
+        passes++;
+        maxKey >>= TPX3_SORT_BITS;
+    }
+
+    scratch.resize(count);
+    Tpx3Pixel* src = pixels;
+    Tpx3Pixel* dst = &scratch[0];
+    std::vector<unsigned> offsets(TPX3_SORT_BUCKETS);
+    for (unsigned pass = 0; pass < passes; pass++) {
+        unsigned shift = pass * TPX3_SORT_BITS;
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (unsigned i = 0; i < count; i++)
+            offsets[((u64)((src[i].toa - minToa) * TPX3_SORT_SCALE) >> shift) & (TPX3_SORT_BUCKETS - 1)]++;
+        unsigned sum = 0;
+        for (unsigned b = 0; b < TPX3_SORT_BUCKETS; b++) {
+            unsigned n = offsets[b];
+            offsets[b] = sum;
+            sum += n;
+        }
+        for (unsigned i = 0; i < count; i++)
+            dst[offsets[((u64)((src[i].toa - minToa) * TPX3_SORT_SCALE) >> shift) & (TPX3_SORT_BUCKETS - 1)]++] = src[i];
+        std::swap(src, dst);
+    }
+    if (src != pixels)
+        memcpy(pixels, src, count * sizeof(Tpx3Pixel));
+}
+
+void segmentShots(const Tpx3Pixel* pixels, unsigned count, const double* shotTimes, unsigned shotCount, std::vector<unsigned>& shotStarts)
+{
+    shotStarts.resize(shotCount + 1);
+    unsigned p = 0;
+    for (unsigned s = 0; s < shotCount; s++) {
+        while (p < count && pixels[p].toa < shotTimes[s])
+            p++;
+        shotStarts[s] = p;
+    }
+    shotStarts[shotCount] = count;
+}
+
+// ##########################################################################################33
+//                                     CLUSTERING
+// ##########################################################################################33
+
+template <class Geometry, class Mode>
+void selectPixelsInRect(const Geometry& geometry, const Tpx3Pixel* pixels, unsigned count, unsigned x0, unsigned y0,
+                        unsigned x1, unsigned y1, float minTot, std::vector<unsigned>& out)
+{
+    // unsigned differences fold both bounds of a coordinate into one compare
+    unsigned w = x1 - x0, h = y1 - y0;
+    for (unsigned i = 0; i < count; i++) {
+        u32 index = pixels[i].index;
+        bool inside = geometry.x(index) - x0 <= w && geometry.y(index) - y0 <= h;
+        if (inside && (!Mode::hasTot || pixels[i].tot >= minTot))
+            out.push_back(i);
+    }
+}
+
+template <class Geometry, class Mode>
+GeometryClusterer<Geometry, Mode>::GeometryClusterer(const ClusterParams& params, const Geometry& geometry)
+    : mParams(params)
+    , mGeometry(geometry)
+    , mIndex(new HitIndex(geometry.width(), geometry.height(), 0))
+    , mLabel(0)
+{
+}
+
+template <class Geometry, class Mode>
+GeometryClusterer<Geometry, Mode>::~GeometryClusterer()
+{
+    delete mIndex;
+}
+
+template <class Geometry, class Mode>
+void GeometryClusterer<Geometry, Mode>::reserve(unsigned hits)
+{
+    if (mHitLabel.size() < hits) {
+        mHitLabel.resize(hits, 0);
+        mHitPass.resize(hits, 0);
+    }
+}
+
+template <class Geometry, class Mode>
+unsigned GeometryClusterer<Geometry, Mode>::clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, std::vector<Tpx3Cluster>& out)
+{
+    return cluster(pixels, count, shot, out);
+}
+
+template <class Geometry, class Mode>
+unsigned GeometryClusterer<Geometry, Mode>::clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, ClusterBuffer& out)
+{
+    return cluster(pixels, count, shot, out);
+}
+
+// Centroid weighted by 1 / (t - t_seed + 1)
+template <class Geometry, class Mode> struct CentroidSum
+{
+    CentroidSum(double seedToa) : seedToa(seedToa), xSum(0), ySum(0), wSum(0), totSum(0), minT(seedToa), maxT(seedToa), size(0) {}
+
+    void add(const Geometry& geometry, const Tpx3Pixel& p)
+    {
+        double w = 1;
+        if (Mode::hasToa) {
+            w = 1.0 / (p.toa - seedToa + 1);
+            minT = PXMIN(minT, p.toa);
+            maxT = PXMAX(maxT, p.toa);
+        }
+        xSum += geometry.x(p.index) * w;
+        ySum += geometry.y(p.index) * w;
+        wSum += w;
+        if (Mode::hasTot)
+            totSum += p.tot;
+        size++;
+    }
+
+    double seedToa, xSum, ySum, wSum, totSum, minT, maxT;
+    unsigned size;
+};
+
+// Members in the order the sweeps found them: by sweep, within a sweep by hit
+struct SweepOrder
+{
+    SweepOrder(const u32* pass) : pass(pass) {}
+    bool operator()(unsigned a, unsigned b) const { return pass[a] != pass[b] ? pass[a] < pass[b] : a < b; }
+    const u32* pass;
+};
+
+template <class Geometry, class Mode>
+template <class Output>
+unsigned GeometryClusterer<Geometry, Mode>::cluster(const Tpx3Pixel* pixels, unsigned count, u32 shot, Output& out)
+{
+    reserve(count);
+    // every cluster takes a new label, the hit labels are cleared only when the labels run out
+    if (mLabel > 0xffffffffu - count) {
+        std::fill(mHitLabel.begin(), mHitLabel.end(), 0);
+        mLabel = 0;
+    }
+    u32* hitLabel = count ? &mHitLabel[0] : NULL;
+    u32* hitPass = count ? &mHitPass[0] : NULL;
+    const u32 base = mLabel;
+    const unsigned passes = mParams.maxSize + 10;
+    unsigned indexed = 0;
+    unsigned added = 0;
+    // the sequence numbers of the index are the hits of the shot
+    mIndex->reset();
+
+    for (unsigned i = 0; i < count; i++) {
+        if (hitLabel[i] > base)
+            continue;
+        double seedToa = Mode::hasToa ? pixels[i].toa : 0;
+        if (Mode::hasToa && (seedToa < mParams.minToa || seedToa > mParams.maxToa))
+            continue;
+
+        // pixels are time sorted, the window ends at the first pixel later than seed + timeWindow
+        unsigned end = count;
+        if (Mode::hasToa) {
+            double maxToa = seedToa + mParams.timeWindow;
+            end = PXMAX(i + 1, indexed);
+            while (end < count && pixels[end].toa <= maxToa)
+                end++;
+        }
+        if (end > indexed) {
+            mIndex->add(pixels + indexed, end - indexed);
+            indexed = end;
+        }
+        mIndex->expire(i + 1);
+
+        // A hit joins in the first sweep that finds a member around it: the sweep of that member when
+        // the member comes before it, the next sweep otherwise (0-1 breadth first search by sweep)
+        u32 label = ++mLabel;
+        hitLabel[i] = label;
+        hitPass[i] = 0;
+        mMembers.clear();
+        mMembers.push_back(i);
+        mLevel.clear();
+        mLevel.push_back(i);
+        for (unsigned pass = 0; !mLevel.empty(); pass++) {
+            mNextLevel.clear();
+            for (size_t k = 0; k < mLevel.size(); k++) {
+                unsigned m = mLevel[k];
+                if (hitPass[m] != pass)
+                    continue;
+                mFound.clear();
+                mIndex->neighbours(pixels[m].index, mFound);
+                for (size_t f = 0; f < mFound.size(); f++) {
+                    unsigned j = (unsigned)mFound[f];
+                    unsigned joins = m < j ? pass : pass + 1;
+                    if (joins >= passes)
+                        continue;
+                    if (hitLabel[j] != label) {
+                        hitLabel[j] = label;
+                        mMembers.push_back(j);
+                    } else if (joins >= hitPass[j]) {
+                        continue;
+                    }
+                    hitPass[j] = joins;
+                    (joins == pass ? mLevel : mNextLevel).push_back(j);
+                }
+            }
+            mLevel.swap(mNextLevel);
+        }
+
+        unsigned size = (unsigned)mMembers.size();
+        for (unsigned k = 1; k < size; k++)
+            mIndex->remove(mMembers[k]);
+        if (size < mParams.minSize || size > mParams.maxSize)
+            continue;
+
+        std::sort(mMembers.begin(), mMembers.end(), SweepOrder(hitPass));
+        CentroidSum<Geometry, Mode> sum(seedToa);
+        for (unsigned k = 0; k < size; k++)
+            sum.add(mGeometry, pixels[mMembers[k]]);
+
+        Tpx3Cluster c;
+        c.toa = seedToa;
+        c.x = (float)(sum.xSum / sum.wSum);
+        c.y = (float)(sum.ySum / sum.wSum);
+        c.tot = (float)sum.totSum;
+        c.spread = (float)(sum.maxT - sum.minT);
+        c.shot = shot;
+        c.size = sum.size;
+        out.push_back(c);
+        added++;
+    }
+    return added;
+}
+
+// ##########################################################################################33
+//                                   OUTPUT BLOCKS
+// ##########################################################################################33
+
+ClusterBlockPool::~ClusterBlockPool()
+{
+    for (size_t i = 0; i < mFree.size(); i++)
+        delete[] mFree[i];
+}
+
+Tpx3Cluster* ClusterBlockPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFree.empty()) {
+            Tpx3Cluster* block = mFree.back();
+            mFree.pop_back();
+            return block;
+        }
+        mAllocated++;
+    }
+    return new Tpx3Cluster[TPX3_CLUSTER_BLOCK];
+}
+
+void ClusterBlockPool::release(Tpx3Cluster* block)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFree.push_back(block);
+}
+
+ClusterBuffer::ClusterBuffer(ClusterBuffer&& other)
+    : mPool(other.mPool)
+    , mBlocks(std::move(other.mBlocks))
+    , mUsed(other.mUsed)
+    , mSize(other.mSize)
+{
+    other.mBlocks.clear();
+    other.mUsed = TPX3_CLUSTER_BLOCK;
+    other.mSize = 0;
+}
+
+void ClusterBuffer::nextBlock()
+{
+    mBlocks.push_back(mPool ? mPool->acquire() : new Tpx3Cluster[TPX3_CLUSTER_BLOCK]);
+    mUsed = 0;
+}
+
+void ClusterBuffer::clear()
+{
+    for (size_t i = 0; i < mBlocks.size(); i++) {
+        if (mPool)
+            mPool->release(mBlocks[i]);
+        else
+            delete[] mBlocks[i];
+    }
+    // the block list keeps its capacity for the next shots
+    mBlocks.clear();
+    mUsed = TPX3_CLUSTER_BLOCK;
+    mSize = 0;
+}
+
+// ##########################################################################################33
+//                                     DISPATCH
+// ##########################################################################################33
+
+template <class Geometry, class Mode> class PixelKernelsImpl : public PixelKernels
+{
+public:
+    PixelKernelsImpl(const Geometry& geometry) : mGeometry(geometry) {}
+
+    unsigned width() const { return mGeometry.width(); }
+    unsigned height() const { return mGeometry.height(); }
+    bool hasToa() const { return Mode::hasToa; }
+    bool hasTot() const { return Mode::hasTot; }
+
+    void convert(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels) const
+    {
+        convertRawPixelsMode<Mode>(raw, count, pixels);
+    }
+
+    void selectRect(const Tpx3Pixel* pixels, unsigned count, unsigned x0, unsigned y0, unsigned x1, unsigned y1,
+                    float minTot, std::vector<unsigned>& out) const
+    {
+        selectPixelsInRect<Geometry, Mode>(mGeometry, pixels, count, x0, y0, x1, y1, minTot, out);
+    }
+
+    ShotClusterer* createClusterer(const ClusterParams& params) const
+    {
+        return new GeometryClusterer<Geometry, Mode>(params, mGeometry);
+    }
+
+private:
+    Geometry mGeometry;
+};
+
+template <class Mode> static PixelKernels* createModeKernels(unsigned width, unsigned height, unsigned chipCount)
+{
+    if (chipCount == 1 && width == TPX3_CHIP_WIDTH && height == TPX3_CHIP_HEIGHT)
+        return new PixelKernelsImpl<SingleChipGeometry, Mode>(SingleChipGeometry());
+    if (chipCount == 4 && width == 2 * TPX3_CHIP_WIDTH && height == 2 * TPX3_CHIP_HEIGHT)
+        return new PixelKernelsImpl<QuadGeometry, Mode>(QuadGeometry());
+    return new PixelKernelsImpl<MatrixGeometry, Mode>(MatrixGeometry(width, height));
+}
+
+PixelKernels* createPixelKernels(unsigned width, unsigned height, unsigned chipCount, int opMode)
+{
+    if (!width || !height)
+        return NULL;
+    switch (opMode) {
+    case PXC_TPX3_OPM_TOATOT:
+        return createModeKernels<ToaTotMode>(width, height, chipCount);
+    case PXC_TPX3_OPM_TOA:
+        return createModeKernels<ToaMode>(width, height, chipCount);
+    case PXC_TPX3_OPM_TOT_NOTOA:
+    case PXC_TPX3_OPM_EVENT_ITOT:
+        return createModeKernels<TotMode>(width, height, chipCount);
+    }
+    return NULL;
+}
+
+// the kernels used directly, without the dispatch
+template void convertRawPixelsMode<ToaTotMode>(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels);
+template class GeometryClusterer<SingleChipGeometry, ToaTotMode>;
+
+// ##########################################################################################33
+//                                    HISTOGRAMS
+// ##########################################################################################33
+
+TofHistogram::TofHistogram(double binWidth, double range)
+    : mBinWidth(binWidth)
+    , mInvBinWidth(1.0 / binWidth)
+    , mBins((size_t)(range / binWidth + 0.5), 0)
+{
+}
+
+void TofHistogram::fill(const Tpx3Pixel* pixels, unsigned count)
+{
+    u64 binCount = mBins.size();
+    for (unsigned i = 0; i < count; i++) {
+        double toa = pixels[i].toa;
+        if (toa < 0)
+            continue;
+        u64 bin = (u64)(toa * mInvBinWidth);
+        if (bin < binCount)
+            mBins[bin]++;
+    }
+}
+
+void TofHistogram::merge(const TofHistogram& other)
+{
+    size_t n = PXMIN(mBins.size(), other.mBins.size());
+    for (size_t i = 0; i < n; i++)
+        mBins[i] += other.mBins[i];
+}
+
+void TofHistogram::clear()
+{
+    std::fill(mBins.begin(), mBins.end(), 0);
+}
+
+TotImage::TotImage(unsigned width, unsigned height)
+    : mData(width * height, 0)
+{
+}
+
+void TotImage::fill(const Tpx3Pixel* pixels, unsigned count)
+{
+    size_t size = mData.size();
+    for (unsigned i = 0; i < count; i++)
+        if (pixels[i].index < size)
+            mData[pixels[i].index] += pixels[i].tot;
+}
+
+void TotImage::clear()
+{
+    std::fill(mData.begin(), mData.end(), 0);
+}
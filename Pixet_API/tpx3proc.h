@@ -0,0 +1,315 @@
+/**
+ * @file      tpx3proc.h
+ *
+ * Processing kernels for data driven Timepix3 pixels: raw pixel
+ * conversion, ToA rollover unwrapping, time sorting, shot segmentation,
+ * clustering/centroiding and histogramming. They do not call the SDK,
+ * so they run offline and in the benchmarks as well.
+ *
+ * The clustering follows centroid_shots from the centroiding notebook:
+ * hits of one shot within a time window of the seed hit that touch the
+ * cluster (8-neighbourhood) are added to it, the centroid is weighted by
+ * 1 / (t - t_seed + 1).
+ *
+ * The kernels with per hit coordinates or optional fields are templates
+ * on the detector geometry and the operation mode. The geometry gives the
+ * matrix size and the mapping of the pixel index to x/y at compile time
+ * (for the single chip and the quad a shift and a mask); the mode says
+ * which of ToA and ToT are measured, the kernels of a mode neither read
+ * nor compute a missing field:
+ *
+ *     PXC_TPX3_OPM_TOATOT      ToA and ToT
+ *     PXC_TPX3_OPM_TOA         ToA only
+ *     PXC_TPX3_OPM_TOT_NOTOA   ToT only (EVENT_ITOT likewise, no ToA)
+ *
+ * createPixelKernels() picks the specialization once at the start of a
+ * run, PixelKernels costs one virtual call per batch or shot.
+ *
+ * A clusterer is the working memory of one thread and is reused from shot
+ * to shot: the hits of a shot are labelled with an ever growing label
+ * instead of being cleared, the centroid of a cluster is summed up in fixed
+ * scratch, and the clusters go to blocks bump allocated from a pool that
+ * takes them back when the consumer is done. Once the largest shot has been
+ * seen, clustering does no heap allocation.
+ *
+ * The neighbours of the members come from a HitIndex (hitindex.h) over the
+ * unused hits of the time window of the seed, so a cluster costs its hits
+ * and their neighbours instead of sweeps over the whole window. The members
+ * are summed in the order the sweeps of the original algorithm found them,
+ * the results are the same.
+ *
+ */
+#ifndef TPX3PROC_H
+#define TPX3PROC_H
+#include "pxcapi.h"
+#include <mutex>
+#include <vector>
+
+class HitIndex;
+
+#define TPX3_CHIP_WIDTH         256
+#define TPX3_CHIP_HEIGHT        256
+#define TPX3_CLOCK_NS           25.0                        // coarse ToA clock period
+#define TPX3_FTOA_NS            (25.0 / 16.0)               // fine ToA step
+#define TPX3_TOA_PERIOD_NS      (1073741824.0 * 25.0)       // 2^30 clocks, ToA wraps every 26.84 s
+#define TPX3_CLUSTER_BLOCK      4096                        // clusters per output block
+
+typedef struct _Tpx3Cluster
+{
+    double toa;             // ToA of the seed hit (ns)
+    float x;                // centroid (pixels)
+    float y;
+    float tot;              // summed ToT
+    float spread;           // ToA range of the hits in the cluster (ns)
+    u32 shot;
+    u32 size;               // number of hits
+} Tpx3Cluster;
+
+// ##########################################################################################33
+//                                 GEOMETRY, OPERATION MODE
+// ##########################################################################################33
+
+// Matrix of a size known at compile time, index = y * Width + x
+template <unsigned Width, unsigned Height> struct FixedGeometry
+{
+    unsigned width() const { return Width; }
+    unsigned height() const { return Height; }
+    unsigned size() const { return Width * Height; }
+    unsigned x(u32 index) const { return index % Width; }
+    unsigned y(u32 index) const { return index / Width; }
+};
+
+typedef FixedGeometry<TPX3_CHIP_WIDTH, TPX3_CHIP_HEIGHT> SingleChipGeometry;
+typedef FixedGeometry<2 * TPX3_CHIP_WIDTH, 2 * TPX3_CHIP_HEIGHT> QuadGeometry;
+
+// Any other matrix (e.g. chips in a row), size known at run time only
+struct MatrixGeometry
+{
+    MatrixGeometry(unsigned width = TPX3_CHIP_WIDTH, unsigned height = TPX3_CHIP_HEIGHT) : mWidth(width), mHeight(height) {}
+    unsigned width() const { return mWidth; }
+    unsigned height() const { return mHeight; }
+    unsigned size() const { return mWidth * mHeight; }
+    unsigned x(u32 index) const { return index % mWidth; }
+    unsigned y(u32 index) const { return index / mWidth; }
+
+    unsigned mWidth;
+    unsigned mHeight;
+};
+
+// Fields measured in an operation mode
+template <bool Toa, bool Tot> struct Tpx3Mode
+{
+    static const bool hasToa = Toa;
+    static const bool hasTot = Tot;
+};
+
+typedef Tpx3Mode<true, true> ToaTotMode;
+typedef Tpx3Mode<true, false> ToaMode;
+typedef Tpx3Mode<false, true> TotMode;
+
+// ##########################################################################################33
+//                                       KERNELS
+// ##########################################################################################33
+
+// Converts raw pixels to pixels with ToA in ns (coarse * 25 ns - fine * 1.5625 ns), the fields
+// the mode does not measure are set to 0
+template <class Mode> void convertRawPixelsMode(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels);
+
+inline void convertRawPixels(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels)
+{
+    convertRawPixelsMode<ToaTotMode>(raw, count, pixels);
+}
+
+// Appends the positions of the pixels in the rectangle [x0, x1] x [y0, y1] with ToT >= minTot
+// (not checked when the mode has no ToT)
+template <class Geometry, class Mode>
+void selectPixelsInRect(const Geometry& geometry, const Tpx3Pixel* pixels, unsigned count, unsigned x0, unsigned y0,
+                        unsigned x1, unsigned y1, float minTot, std::vector<unsigned>& out);
+
+// Removes the ToA rollovers from a stream of batches, pixels may be slightly out of order
+class ToaUnwrapper
+{
+public:
+    ToaUnwrapper(double period = TPX3_TOA_PERIOD_NS);
+    void unwrap(Tpx3Pixel* pixels, unsigned count);
+    void reset() { mEpoch = 0; mLast = 0; mHasReference = false; }
+    // Starts the next batch in the epoch closest to the expected unwrapped ToA, lets independent
+    // parts of a run be unwrapped separately (the expectation has to be better than half the period)
+    void setReference(double expectedToa) { mReference = expectedToa; mHasReference = true; }
+    u64 rollovers() const { return mEpoch; }
+
+private:
+    double mPeriod;
+    u64 mEpoch;
+    double mLast;
+    double mReference;
+    bool mHasReference;
+};
+
+// Sorts the pixels by ToA (stable LSD radix sort on ToA in 1/64 ns), ToA has to be >= 0
+void sortPixelsByToa(Tpx3Pixel* pixels, unsigned count, std::vector<Tpx3Pixel>& scratch);
+
+// Splits time sorted pixels by ascending shot times. shotStarts[k] is index of the first pixel of shot k,
+// shotStarts[shotCount] = count. Pixels before the first shot are skipped.
+void segmentShots(const Tpx3Pixel* pixels, unsigned count, const double* shotTimes, unsigned shotCount, std::vector<unsigned>& shotStarts);
+
+typedef struct _ClusterParams
+{
+    double timeWindow;      // max ToA difference to the seed hit (ns)
+    double minToa;          // seeds are taken only from [minToa, maxToa] relative to the shot
+    double maxToa;
+    unsigned minSize;
+    unsigned maxSize;
+} ClusterParams;
+
+// Free output blocks of TPX3_CLUSTER_BLOCK clusters, shared by the threads
+class ClusterBlockPool
+{
+public:
+    ClusterBlockPool() : mAllocated(0) {}
+    ~ClusterBlockPool();
+
+    Tpx3Cluster* acquire();
+    void release(Tpx3Cluster* block);
+    // Blocks allocated so far, in use or free
+    size_t allocated() const { return mAllocated; }
+
+private:
+    std::mutex mMutex;
+    std::vector<Tpx3Cluster*> mFree;
+    size_t mAllocated;
+};
+
+// Clusters bump allocated in blocks, the blocks go back to the pool on clear (new/delete without a pool)
+class ClusterBuffer
+{
+public:
+    ClusterBuffer(ClusterBlockPool* pool = NULL) : mPool(pool), mUsed(TPX3_CLUSTER_BLOCK), mSize(0) {}
+    ClusterBuffer(ClusterBuffer&& other);
+    ~ClusterBuffer() { clear(); }
+
+    void push_back(const Tpx3Cluster& cluster)
+    {
+        if (mUsed == TPX3_CLUSTER_BLOCK)
+            nextBlock();
+        mBlocks.back()[mUsed++] = cluster;
+        mSize++;
+    }
+
+    size_t size() const { return mSize; }
+    unsigned blockCount() const { return (unsigned)mBlocks.size(); }
+    const Tpx3Cluster* block(unsigned index) const { return mBlocks[index]; }
+    unsigned blockSize(unsigned index) const { return index + 1 < mBlocks.size() ? TPX3_CLUSTER_BLOCK : mUsed; }
+    void clear();
+
+private:
+    ClusterBuffer(const ClusterBuffer&);
+    ClusterBuffer& operator=(const ClusterBuffer&);
+    void nextBlock();
+
+    ClusterBlockPool* mPool;
+    std::vector<Tpx3Cluster*> mBlocks;
+    unsigned mUsed;                 // clusters in the last block
+    size_t mSize;
+};
+
+class ShotClusterer
+{
+public:
+    virtual ~ShotClusterer() {}
+
+    // Clusters one shot of time sorted pixels with ToA relative to the shot, appends the clusters to out.
+    // Returns number of clusters added.
+    virtual unsigned clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, std::vector<Tpx3Cluster>& out) = 0;
+    virtual unsigned clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, ClusterBuffer& out) = 0;
+};
+
+// Without ToA all hits of a shot are one time window, every hit is a seed and the centroid is not
+// weighted; without ToT the summed ToT is 0. One clusterer per thread.
+template <class Geometry, class Mode> class GeometryClusterer : public ShotClusterer
+{
+public:
+    GeometryClusterer(const ClusterParams& params, const Geometry& geometry = Geometry());
+    ~GeometryClusterer();
+
+    unsigned clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, std::vector<Tpx3Cluster>& out);
+    unsigned clusterShot(const Tpx3Pixel* pixels, unsigned count, u32 shot, ClusterBuffer& out);
+    // Sizes the scratch for shots of up to hits pixels ahead of time
+    void reserve(unsigned hits);
+
+    const ClusterParams& params() const { return mParams; }
+
+private:
+    GeometryClusterer(const GeometryClusterer&);
+    GeometryClusterer& operator=(const GeometryClusterer&);
+    template <class Output> unsigned cluster(const Tpx3Pixel* pixels, unsigned count, u32 shot, Output& out);
+
+    ClusterParams mParams;
+    Geometry mGeometry;
+    HitIndex* mIndex;               // unused hits after the seed up to the end of its window
+    std::vector<u32> mHitLabel;     // label of every hit of the shot, a label from before the shot = unused
+    std::vector<u32> mHitPass;      // sweep of the original algorithm that finds the hit
+    std::vector<unsigned> mMembers; // scratch of the current cluster
+    std::vector<unsigned> mLevel;
+    std::vector<unsigned> mNextLevel;
+    std::vector<u64> mFound;
+    u32 mLabel;                     // last label given
+};
+
+typedef GeometryClusterer<SingleChipGeometry, ToaTotMode> HitClusterer;
+
+// The kernels for the geometry and mode of a run
+class PixelKernels
+{
+public:
+    virtual ~PixelKernels() {}
+
+    virtual unsigned width() const = 0;
+    virtual unsigned height() const = 0;
+    virtual bool hasToa() const = 0;
+    virtual bool hasTot() const = 0;
+
+    virtual void convert(const RawTpx3Pixel* raw, unsigned count, Tpx3Pixel* pixels) const = 0;
+    virtual void selectRect(const Tpx3Pixel* pixels, unsigned count, unsigned x0, unsigned y0, unsigned x1, unsigned y1,
+                            float minTot, std::vector<unsigned>& out) const = 0;
+    // A clusterer for one thread, the caller deletes it
+    virtual ShotClusterer* createClusterer(const ClusterParams& params) const = 0;
+};
+
+// Kernels for a width x height matrix of chipCount chips measured in opMode (PXC_TPX3_OPM_xx),
+// NULL when the mode is not known. The caller deletes them.
+PixelKernels* createPixelKernels(unsigned width, unsigned height, unsigned chipCount, int opMode);
+
+// ToF spectrum with fixed bins over [0, range) ns
+class TofHistogram
+{
+public:
+    TofHistogram(double binWidth, double range);
+    // pixels with ToA relative to their shot
+    void fill(const Tpx3Pixel* pixels, unsigned count);
+    void merge(const TofHistogram& other);
+    void clear();
+    const std::vector<u64>& bins() const { return mBins; }
+    std::vector<u64>& bins() { return mBins; }
+    double binWidth() const { return mBinWidth; }
+
+private:
+    double mBinWidth;
+    double mInvBinWidth;
+    std::vector<u64> mBins;
+};
+
+// Summed ToT per pixel
+class TotImage
+{
+public:
+    TotImage(unsigned width = TPX3_CHIP_WIDTH, unsigned height = TPX3_CHIP_HEIGHT);
+    void fill(const Tpx3Pixel* pixels, unsigned count);
+    void clear();
+    const std::vector<double>& data() const { return mData; }
+
+private:
+    std::vector<double> mData;
+};
+
+#endif /* end of include guard: TPX3PROC_H */
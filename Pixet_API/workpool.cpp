@@ -0,0 +1,154 @@
+/**
+ * @file      workpool.cpp
+ *
+ * Work-stealing thread pool.
+ *
+ */
+#include "workpool.h"
+#include <cassert>
+
+#ifdef _MSC_VER
+#define WORKPOOL_TLS    __declspec(thread)
+#else
+#define WORKPOOL_TLS    __thread
+#endif
+
+static WORKPOOL_TLS int tWorkerIndex = -1;
+static WORKPOOL_TLS const WorkStealingPool* tWorkerPool = NULL;
+
+WorkStealingPool::WorkStealingPool()
+    : mPending(0)
+    , mNext(0)
+    , mRunning(false)
+    , mTasksRun(0)
+    , mSteals(0)
+{
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    stop();
+}
+
+void WorkStealingPool::start(unsigned threadCount)
+{
+    if (mRunning)
+        return;
+    if (!threadCount)
+        threadCount = PXMAX(std::thread::hardware_concurrency(), 1u);
+    mRunning = true;
+    for (unsigned i = 0; i < threadCount; i++)
+        mWorkers.push_back(new Worker());
+    for (unsigned i = 0; i < threadCount; i++)
+        mThreads.push_back(std::thread(&WorkStealingPool::loop, this, i));
+}
+
+void WorkStealingPool::stop()
+{
+    if (!mRunning)
+        return;
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mWake.notify_all();
+    for (size_t i = 0; i < mThreads.size(); i++)
+        mThreads[i].join();
+    mThreads.clear();
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        delete mWorkers[i];
+    mWorkers.clear();
+}
+
+int WorkStealingPool::workerIndex() const
+{
+    return tWorkerPool == this ? tWorkerIndex : -1;
+}
+
+void WorkStealingPool::submit(const Task& task)
+{
+    if (mWorkers.empty()) {
+        task();
+        mTasksRun++;
+        return;
+    }
+    int self = workerIndex();
+    unsigned index = self >= 0 ? (unsigned)self : mNext++ % (unsigned)mWorkers.size();
+    mPending++;
+    {
+        std::lock_guard<std::mutex> lock(mWorkers[index]->mutex);
+        mWorkers[index]->tasks.push_back(task);
+    }
+    // taking mMutex orders the push before a worker that is about to sleep checks for tasks
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+    }
+    mWake.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+    assert(workerIndex() < 0 && "WorkStealingPool::wait() called from a worker");
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdle.wait(lock, [this] { return mPending.load() == 0; });
+}
+
+bool WorkStealingPool::takeTask(unsigned index, Task& task)
+{
+    // own deque from the back
+    {
+        Worker* w = mWorkers[index];
+        std::lock_guard<std::mutex> lock(w->mutex);
+        if (!w->tasks.empty()) {
+            task = w->tasks.back();
+            w->tasks.pop_back();
+            return true;
+        }
+    }
+    // steal from the front of the others, starting at the next worker
+    unsigned count = (unsigned)mWorkers.size();
+    for (unsigned k = 1; k < count; k++) {
+        Worker* w = mWorkers[(index + k) % count];
+        std::lock_guard<std::mutex> lock(w->mutex);
+        if (!w->tasks.empty()) {
+            task = w->tasks.front();
+            w->tasks.pop_front();
+            mSteals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::loop(unsigned index)
+{
+    tWorkerIndex = (int)index;
+    tWorkerPool = this;
+    Task task;
+    while (true) {
+        if (takeTask(index, task)) {
+            task();
+            task = Task();
+            mTasksRun++;
+            if (--mPending == 0) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mIdle.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (!mRunning)
+            break;
+        // recheck under the lock, a submit in between would otherwise be missed
+        bool queued = false;
+        for (size_t i = 0; i < mWorkers.size() && !queued; i++) {
+            std::lock_guard<std::mutex> wl(mWorkers[i]->mutex);
+            queued = !mWorkers[i]->tasks.empty();
+        }
+        if (!queued)
+            mWake.wait(lock);
+    }
+    tWorkerIndex = -1;
+    tWorkerPool = NULL;
+}
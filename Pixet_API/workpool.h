@@ -0,0 +1,71 @@
+/**
+ * @file      workpool.h
+ *
+ * Work-stealing thread pool. Every worker has its own task deque: it
+ * pushes the tasks it spawns to the back and takes its next task from the
+ * back too (newest first, the data is still in cache), idle workers steal
+ * the oldest task from the front of another worker's deque. Tasks
+ * submitted from outside the pool are spread round-robin.
+ *
+ */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    WorkStealingPool();
+    ~WorkStealingPool();
+
+    // threadCount 0 = number of cores
+    void start(unsigned threadCount = 0);
+    // Waits for all tasks and stops the workers
+    void stop();
+
+    // Queues a task, from a worker it goes to the worker's own deque.
+    // A pool that is not started runs the task in the calling thread.
+    void submit(const Task& task);
+    // Blocks until there are no queued or running tasks. Must not be called
+    // from a worker: its own running task never finishes, so it would never return.
+    void wait();
+
+    unsigned threadCount() const { return (unsigned)mWorkers.size(); }
+    // Index of the calling worker, -1 outside the pool
+    int workerIndex() const;
+
+    u64 tasksRun() const { return mTasksRun.load(); }
+    u64 steals() const { return mSteals.load(); }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void loop(unsigned index);
+    bool takeTask(unsigned index, Task& task);
+
+    std::vector<Worker*> mWorkers;
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mIdle;
+    std::atomic<u64> mPending;      // queued + running tasks
+    std::atomic<unsigned> mNext;
+    std::atomic<bool> mRunning;
+    std::atomic<u64> mTasksRun;
+    std::atomic<u64> mSteals;
+};
+
+#endif /* end of include guard: WORKPOOL_H */
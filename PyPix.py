@@ -6,6 +6,7 @@ import scipy.stats as stats
 from scipy.ndimage import label, center_of_mass
 import h5py
 import time
+import threading
 from PyQt6 import uic, QtWidgets, QtCore, QtGui
 import pyqtgraph as pg
 from pyqtgraph.widgets.RawImageWidget import RawImageWidget
@@ -25,6 +26,162 @@ if pypixet.start() != 0:
     exit()
 pixet = pypixet.pixet
 
+class HitPrefilter():
+    '''
+    Prefilter applied to every data-driven batch before it is saved or analysed.\n
+    A hit is kept if it lies inside the ROI (union of rectangles and bitmaps, everything\n
+    if no ROI is set), has a ToT in [min_tot, max_tot] and arrives in [min_time, max_time) ns\n
+    after its shot. All predicates are evaluated with numpy over the whole batch.\n
+    The ROI/ToT gates (pixel_mask) are applied as soon as the batch is read, so the ROI has\n
+    to contain the LED. The ToA gate (time_mask) needs the shot times and is applied once\n
+    the shots are found; without the LED there are no shots and it is not applied.
+    '''
+    def __init__(self, min_time=0, max_time=50000, min_tot=0, max_tot=1022, width=256, height=256) -> None:
+        self.min_time = min_time
+        self.max_time = max_time
+        self.min_tot  = min_tot
+        self.max_tot  = max_tot
+        self.width    = width
+        self.height   = height
+        self.roi      = None # Flat boolean mask indexed by pixel index
+        self.hits_in  = 0
+        self.hits_out = 0
+
+    def add_roi_rect(self, x0, y0, x1, y1) -> None:
+        '''Add an inclusive rectangle of pixels to the ROI.'''
+        if self.roi is None: self.roi = np.zeros(self.width * self.height, dtype=bool)
+        roi = self.roi.reshape((self.height, self.width))
+        roi[y0:y1+1, x0:x1+1] = True
+
+    def add_roi_bitmap(self, bitmap) -> None:
+        '''Add a (height, width) bitmap to the ROI, nonzero pixels are kept.'''
+        if self.roi is None: self.roi = np.zeros(self.width * self.height, dtype=bool)
+        self.roi |= np.asarray(bitmap).reshape(-1) != 0
+
+    def clear_roi(self) -> None:
+        self.roi = None
+
+    def pixel_mask(self, Idx, ToT) -> np.ndarray:
+        '''Return the boolean mask of hits inside the ROI and the ToT range.'''
+        keep = (ToT >= self.min_tot) & (ToT <= self.max_tot)
+        if self.roi is not None:
+            keep &= self.roi[Idx]
+        self.hits_in  += keep.shape[0]
+        self.hits_out += np.count_nonzero(keep)
+        return keep
+
+    def relative_times(self, ToA, shot_times):
+        '''
+        Return the ToA relative to the latest shot before each hit and the mask of hits after the first shot.
+        '''
+        if len(shot_times) == 0:
+            return ToA, np.zeros(ToA.shape[0], dtype=bool)
+        shot_times = np.sort(shot_times)
+        shot = np.searchsorted(shot_times, ToA, side='right') - 1
+        return ToA - shot_times[np.maximum(shot, 0)], shot >= 0
+
+    def time_mask(self, ToA, shot_times) -> np.ndarray:
+        '''
+        Return the boolean mask of hits inside the ToA gate.\n
+        ToA is gated relative to the latest shot before each hit, hits before the first shot are dropped.
+        '''
+        times, after_shot = self.relative_times(ToA, shot_times)
+        keep = after_shot & (self.min_time <= times) & (times < self.max_time)
+        self.hits_out -= keep.shape[0] - np.count_nonzero(keep)
+        return keep
+
+class PreviewPublisher():
+    '''
+    Rate-limited, triple-buffered hand-over of preview data from the acquisition thread to the GUI.\n
+    The producer fills the back slot and swaps it with the middle slot, the GUI timer swaps the middle\n
+    slot with the front slot only when something new arrived. Swaps are index exchanges under a lock,\n
+    so neither side waits on the other and older snapshots are simply overwritten (latest wins).\n
+    Images are binned and converted to u8/u16 display data in the producer at most refresh_rate times\n
+    per second, so the preview costs the same whatever the hit rate. The last update held back by the\n
+    rate limit is kept and published by flush() at the end of the run, so the final state is shown.
+    '''
+    def __init__(self, shape=None, dtype=np.uint8, refresh_rate=20.0, binning=1) -> None:
+        self.dtype        = dtype
+        self.refresh_rate = refresh_rate
+        self.binning      = binning
+        if shape is not None:
+            shape = (shape[0] // binning, shape[1] // binning)
+            self._buffers = [np.zeros(shape, dtype=dtype) for _ in range(3)]
+        else:
+            self._buffers = [None, None, None]
+        self._meta    = [None, None, None]
+        self._back, self._middle, self._front = 0, 1, 2
+        self._fresh   = False
+        self._lock    = threading.Lock()
+        self._last    = 0.0
+        self._pending = None # Last update held back by the rate limit, (method, args)
+        self.published = 0 # Snapshots handed to the middle slot
+        self.skipped   = 0 # Updates dropped by the rate limit
+        self.replaced  = 0 # Snapshots overwritten before the GUI took them
+
+    def due(self) -> bool:
+        '''True if enough time passed since the last snapshot to publish another one.'''
+        now = time.perf_counter()
+        if now - self._last < 1.0 / self.refresh_rate:
+            self.skipped += 1
+            return False
+        self._last = now
+        return True
+
+    def _swap_back(self) -> None:
+        with self._lock:
+            self._back, self._middle = self._middle, self._back
+            if self._fresh: self.replaced += 1
+            self._fresh = True
+        self.published += 1
+
+    def flush(self) -> None:
+        '''Publish the last update held back by the rate limit, if any.'''
+        if self._pending is None: return
+        method, args = self._pending
+        method(*args, force=True)
+
+    def publish(self, value, meta=None, force=False) -> None:
+        '''Publish an arbitrary object (e.g. a spectrum) as the latest snapshot.'''
+        if not force and not self.due():
+            self._pending = (self.publish, (value, meta))
+            return
+        self._pending = None
+        self._buffers[self._back] = value
+        self._meta[self._back] = meta
+        self._swap_back()
+
+    def publish_image(self, image, led, radius=15, force=False) -> None:
+        '''
+        Publish a ToT image normalised to the maximum around the LED (or the whole image if no LED).\n
+        The image is binned and written into the preallocated back buffer as display data.
+        '''
+        if not force and not self.due():
+            self._pending = (self.publish_image, (image, led, radius))
+            return
+        self._pending = None
+        b = self.binning
+        if b > 1:
+            h, w = self._buffers[self._back].shape
+            image = image[:h*b, :w*b].reshape(h, b, w, b).max(axis=(1, 3))
+        maximum = 0
+        if led[0] is not False:
+            lx, ly, r = led[0] // b, led[1] // b, max(radius // b, 1)
+            maximum = np.max(image[max(lx-r, 0):lx+r, max(ly-r, 0):ly+r], initial=0)
+        if maximum == 0: maximum = max(np.max(image), 1)
+        top = np.iinfo(self.dtype).max
+        np.multiply(np.minimum(image, maximum), top / maximum, out=self._buffers[self._back], casting='unsafe')
+        self._meta[self._back] = led
+        self._swap_back()
+
+    def take(self):
+        '''Return (value, meta) of the newest snapshot, or None if nothing new was published.'''
+        with self._lock:
+            if not self._fresh: return None
+            self._middle, self._front = self._front, self._middle
+            self._fresh = False
+        return self._buffers[self._front], self._meta[self._front]
+
 class ImageAcquisitionThread(QtCore.QThread):
     '''
     Thread for getting images from Timepix.
@@ -34,10 +191,6 @@ class ImageAcquisitionThread(QtCore.QThread):
     '''Emit signal when end of acquisition reached'''
     progress = QtCore.pyqtSignal(list)               
     '''Emit current progress on delay stage position'''
-    tot_signal = QtCore.pyqtSignal(list)
-    '''Emit tot image and LED location'''
-    toa_spectrum_signal = QtCore.pyqtSignal(np.ndarray)
-    '''Emit toa times and intensities'''
 
     def __init__(self, parent=None) -> None:
         QtCore.QThread.__init__(self, parent)
@@ -46,6 +199,9 @@ class ImageAcquisitionThread(QtCore.QThread):
         self.start_time : float = 1.00
         self.iter       : int = parent._iterations.value()
         self.device = parent.device
+        self.prefilter = HitPrefilter()
+        self.tot_preview = parent.tot_preview_
+        self.tof_preview = parent.tof_preview_
 
         #Create a filename for saving data
         filename = os.path.join(parent._dir_name.text(),parent._file_name.text())
@@ -64,6 +220,15 @@ class ImageAcquisitionThread(QtCore.QThread):
         hf.create_group('ToA')
         hf.close()
 
+    def save_data(self, current_time, Idx, ToT, ToA, keep) -> None:
+        '''Append the hits selected by keep to the save file.'''
+        if not self.saving: return
+        hf = h5py.File(self.filename, 'a')
+        hf['Index'].create_dataset(f'{current_time}', data=Idx[keep], compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
+        hf['ToT'].create_dataset(f'{current_time}', data=ToT[keep], compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
+        hf['ToA'].create_dataset(f'{current_time}', data=ToA[keep], compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
+        hf.close()
+
     def new_data(self, unused):
         '''Function is called each time datadriven mode dumps to memory.'''
         current_time = round(time.time()-self.start_time,2)
@@ -79,15 +244,12 @@ class ImageAcquisitionThread(QtCore.QThread):
         ToT = np.array(pixelsRaw[4], dtype=np.uint16)
         Idx = np.array(pixelsRaw[0], dtype=np.uint16)
         ToA = np.array(pixelsData[1], dtype=float)
+        # ROI and ToT gates first, the analysis below only sees the hits that pass them
+        keep = self.prefilter.pixel_mask(Idx, ToT)
+        Idx, ToT, ToA = Idx[keep], ToT[keep], ToA[keep]
         if ToA.shape[0] == 0:
             return
-        # Save data
-        if self.saving:
-            hf = h5py.File(self.filename, 'a')
-            hf['Index'].create_dataset(f'{current_time}', data=Idx, compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
-            hf['ToT'].create_dataset(f'{current_time}', data=ToT, compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
-            hf['ToA'].create_dataset(f'{current_time}', data=ToA, compression="gzip", compression_opts=4, shuffle=True, fletcher32=True)
-            hf.close()
+        rawToA = np.copy(ToA)                              # Keep the raw ToA for saving
 
         # Get image data, find coordinate data and adjust ToA values if required
         x = np.array(Idx %  256, dtype=np.uint8)           # Calculate x positions
@@ -122,10 +284,12 @@ class ImageAcquisitionThread(QtCore.QThread):
         coms = (np.round(center_of_mass(image, labels[0], list_of_labels))).astype(int) # Get the center of masses as ints
         if len(coms) == 0: 
             coms = [[False,False]]                                                      # If LED not found pass null value
-            self.tot_signal.emit([image, coms[0]])                                      # Emit the ToT image and false LED location
+            self.tot_preview.publish_image(image, coms[0])                              # Publish the ToT image and false LED location
+            # No shot times without the LED, the batch is saved with the ROI/ToT gates only
+            self.save_data(current_time, Idx, ToT, rawToA, np.ones(ToA.shape[0], dtype=bool))
             return
         else:
-            self.tot_signal.emit([image, coms[0]])                                      # Emit the ToT image and the LED location
+            self.tot_preview.publish_image(image, coms[0])                              # Publish the ToT image and the LED location
         
         # After sending the ToT data we now want to roughly find t0 and slice data
         com = coms[0]                                    # Get the first index of com
@@ -155,44 +319,15 @@ class ImageAcquisitionThread(QtCore.QThread):
         # Find the lowest value in each cluster
         shot_times = np.array([min(clusters[cluster_index]) for cluster_index in clusters])
 
-        ToA_data = {}
-        start_idx = 0
-        min_time = 0
-        max_time = 50000
-
-        for index in range(len(shot_times)+1):
-            # For the last laser trigger there is no next trigger, set ending to end of array
-            try:
-                timing = shot_times[index]
-                slice_end_idx = np.searchsorted(ToA, timing, side='right')
-            except:
-                slice_end_idx = -1
-            # The 1st index is data before the first trigger pulse
-            if index == 0:
-                start_idx = slice_end_idx
-                continue
-            # Get the times that correspond to the laser pulse
-            times = np.copy(ToA[start_idx:slice_end_idx])
-            # Ignore the loop of no data in it
-            if len(times) == 0: continue
-            # Set time to be relative for each pulse
-            times -= np.min(times)
-            # Remove laser pulse data and noise outside of thresholds
-            not_noise = np.where((min_time < times) & (times < max_time))[0]
-            if len(not_noise) == 0: continue
-            temp_toa = times[not_noise]
-            toa_counts, toa_times = np.unique(temp_toa, return_counts=True)
-            for index, ut in enumerate(toa_times):
-                if ut not in ToA_data:
-                    ToA_data[ut] = toa_counts[index]
-                else:
-                    ToA_data[ut] += toa_counts[index]
-            start_idx = slice_end_idx
-        x_toa = np.array([ToA_data[x] for x in ToA_data])
-        y_toa = np.array([x for x in ToA_data])
-        toa_array = np.vstack((x_toa, y_toa)).T
-        toa_array = toa_array[toa_array[:, 0].argsort()]   # Make a verticle 2d array
-        self.toa_spectrum_signal.emit(toa_array)
+        # Save only the hits inside the ToA gate, the ToF spectrum is made of the same hits
+        keep = self.prefilter.time_mask(ToA, shot_times)
+        self.save_data(current_time, Idx, ToT, rawToA, keep)
+
+        # ToF of every kept hit relative to its shot, rows of [ToF, counts] sorted by ToF
+        times = self.prefilter.relative_times(ToA[keep], shot_times)[0]
+        tof, counts = np.unique(times, return_counts=True)
+        toa_array = np.vstack((tof, counts)).T
+        self.tof_preview.publish(toa_array)
 
     def run(self) -> None:
         '''Ask the camera for image arrays.'''
@@ -203,6 +338,9 @@ class ImageAcquisitionThread(QtCore.QThread):
         self.device.registerEvent(pixet.PX_EVENT_ACQ_NEW_DATA, 0, self.new_data)
         rc = self.device.doAdvancedAcquisition(self.iter, self.run_time, pixet.PX_ACQTYPE_DATADRIVEN, pixet.PX_ACQMODE_NORMAL, pixet.PX_FTYPE_AUTODETECT, 0, "")
         self.device.unregisterEvent(pixet.PX_EVENT_ACQ_NEW_DATA, 0, self.new_data)
+        # The last snapshots of the run may have been held back by the rate limit
+        self.tot_preview.flush()
+        self.tof_preview.flush()
         self.finished.emit()
 
     def stop(self) -> None:
@@ -336,6 +474,13 @@ class MainWindow(QtWidgets.QMainWindow):
         self.tot_expanded_ = False          # Is the ToT Image popped out?
         self.rotation_     = 0              # Rotation angle of the image
 
+        # Previews are published by the acquisition thread and drawn by a timer at a fixed rate
+        self.tot_preview_ = PreviewPublisher((256,256), dtype=np.uint8, refresh_rate=20.0)
+        self.tof_preview_ = PreviewPublisher(refresh_rate=20.0)
+        self.preview_timer_ = QtCore.QTimer(self)
+        self.preview_timer_.setInterval(int(1000 / self.tot_preview_.refresh_rate))
+        self.preview_timer_.timeout.connect(self.update_previews)
+
         #Call the class responsible for plot drawing and functions
         self.ui_plots = UI_Plots(self)
 
@@ -362,23 +507,26 @@ class MainWindow(QtWidgets.QMainWindow):
         self._progressBar.setFormat(value[1])
         self.camera_temperature()
 
-    def update_tot(self, value : list) -> None:
-        image = value[0]
-        led = value[1]
-        radius = 15
-        try: maximum = np.max(image[led[0]-radius:led[0]+radius,led[1]-radius:led[1]+radius]) # Get the maximum value of the led pixels
-        except ValueError: maximum = np.max(image)
-        image = np.array((image / maximum) * 255, dtype=int)
-        overflow = np.where(image > 255)
-        image[overflow] = 255
-        if type(led[0]) != False:
-            x1 = np.array([[led[0] - radius, led[1] - c] for c in range(-radius,radius+1)])
-            y1 = np.array([[led[0] - c, led[1] - radius] for c in range(-radius,radius+1)])
-            x2 = np.array([[led[0] + radius, led[1] - c] for c in range(-radius,radius+1)])
-            y2 = np.array([[led[0] - c, led[1] + radius] for c in range(-radius,radius+1)])
-            square = np.vstack((x1,y1,x2,y2))
-            image[square[:,0], square[:,1]] = 255
-        self.ToT_view_.setImage(image, levels=[0,255])
+    def update_previews(self) -> None:
+        '''Draw the newest preview snapshots, called by the preview timer.'''
+        tot = self.tot_preview_.take()
+        if tot is not None: self.update_tot(tot[0], tot[1])
+        tof = self.tof_preview_.take()
+        if tof is not None: self.update_toa_spectrum(tof[0])
+
+    def update_tot(self, image : np.ndarray, led : list) -> None:
+        '''Draw the ToT display image with a square around the LED.'''
+        top = np.iinfo(image.dtype).max
+        b = self.tot_preview_.binning
+        radius = max(15 // b, 1)
+        image = np.copy(image)                             # The front buffer goes back to the producer on the next take()
+        if led[0] is not False:
+            lx, ly = led[0] // b, led[1] // b
+            h, w = image.shape
+            x0, x1, y0, y1 = max(lx-radius, 0), min(lx+radius, h-1), max(ly-radius, 0), min(ly+radius, w-1)
+            image[x0:x1+1, [y0, y1]] = top
+            image[[x0, x1], y0:y1+1] = top
+        self.ToT_view_.setImage(image, levels=[0,top])
 
     def update_toa_spectrum(self, value: list) -> None:
         self.tof_plot_line.setData(value)
@@ -480,11 +628,10 @@ class MainWindow(QtWidgets.QMainWindow):
         else:
             thread = ImageAcquisitionThread(self)
             thread.progress.connect(self.update_pb)
-            thread.tot_signal.connect(self.update_tot)
-            thread.toa_spectrum_signal.connect(self.update_toa_spectrum)
             thread.finished.connect(self.camera_finished)
             self.acquisition_thread = thread
             self.acquisition_thread.start()
+            self.preview_timer_.start()
             self.running = True
             self._button.setText("Stop")
 
@@ -492,6 +639,8 @@ class MainWindow(QtWidgets.QMainWindow):
         self.running = False
         self._button.setText("Start")
         self.acquisition_thread.wait()
+        self.preview_timer_.stop()
+        self.update_previews()
         del self.acquisition_thread
         self._button.setEnabled(True)
 